@@ -10,7 +10,31 @@
 #define LuaPlusLite_LuaPlusLite_h
 
 // C++ Standard Library Includes:
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <string>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// C Standard Library Includes:
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 // Lua Includes:
 #include <lua.hpp>
@@ -19,6 +43,14 @@
 #define LuaPlusLite__ToXYZ_methods_convert_internal_value_types 0
 #define LuaPlusLite__IsString_and_IsNumber_only_match_explicitly 0
 
+// When set to 0, luapluslite_assert checks are compiled out entirely, and
+// misuse of the API (such as calling SetInteger on a non-table) results in
+// undefined behavior rather than a LuaException.  The TryTo* accessors
+// report failed conversions without throwing, whichever mode is chosen.
+#ifndef LuaPlusLite__assertions_throw_exceptions
+#define LuaPlusLite__assertions_throw_exceptions 1
+#endif
+
 namespace LuaPlusLite {
 #if defined(__clang__) || defined(__GNUC__)
 #pragma mark - Error Reporting
@@ -42,40 +74,706 @@ namespace LuaPlusLite {
 		std::string message_;
 	};
 
+	// Builds and throws the exception for a failed luapluslite_assert.  This
+	// is kept out of line so that the check left in each accessor is just a
+	// compare and a branch.
+#if defined(__clang__) || defined(__GNUC__)
+	__attribute__((noinline, noreturn))
+#elif defined(_MSC_VER)
+	__declspec(noinline) __declspec(noreturn)
+#endif
+	inline void LuaAssertionFailed(const char * function, const char * expression, const std::string & message) {
+		std::string what = std::string("assertion failed in ") + function + ": (" + expression + ")";
+		if ( ! message.empty()) {
+			what += "; " + message;
+		}
+		throw LuaException(what);
+	}
+
 #if defined(__clang__) || defined(__GNUC__)
-	#define luapluslite_assert(expression) if (!(expression)) { throw LuaException(std::string("assertion failed in ") + __PRETTY_FUNCTION__ + ": (" + #expression + ")"); }
-	#define luapluslite_assert_ex(expression, message) if (!(expression)) { throw LuaException(std::string("assertion failed in ") + __PRETTY_FUNCTION__ + ": (" + #expression + "); " + message); }
+	#define luapluslite_function_name __PRETTY_FUNCTION__
+	#define luapluslite_likely(expression) __builtin_expect(!!(expression), 1)
 #elif defined(_MSC_VER)
-	#define luapluslite_assert(expression) if (!(expression)) { throw LuaException(std::string("assertion failed in ") + __FUNCSIG__ + ": (" + #expression + ")"); }
-	#define luapluslite_assert_ex(expression, message) if (!(expression)) { throw LuaException(std::string("assertion failed in ") + __FUNCSIG__ + ": (" + #expression + "); " + message); }
+	#define luapluslite_function_name __FUNCSIG__
+	#define luapluslite_likely(expression) (expression)
+#else
+	#define luapluslite_function_name __FUNCTION__
+	#define luapluslite_likely(expression) (expression)
+#endif
+
+#if LuaPlusLite__assertions_throw_exceptions == 1
+	#define luapluslite_assert(expression) if (luapluslite_likely(expression)) {} else LuaAssertionFailed(luapluslite_function_name, #expression, std::string())
+	#define luapluslite_assert_ex(expression, message) if (luapluslite_likely(expression)) {} else LuaAssertionFailed(luapluslite_function_name, #expression, message)
 #else
-	#define luapluslite_assert(expression) if (!(expression)) { throw LuaException(std::string("assertion failed in ") + __FUNCTION__ + ": (" + #expression + ")"); }
-	#define luapluslite_assert_ex(expression, message) if (!(expression)) { throw LuaException(std::string("assertion failed in ") + __FUNCTION__ + ": (" + #expression + "); " + message); }
+	#define luapluslite_assert(expression) ((void)0)
+	#define luapluslite_assert_ex(expression, message) ((void)0)
+#endif
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - LuaPoolAllocator
+#endif
+
+	static const size_t LUAPLUSLITE_POOL_GRANULARITY = 16;
+	static const size_t LUAPLUSLITE_POOL_MAX_BLOCK_SIZE = 256;
+	static const size_t LUAPLUSLITE_POOL_NUM_CLASSES = LUAPLUSLITE_POOL_MAX_BLOCK_SIZE / LUAPLUSLITE_POOL_GRANULARITY;
+	static const size_t LUAPLUSLITE_POOL_CHUNK_SIZE = 16 * 1024;
+	
+	// A lua_Alloc built on per-size-class free lists.  Blocks of up to
+	// LUAPLUSLITE_POOL_MAX_BLOCK_SIZE bytes are rounded up to a multiple of
+	// LUAPLUSLITE_POOL_GRANULARITY and carved out of large chunks, which
+	// suits the many small strings, tables, closures and upvalues a Lua
+	// program creates.  Larger blocks go to malloc.
+	//
+	// Chunks are only returned to the system when the allocator is
+	// destroyed, so it must outlive every lua_State that uses it.  A
+	// LuaPoolAllocator is not thread-safe.
+	class LuaPoolAllocator {
+	public:
+		struct ClassStats {
+			size_t block_size;
+			size_t allocations;		// Total number of blocks handed out.
+			size_t blocks_in_use;
+			size_t blocks_reserved;	// Blocks carved out of chunks so far.
+		};
+		
+		LuaPoolAllocator() : large_allocations_(0), large_bytes_in_use_(0), small_malloc_blocks_(0), kept_pool_blocks_(0), chunk_limit_(0) {
+			for (size_t i = 0; i < LUAPLUSLITE_POOL_NUM_CLASSES; ++i) {
+				free_lists_[i] = NULL;
+				ClassStats stats = { (i + 1) * LUAPLUSLITE_POOL_GRANULARITY, 0, 0, 0 };
+				stats_[i] = stats;
+			}
+		}
+		
+		~LuaPoolAllocator() {
+			for (size_t i = 0; i < chunks_.size(); ++i) {
+				free(chunks_[i].memory);
+			}
+		}
+		
+		// The lua_Alloc entry point.  'ud' must point to a LuaPoolAllocator.
+		static void * Alloc(void * ud, void * ptr, size_t osize, size_t nsize) {
+			return static_cast<LuaPoolAllocator *>(ud)->Realloc(ptr, osize, nsize);
+		}
+		
+		void * Realloc(void * ptr, size_t osize, size_t nsize) {
+			if (ptr == NULL) {
+				// 'osize' holds the type of the object being created.
+				osize = 0;
+			}
+			if (nsize == 0) {
+				Free(ptr, osize);
+				return NULL;
+			}
+			if (ptr != NULL) {
+				if (osize > LUAPLUSLITE_POOL_MAX_BLOCK_SIZE && nsize > LUAPLUSLITE_POOL_MAX_BLOCK_SIZE) {
+					void * block = realloc(ptr, nsize);
+					if (block != NULL) {
+						large_bytes_in_use_ += nsize;
+						large_bytes_in_use_ -= osize;
+					}
+					return block;
+				}
+				if (nsize <= LUAPLUSLITE_POOL_MAX_BLOCK_SIZE && ClassOf(osize) == ClassOf(nsize)) {
+					return ptr;
+				}
+			}
+			void * block = Allocate(nsize);
+			if (block == NULL) {
+				if (nsize > osize) {
+					return NULL;
+				}
+				// Lua requires shrinking to succeed.  A block from malloc
+				// can't be kept as is, as it would later be freed into a
+				// class's free list.
+				if (osize > LUAPLUSLITE_POOL_MAX_BLOCK_SIZE) {
+					++small_malloc_blocks_;
+					return ShrinkIntoClass(ptr, osize, nsize);
+				}
+				if (small_malloc_blocks_ != 0 || kept_pool_blocks_ != 0) {
+					const Chunk * chunk = FindChunk(ptr);
+					if (chunk == NULL) {
+						return ShrinkIntoClass(ptr, stats_[ClassOf(osize)].block_size, nsize);
+					}
+					if (chunk->class_index != ClassOf(osize)) {
+						return ptr;
+					}
+				}
+				// The old pool block is kept.  It still belongs to its own
+				// class, which Free finds from the chunk it lies in.
+				++kept_pool_blocks_;
+				return ptr;
+			}
+			if (ptr != NULL) {
+				memcpy(block, ptr, (osize < nsize) ? osize : nsize);
+				Free(ptr, osize);
+			}
+			return block;
+		}
+		
+		size_t GetNumClasses() const {
+			return LUAPLUSLITE_POOL_NUM_CLASSES;
+		}
+		
+		const ClassStats & GetClassStats(size_t class_index) const {
+			luapluslite_assert(class_index < LUAPLUSLITE_POOL_NUM_CLASSES);
+			return stats_[class_index];
+		}
+		
+		// The number of blocks, too large for any class, sent to malloc.
+		size_t GetLargeAllocations() const {
+			return large_allocations_;
+		}
+		
+		// The number of bytes taken from the system, for chunks and for
+		// large blocks that are still in use.
+		size_t GetBytesReserved() const {
+			return chunks_.size() * LUAPLUSLITE_POOL_CHUNK_SIZE + large_bytes_in_use_;
+		}
+		
+		// Caps the number of chunks reserved.  Past the cap, blocks of a
+		// class with no free block fail to allocate, as they would if the
+		// system were out of memory.  0, the default, sets no cap.
+		void SetChunkLimit(size_t max_chunks) {
+			chunk_limit_ = max_chunks;
+		}
+		
+	private:
+		LuaPoolAllocator(const LuaPoolAllocator &);
+		LuaPoolAllocator & operator=(const LuaPoolAllocator &);
+		
+		struct FreeBlock {
+			FreeBlock * next;
+		};
+		
+		struct Chunk {
+			void * memory;
+			size_t class_index;		// The class the chunk was carved for.
+		};
+		
+		static size_t ClassOf(size_t size) {
+			return (size + LUAPLUSLITE_POOL_GRANULARITY - 1) / LUAPLUSLITE_POOL_GRANULARITY - 1;
+		}
+		
+		void * Allocate(size_t size) {
+			if (size > LUAPLUSLITE_POOL_MAX_BLOCK_SIZE) {
+				void * block = malloc(size);
+				if (block != NULL) {
+					++large_allocations_;
+					large_bytes_in_use_ += size;
+				}
+				return block;
+			}
+			size_t class_index = ClassOf(size);
+			if (free_lists_[class_index] == NULL && ! AddChunk(class_index)) {
+				return NULL;
+			}
+			FreeBlock * block = free_lists_[class_index];
+			free_lists_[class_index] = block->next;
+			++stats_[class_index].allocations;
+			++stats_[class_index].blocks_in_use;
+			return block;
+		}
+		
+		void Free(void * ptr, size_t size) {
+			if (ptr == NULL) {
+				return;
+			}
+			if (size > LUAPLUSLITE_POOL_MAX_BLOCK_SIZE) {
+				free(ptr);
+				large_bytes_in_use_ -= size;
+				return;
+			}
+			size_t class_index = ClassOf(size);
+			if (small_malloc_blocks_ != 0 || kept_pool_blocks_ != 0) {
+				const Chunk * chunk = FindChunk(ptr);
+				if (chunk == NULL) {
+					free(ptr);
+					large_bytes_in_use_ -= stats_[class_index].block_size;
+					--small_malloc_blocks_;
+					return;
+				}
+				if (chunk->class_index != class_index) {
+					class_index = chunk->class_index;
+					--kept_pool_blocks_;
+				}
+			}
+			FreeBlock * block = static_cast<FreeBlock *>(ptr);
+			block->next = free_lists_[class_index];
+			free_lists_[class_index] = block;
+			--stats_[class_index].blocks_in_use;
+		}
+		
+		// Shrinks a block held by malloc, 'held_size' bytes long, down to
+		// the block size of the class 'nsize' falls in.  This is only done
+		// when no pool block could be had.  The block stays with malloc,
+		// and is recognized when freed by lying outside every chunk.  Should
+		// realloc fail, the block is kept whole, and is accounted for as if
+		// it had shrunk.
+		void * ShrinkIntoClass(void * ptr, size_t held_size, size_t nsize) {
+			const size_t block_size = stats_[ClassOf(nsize)].block_size;
+			void * block = realloc(ptr, block_size);
+			large_bytes_in_use_ -= held_size;
+			large_bytes_in_use_ += block_size;
+			return (block != NULL) ? block : ptr;
+		}
+		
+		// The chunk 'ptr' lies in, or NULL for a block held by malloc.
+		const Chunk * FindChunk(const void * ptr) const {
+			const char * address = static_cast<const char *>(ptr);
+			for (size_t i = 0; i < chunks_.size(); ++i) {
+				const char * chunk = static_cast<const char *>(chunks_[i].memory);
+				if (std::less_equal<const char *>()(chunk, address) && std::less<const char *>()(address, chunk + LUAPLUSLITE_POOL_CHUNK_SIZE)) {
+					return &chunks_[i];
+				}
+			}
+			return NULL;
+		}
+		
+		// Carves a new chunk into blocks for the given class.
+		bool AddChunk(size_t class_index) {
+			if (chunk_limit_ != 0 && chunks_.size() >= chunk_limit_) {
+				return false;
+			}
+			char * chunk = static_cast<char *>(malloc(LUAPLUSLITE_POOL_CHUNK_SIZE));
+			if (chunk == NULL) {
+				return false;
+			}
+			Chunk entry = { chunk, class_index };
+			chunks_.push_back(entry);
+			const size_t block_size = stats_[class_index].block_size;
+			const size_t num_blocks = LUAPLUSLITE_POOL_CHUNK_SIZE / block_size;
+			for (size_t i = num_blocks; i > 0; --i) {
+				FreeBlock * block = reinterpret_cast<FreeBlock *>(chunk + (i - 1) * block_size);
+				block->next = free_lists_[class_index];
+				free_lists_[class_index] = block;
+			}
+			stats_[class_index].blocks_reserved += num_blocks;
+			return true;
+		}
+		
+		FreeBlock * free_lists_[LUAPLUSLITE_POOL_NUM_CLASSES];
+		ClassStats stats_[LUAPLUSLITE_POOL_NUM_CLASSES];
+		std::vector<Chunk> chunks_;
+		size_t large_allocations_;
+		size_t large_bytes_in_use_;
+		size_t small_malloc_blocks_;	// Blocks left with malloc by ShrinkIntoClass.
+		size_t kept_pool_blocks_;		// Blocks kept under a smaller class's size.
+		size_t chunk_limit_;
+	};
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - LuaArenaAllocator
+#endif
+
+	static const size_t LUAPLUSLITE_ARENA_ALIGNMENT = 16;
+	static const size_t LUAPLUSLITE_ARENA_CHUNK_SIZE = 64 * 1024;
+	static const size_t LUAPLUSLITE_ARENA_MAX_BLOCK_SIZE = LUAPLUSLITE_ARENA_CHUNK_SIZE / 4;
+	
+	// A lua_Alloc for short-lived states.  Blocks of up to
+	// LUAPLUSLITE_ARENA_MAX_BLOCK_SIZE bytes are bumped off the end of large
+	// chunks, and are never reused: freeing one only reclaims it if it was
+	// the last block allocated.  Larger blocks go to malloc, and are freed
+	// normally until DiscardFrees() is called.  Everything is released at
+	// once when the allocator is destroyed.
+	//
+	// A state that keeps creating and dropping objects will keep growing
+	// its arena, so this suits states that run a script or two and are
+	// then destroyed.  A LuaArenaAllocator is not thread-safe.
+	class LuaArenaAllocator {
+	public:
+		LuaArenaAllocator() : current_(NULL), current_end_(NULL), last_block_(NULL), large_blocks_(NULL), large_bytes_in_use_(0), discard_frees_(false) {
+		}
+		
+		~LuaArenaAllocator() {
+			for (size_t i = 0; i < chunks_.size(); ++i) {
+				free(chunks_[i]);
+			}
+			while (large_blocks_ != NULL) {
+				LargeBlock * next = large_blocks_->next;
+				free(large_blocks_);
+				large_blocks_ = next;
+			}
+		}
+		
+		// The lua_Alloc entry point.  'ud' must point to a LuaArenaAllocator.
+		static void * Alloc(void * ud, void * ptr, size_t osize, size_t nsize) {
+			return static_cast<LuaArenaAllocator *>(ud)->Realloc(ptr, osize, nsize);
+		}
+		
+		void * Realloc(void * ptr, size_t osize, size_t nsize) {
+			if (ptr == NULL) {
+				// 'osize' holds the type of the object being created.
+				osize = 0;
+			}
+			if (nsize == 0) {
+				Free(ptr, osize);
+				return NULL;
+			}
+			if (ptr != NULL && osize <= LUAPLUSLITE_ARENA_MAX_BLOCK_SIZE && nsize <= LUAPLUSLITE_ARENA_MAX_BLOCK_SIZE) {
+				if (ptr == last_block_ && static_cast<char *>(ptr) + AlignedSize(nsize) <= current_end_) {
+					current_ = static_cast<char *>(ptr) + AlignedSize(nsize);
+					return ptr;
+				}
+				if (nsize <= osize) {
+					return ptr;
+				}
+			}
+			if (ptr != NULL && osize > LUAPLUSLITE_ARENA_MAX_BLOCK_SIZE && nsize > LUAPLUSLITE_ARENA_MAX_BLOCK_SIZE) {
+				return ReallocLarge(ptr, osize, nsize);
+			}
+			void * block = Allocate(nsize);
+			if (block == NULL) {
+				// Lua requires shrinking to succeed, and the old block is
+				// still big enough.
+				return (nsize <= osize) ? ptr : NULL;
+			}
+			if (ptr != NULL) {
+				memcpy(block, ptr, (osize < nsize) ? osize : nsize);
+				Free(ptr, osize);
+			}
+			return block;
+		}
+		
+		// Makes every later free a no-op.  LuaState calls this just before
+		// lua_close, as the whole arena is about to be released anyway.
+		void DiscardFrees() {
+			discard_frees_ = true;
+		}
+		
+		// The number of bytes taken from the system, for chunks and for
+		// large blocks that are still held.
+		size_t GetBytesReserved() const {
+			return chunks_.size() * LUAPLUSLITE_ARENA_CHUNK_SIZE + large_bytes_in_use_;
+		}
+		
+	private:
+		LuaArenaAllocator(const LuaArenaAllocator &);
+		LuaArenaAllocator & operator=(const LuaArenaAllocator &);
+		
+		// Header for blocks too large for the arena, which keeps them in
+		// a list so that they can all be released at once.
+		struct LargeBlock {
+			LargeBlock * prev;
+			LargeBlock * next;
+		};
+		
+		static size_t AlignedSize(size_t size) {
+			return (size + LUAPLUSLITE_ARENA_ALIGNMENT - 1) & ~(LUAPLUSLITE_ARENA_ALIGNMENT - 1);
+		}
+		
+		static size_t LargeHeaderSize() {
+			return AlignedSize(sizeof(LargeBlock));
+		}
+		
+		void * Allocate(size_t size) {
+			if (size > LUAPLUSLITE_ARENA_MAX_BLOCK_SIZE) {
+				LargeBlock * block = static_cast<LargeBlock *>(malloc(LargeHeaderSize() + size));
+				if (block == NULL) {
+					return NULL;
+				}
+				block->prev = NULL;
+				block->next = large_blocks_;
+				if (large_blocks_ != NULL) {
+					large_blocks_->prev = block;
+				}
+				large_blocks_ = block;
+				large_bytes_in_use_ += size;
+				return reinterpret_cast<char *>(block) + LargeHeaderSize();
+			}
+			size = AlignedSize(size);
+			if (current_ == NULL || size > (size_t)(current_end_ - current_)) {
+				char * chunk = static_cast<char *>(malloc(LUAPLUSLITE_ARENA_CHUNK_SIZE));
+				if (chunk == NULL) {
+					return NULL;
+				}
+				chunks_.push_back(chunk);
+				current_ = chunk;
+				current_end_ = chunk + LUAPLUSLITE_ARENA_CHUNK_SIZE;
+			}
+			last_block_ = current_;
+			current_ += size;
+			return last_block_;
+		}
+		
+		void * ReallocLarge(void * ptr, size_t osize, size_t nsize) {
+			LargeBlock * old_block = reinterpret_cast<LargeBlock *>(static_cast<char *>(ptr) - LargeHeaderSize());
+			LargeBlock * block = static_cast<LargeBlock *>(realloc(old_block, LargeHeaderSize() + nsize));
+			if (block == NULL) {
+				return NULL;
+			}
+			if (block->prev != NULL) {
+				block->prev->next = block;
+			} else {
+				large_blocks_ = block;
+			}
+			if (block->next != NULL) {
+				block->next->prev = block;
+			}
+			large_bytes_in_use_ += nsize;
+			large_bytes_in_use_ -= osize;
+			return reinterpret_cast<char *>(block) + LargeHeaderSize();
+		}
+		
+		void Free(void * ptr, size_t size) {
+			if (ptr == NULL || discard_frees_) {
+				return;
+			}
+			if (size > LUAPLUSLITE_ARENA_MAX_BLOCK_SIZE) {
+				LargeBlock * block = reinterpret_cast<LargeBlock *>(static_cast<char *>(ptr) - LargeHeaderSize());
+				if (block->prev != NULL) {
+					block->prev->next = block->next;
+				} else {
+					large_blocks_ = block->next;
+				}
+				if (block->next != NULL) {
+					block->next->prev = block->prev;
+				}
+				free(block);
+				large_bytes_in_use_ -= size;
+			} else if (ptr == last_block_) {
+				current_ = last_block_;
+				last_block_ = NULL;
+			}
+		}
+		
+		std::vector<void *> chunks_;
+		char * current_;
+		char * current_end_;
+		char * last_block_;
+		LargeBlock * large_blocks_;
+		size_t large_bytes_in_use_;
+		bool discard_frees_;
+	};
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Memory Accounting
 #endif
 
+	// Lua 5.2 tags new objects with their type (LUA_TSTRING, LUA_TTABLE,
+	// and so on), plus two internal types: function prototypes and
+	// upvalues.  Allocations that are not objects, such as table arrays
+	// and stacks, are tagged 0 (LUA_TNIL).
+	static const int LUAPLUSLITE_MEMORY_NUM_TAGS = LUA_NUMTAGS + 2;
+	
+	struct LuaMemoryStats {
+		size_t bytes_in_use;
+		size_t peak_bytes_in_use;
+		size_t limit;					// 0 if there is no limit.
+		size_t failed_allocations;		// Allocations refused by the limit.
+		
+		// Counts and sizes of new allocations, by tag, since the state
+		// was created.  Lua only reports an allocation's tag when it is
+		// made, so these are running totals rather than what is in use.
+		size_t allocations_by_tag[LUAPLUSLITE_MEMORY_NUM_TAGS];
+		size_t bytes_by_tag[LUAPLUSLITE_MEMORY_NUM_TAGS];
+		
+		LuaMemoryStats() : bytes_in_use(0), peak_bytes_in_use(0), limit(0), failed_allocations(0) {
+			for (int i = 0; i < LUAPLUSLITE_MEMORY_NUM_TAGS; ++i) {
+				allocations_by_tag[i] = 0;
+				bytes_by_tag[i] = 0;
+			}
+		}
+	};
+	
+	// The realloc-based allocator that luaL_newstate uses.
+	inline void * LuaDefaultAlloc(void *, void * ptr, size_t, size_t nsize) {
+		if (nsize == 0) {
+			free(ptr);
+			return NULL;
+		}
+		return realloc(ptr, nsize);
+	}
+	
+	// A lua_Alloc that forwards to another one, keeping a LuaMemoryStats
+	// up to date.  Once a limit is set, any allocation that would take the
+	// state past it fails, so Lua runs an emergency collection and, if
+	// that doesn't free enough, raises a LUA_ERRMEM error.  Shrinking and
+	// freeing always succeed.
+	class LuaMemoryTracker {
+	public:
+		LuaMemoryTracker(lua_Alloc allocator, void * allocator_ud, size_t limit) : allocator_(allocator), allocator_ud_(allocator_ud) {
+			luapluslite_assert(allocator != NULL);
+			stats_.limit = limit;
+		}
+		
+		// The lua_Alloc entry point.  'ud' must point to a LuaMemoryTracker.
+		static void * Alloc(void * ud, void * ptr, size_t osize, size_t nsize) {
+			return static_cast<LuaMemoryTracker *>(ud)->Realloc(ptr, osize, nsize);
+		}
+		
+		void * Realloc(void * ptr, size_t osize, size_t nsize) {
+			// For new blocks, 'osize' holds the tag, and no memory is in use yet.
+			const size_t old_size = ptr ? osize : 0;
+			if (nsize > old_size && stats_.limit != 0 && stats_.bytes_in_use + (nsize - old_size) > stats_.limit) {
+				++stats_.failed_allocations;
+				return NULL;
+			}
+			void * block = allocator_(allocator_ud_, ptr, osize, nsize);
+			if (block == NULL && nsize != 0) {
+				return NULL;
+			}
+			stats_.bytes_in_use += nsize;
+			stats_.bytes_in_use -= old_size;
+			if (stats_.bytes_in_use > stats_.peak_bytes_in_use) {
+				stats_.peak_bytes_in_use = stats_.bytes_in_use;
+			}
+			if (ptr == NULL && osize < (size_t)LUAPLUSLITE_MEMORY_NUM_TAGS) {
+				++stats_.allocations_by_tag[osize];
+				stats_.bytes_by_tag[osize] += nsize;
+			}
+			return block;
+		}
+		
+		const LuaMemoryStats & GetStats() const {
+			return stats_;
+		}
+		
+		// A limit of 0 removes the limit.  Lowering the limit below the
+		// memory already in use only affects later allocations.
+		void SetLimit(size_t limit) {
+			stats_.limit = limit;
+		}
+		
+	private:
+		LuaMemoryTracker(const LuaMemoryTracker &);
+		LuaMemoryTracker & operator=(const LuaMemoryTracker &);
+		
+		lua_Alloc allocator_;
+		void * allocator_ud_;
+		LuaMemoryStats stats_;
+	};
+
 
 #if defined(__clang__) || defined(__GNUC__)
 #pragma mark - LuaState
 #endif
 
 	static const char * LUAPLUSLITE_LUASTATE_REGISTRYSTRING = "LuaPlusLite_LuaState";
+	static const int LUAPLUSLITE_REFPOOL_INITIAL_SIZE = 64;
 	
 	class LuaObject;
+	class LuaStackObject;
+	class LuaStateSnapshot;
+	class LuaTableIterator;
 
 	class LuaState {
 	public:
-		LuaState() : c_state_(NULL) {
+		// Settings applied when a LuaState is created.  Zero, or NULL,
+		// leaves the corresponding Lua default in place.  For example:
+		//
+		//   LuaState::Options options;
+		//   options.OpenLibrary("_G", luaopen_base).OpenLibrary(LUA_STRLIBNAME, luaopen_string);
+		//   options.gc_pause = 150;
+		//   LuaState state(options);
+		//
+		struct Options {
+			// The allocator for the new lua_State, and its 'ud' argument.
+			// NULL selects the realloc-based allocator used by luaL_newstate.
+			lua_Alloc allocator;
+			void * allocator_ud;
+			
+			// Gives the state a LuaPoolAllocator of its own, in place of
+			// 'allocator'.  See LuaState::GetPoolAllocator().
+			bool use_pool_allocator;
+			
+			// Gives the state a LuaArenaAllocator of its own, in place of
+			// 'allocator'.  The arena is released in one go when the
+			// LuaState is destroyed, after finalizers have run.
+			bool use_arena_allocator;
+			
+			// Keeps a LuaMemoryStats for the state (see GetMemoryStats()).
+			// A nonzero 'memory_limit' caps the bytes the state may hold,
+			// and implies 'track_memory'.  The constructor throws a
+			// LuaException if the limit is reached before the state, and
+			// its libraries, are set up.
+			bool track_memory;
+			size_t memory_limit;
+			
+			// Libraries opened, in order, as if by luaL_requiref.
+			std::vector<luaL_Reg> libraries;
+			
+			// The number of free stack slots to reserve up front.
+			int stack_size;
+			
+			// Collector tuning, as for lua_gc's LUA_GCSETPAUSE and
+			// LUA_GCSETSTEPMUL options, and LUA_GCGEN.
+			int gc_pause;
+			int gc_step_multiplier;
+			bool gc_generational;
+			
+			Options() : allocator(NULL), allocator_ud(NULL), use_pool_allocator(false), use_arena_allocator(false), track_memory(false), memory_limit(0), stack_size(0), gc_pause(0), gc_step_multiplier(0), gc_generational(false)
+			{
+			}
+			
+			Options & OpenLibrary(const char * name, lua_CFunction open) {
+				luaL_Reg library = { name, open };
+				libraries.push_back(library);
+				return *this;
+			}
+			
+			// Adds every library that luaL_openlibs would open.
+			Options & OpenStandardLibraries() {
+				return OpenLibrary("_G", luaopen_base)
+					.OpenLibrary(LUA_LOADLIBNAME, luaopen_package)
+					.OpenLibrary(LUA_COLIBNAME, luaopen_coroutine)
+					.OpenLibrary(LUA_TABLIBNAME, luaopen_table)
+					.OpenLibrary(LUA_IOLIBNAME, luaopen_io)
+					.OpenLibrary(LUA_OSLIBNAME, luaopen_os)
+					.OpenLibrary(LUA_STRLIBNAME, luaopen_string)
+					.OpenLibrary(LUA_BITLIBNAME, luaopen_bit32)
+					.OpenLibrary(LUA_MATHLIBNAME, luaopen_math)
+					.OpenLibrary(LUA_DBLIBNAME, luaopen_debug);
+			}
+		};
+		
+		LuaState() : c_state_(NULL), pool_allocator_(NULL), arena_allocator_(NULL), memory_tracker_(NULL), ref_pool_index_(LUA_NOREF), ref_pool_top_(0) {
 			c_state_ = luaL_newstate();
-			lua_pushstring(c_state_, LUAPLUSLITE_LUASTATE_REGISTRYSTRING);
-			lua_pushlightuserdata(c_state_, this);
-			lua_settable(c_state_, LUA_REGISTRYINDEX);
+			Init();
 		}
 		
-		~LuaState() {
-			if (c_state_) {
-				lua_close(c_state_);
-				c_state_ = NULL;
+		explicit LuaState(const Options & options) : c_state_(NULL), pool_allocator_(NULL), arena_allocator_(NULL), memory_tracker_(NULL), ref_pool_index_(LUA_NOREF), ref_pool_top_(0), options_(options) {
+			luapluslite_assert( ! (options.use_pool_allocator && options.use_arena_allocator));
+			lua_Alloc allocator = options.allocator;
+			void * allocator_ud = options.allocator_ud;
+			if (options.use_pool_allocator) {
+				pool_allocator_ = new LuaPoolAllocator();
+				allocator = &LuaPoolAllocator::Alloc;
+				allocator_ud = pool_allocator_;
+			} else if (options.use_arena_allocator) {
+				arena_allocator_ = new LuaArenaAllocator();
+				allocator = &LuaArenaAllocator::Alloc;
+				allocator_ud = arena_allocator_;
+			}
+			if (options.track_memory || options.memory_limit != 0) {
+				memory_tracker_ = new LuaMemoryTracker(allocator ? allocator : &LuaDefaultAlloc, allocator_ud, options.memory_limit);
+				allocator = &LuaMemoryTracker::Alloc;
+				allocator_ud = memory_tracker_;
+			}
+			if (allocator) {
+				c_state_ = lua_newstate(allocator, allocator_ud);
+				if (c_state_) {
+					lua_atpanic(c_state_, &LuaState::Panic);
+				}
+			} else {
+				c_state_ = luaL_newstate();
+			}
+			if (c_state_ == NULL) {
+				Close();
+				throw LuaException("not enough memory");
 			}
+			Init();
+			ApplyOptions(options);
+		}
+		
+		// Creates a state with the snapshot's Options, and then restores
+		// the snapshot into it.  See LuaStateSnapshot.
+		explicit LuaState(const LuaStateSnapshot & snapshot);
+		
+		~LuaState() {
+			Close();
 		}
 		
 		static LuaState * CastState(lua_State * wrapped_c_state) {
@@ -98,6 +796,42 @@ namespace LuaPlusLite {
 			return c_state_;
 		}
 		
+		// The Options the state was created with.  States made by the
+		// default constructor report default Options.
+		const Options & GetOptions() const {
+			return options_;
+		}
+		
+		// Returns the state's own LuaPoolAllocator, or NULL if it was not
+		// created with Options::use_pool_allocator.
+		const LuaPoolAllocator * GetPoolAllocator() const {
+			return pool_allocator_;
+		}
+		
+		// Returns the state's own LuaArenaAllocator, or NULL if it was not
+		// created with Options::use_arena_allocator.
+		const LuaArenaAllocator * GetArenaAllocator() const {
+			return arena_allocator_;
+		}
+		
+		// Returns the state's memory usage.  Without Options::track_memory,
+		// only 'bytes_in_use' is filled in, from lua_gc's count.
+		LuaMemoryStats GetMemoryStats() const {
+			if (memory_tracker_) {
+				return memory_tracker_->GetStats();
+			}
+			LuaMemoryStats stats;
+			stats.bytes_in_use = (size_t)lua_gc(c_state_, LUA_GCCOUNT, 0) * 1024 + (size_t)lua_gc(c_state_, LUA_GCCOUNTB, 0);
+			return stats;
+		}
+		
+		// Changes the limit set by Options::memory_limit; 0 removes it.
+		// The state must have been created with memory tracking.
+		void SetMemoryLimit(size_t limit) {
+			luapluslite_assert(memory_tracker_ != NULL);
+			memory_tracker_->SetLimit(limit);
+		}
+		
 		LuaObject GetGlobal(const char * key);
 		LuaObject GetGlobals();
 
@@ -192,6 +926,14 @@ namespace LuaPlusLite {
 			return lua_pushstring(c_state_, s);
 		}
 		
+		const char * PushString(const char * s, size_t len) {
+			return lua_pushlstring(c_state_, s, len);
+		}
+		
+		const char * PushString(const std::string & s) {
+			return lua_pushlstring(c_state_, s.data(), s.size());
+		}
+		
 		int PushThread() {
 			return lua_pushthread(c_state_);
 		}
@@ -200,7 +942,7 @@ namespace LuaPlusLite {
 			lua_settop(c_state_, n);
 		}
 		
-		LuaObject Stack(int index);
+		LuaStackObject Stack(int index);
 
 
 #if defined(__clang__) || defined(__GNUC__)
@@ -249,700 +991,4452 @@ namespace LuaPlusLite {
 		}
 
 		
-	private:
-		lua_State * c_state_;
-	};
-	
-
 #if defined(__clang__) || defined(__GNUC__)
-#pragma mark - LuaObject
+#pragma mark - Reference Pool
 #endif
 
-	class LuaObject {
-	public:
-	
-#if defined(__clang__) || defined(__GNUC__)
-#pragma mark - Initialization and Destruction
-#endif
+	private:
+		friend class LuaObject;
 
-		LuaObject() : lua_state_(NULL)
-		{
+		// LuaObjects store their values in a dedicated, integer-indexed
+		// table (the reference pool), rather than in the registry's hash
+		// part.  Released slots are recycled through a free list, which
+		// keeps the pool dense and its entries inside the table's array
+		// part.
+
+		// Pops the value at the top of the stack and stores it in a free slot.
+		int NewRef() {
+			int ref;
+			if (ref_pool_free_slots_.empty()) {
+				ref = ++ref_pool_top_;
+			} else {
+				ref = ref_pool_free_slots_.back();
+				ref_pool_free_slots_.pop_back();
+			}
+			SetRef(ref);
+			return ref;
 		}
 		
-		LuaObject(LuaState * state, int stack_position) : lua_state_(state)
-		{
-			if (lua_state_->GetCState()) {
-				// TODO: check for valid stack position (and throw LuaException on failure)
-				lua_pushvalue(lua_state_->GetCState(), stack_position);
-				lua_rawsetp(lua_state_->GetCState(), LUA_REGISTRYINDEX, this);
-			}
+		// Pops the value at the top of the stack and stores it in an existing slot.
+		void SetRef(int ref) {
+			lua_rawgeti(c_state_, LUA_REGISTRYINDEX, ref_pool_index_);
+			lua_insert(c_state_, -2);
+			lua_rawseti(c_state_, -2, ref);
+			lua_pop(c_state_, 1);
 		}
 		
-		LuaObject(const LuaObject & src) : lua_state_(src.lua_state_)
-		{
-			if (lua_state_->GetCState()) {
-				src.Push();
-				lua_rawsetp(lua_state_->GetCState(), LUA_REGISTRYINDEX, this);
-			}
+		void PushRef(int ref) const {
+			lua_rawgeti(c_state_, LUA_REGISTRYINDEX, ref_pool_index_);
+			lua_rawgeti(c_state_, -1, ref);
+			lua_replace(c_state_, -2);
 		}
 		
-		~LuaObject() {
-			if (lua_state_ && lua_state_->GetCState()) {
-				lua_pushnil(lua_state_->GetCState());
-				lua_rawsetp(lua_state_->GetCState(), LUA_REGISTRYINDEX, this);
+		// Pushes the values in two slots, in one trip to the pool.
+		void PushRefs(int ref1, int ref2) const {
+			lua_rawgeti(c_state_, LUA_REGISTRYINDEX, ref_pool_index_);
+			lua_rawgeti(c_state_, -1, ref1);
+			lua_rawgeti(c_state_, -2, ref2);
+			lua_remove(c_state_, -3);
+		}
+		
+		void FreeRef(int ref) {
+			lua_rawgeti(c_state_, LUA_REGISTRYINDEX, ref_pool_index_);
+			lua_pushnil(c_state_);
+			lua_rawseti(c_state_, -2, ref);
+			lua_pop(c_state_, 1);
+			ref_pool_free_slots_.push_back(ref);
+		}
+		
+		// Constructors set the new state up through lua_pcall, so that a
+		// failure (such as reaching Options::memory_limit while libraries
+		// are opened) closes the state and throws a LuaException, rather
+		// than Lua panicking.
+		void SetUp(lua_CFunction function, void * argument) {
+			lua_pushcfunction(c_state_, function);
+			lua_pushlightuserdata(c_state_, argument);
+			if (lua_pcall(c_state_, 1, 0, 0) != LUA_OK) {
+				const char * error_message = lua_tostring(c_state_, -1);
+				LuaException exception(error_message ? error_message : "error while creating a LuaState");
+				Close();
+				throw exception;
 			}
 		}
 		
-		void Reset() {
-			if (lua_state_ != NULL) {
-				lua_pushnil(lua_state_->GetCState());
-				lua_rawsetp(lua_state_->GetCState(), LUA_REGISTRYINDEX, this);
-				lua_state_ = NULL;
+		void Init() {
+			if (c_state_ == NULL) {
+				throw LuaException("not enough memory");
 			}
+			SetUp(&LuaState::InitProtected, this);
 		}
 		
-#if defined(__clang__) || defined(__GNUC__)
-#pragma mark - Stack Management
-#endif
+		static int InitProtected(lua_State * L) {
+			LuaState * state = static_cast<LuaState *>(lua_touserdata(L, 1));
+			lua_pushstring(L, LUAPLUSLITE_LUASTATE_REGISTRYSTRING);
+			lua_pushlightuserdata(L, state);
+			lua_settable(L, LUA_REGISTRYINDEX);
+			lua_createtable(L, LUAPLUSLITE_REFPOOL_INITIAL_SIZE, 0);
+			state->ref_pool_index_ = luaL_ref(L, LUA_REGISTRYINDEX);
+			return 0;
+		}
 		
-		void Push() const {
-			luapluslite_assert(lua_state_ != NULL);
-			lua_rawgetp(lua_state_->GetCState(), LUA_REGISTRYINDEX, this);
-		}
-
-
-#if defined(__clang__) || defined(__GNUC__)
-#pragma mark - Value Assignment
-#endif
-		
-		void AssignBoolean(LuaState * state, bool value) {
-			luapluslite_assert(state != NULL);
-			lua_pushboolean(state->GetCState(), value);
-			AssignValueToState(state);
-		}
-	
-		void AssignInteger(LuaState * state, lua_Integer value) {
-			luapluslite_assert(state != NULL);
-			lua_pushinteger(state->GetCState(), value);
-			AssignValueToState(state);
+		// Opens the libraries, and applies the collector settings.
+		void ApplyOptions(const Options & options) {
+			SetUp(&LuaState::ApplyOptionsProtected, const_cast<Options *>(&options));
+			// Reserved outside of the protected call, as the reservation
+			// only lasts as long as the call it was made in.
+			if (options.stack_size > 0) {
+				lua_checkstack(c_state_, options.stack_size);
+			}
 		}
 		
-		void AssignLightUserData(LuaState * state, void * value) {
-			luapluslite_assert(state != NULL);
-			lua_pushlightuserdata(state->GetCState(), value);
-			AssignValueToState(state);
+		static int ApplyOptionsProtected(lua_State * L) {
+			const Options & options = *static_cast<const Options *>(lua_touserdata(L, 1));
+			if (options.gc_generational) {
+				lua_gc(L, LUA_GCGEN, 0);
+			}
+			if (options.gc_pause > 0) {
+				lua_gc(L, LUA_GCSETPAUSE, options.gc_pause);
+			}
+			if (options.gc_step_multiplier > 0) {
+				lua_gc(L, LUA_GCSETSTEPMUL, options.gc_step_multiplier);
+			}
+			for (size_t i = 0; i < options.libraries.size(); ++i) {
+				luaL_requiref(L, options.libraries[i].name, options.libraries[i].func, 1);
+				lua_pop(L, 1);
+			}
+			return 0;
 		}
 		
-		void AssignNumber(LuaState * state, lua_Number value) {
-			luapluslite_assert(state != NULL);
-			lua_pushnumber(state->GetCState(), value);
-			AssignValueToState(state);
+		void Close() {
+			if (c_state_) {
+				if (arena_allocator_) {
+					// Everything lua_close frees, including anything freed by
+					// the finalizers it runs, goes back with the arena.
+					lua_gc(c_state_, LUA_GCSTOP, 0);
+					arena_allocator_->DiscardFrees();
+				}
+				lua_close(c_state_);
+				c_state_ = NULL;
+			}
+			delete pool_allocator_;
+			pool_allocator_ = NULL;
+			delete arena_allocator_;
+			arena_allocator_ = NULL;
+			delete memory_tracker_;
+			memory_tracker_ = NULL;
 		}
 		
-		void AssignString(LuaState * state, const char * value) {
-			luapluslite_assert(state != NULL);
-			lua_pushstring(state->GetCState(), value);
-			AssignValueToState(state);
+		// Matches the panic function that luaL_newstate installs.
+		static int Panic(lua_State * L) {
+			fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+			return 0;
 		}
 		
-		void AssignNil(LuaState * state) {
-			luapluslite_assert(state != NULL);
-			lua_pushnil(state->GetCState());
-			AssignValueToState(state);
-		}
+		LuaState(const LuaState &);
+		LuaState & operator=(const LuaState &);
 		
-		void AssignNewTable(LuaState * state, int narr = 0, int nrec = 0) {
-			luapluslite_assert(state != NULL);
-			lua_createtable(state->GetCState(), narr, nrec);
-			AssignValueToState(state);
-		}
+		lua_State * c_state_;
+		LuaPoolAllocator * pool_allocator_;
+		LuaArenaAllocator * arena_allocator_;
+		LuaMemoryTracker * memory_tracker_;
+		int ref_pool_index_;
+		int ref_pool_top_;
+		std::vector<int> ref_pool_free_slots_;
+		Options options_;
+	};
 
 
 #if defined(__clang__) || defined(__GNUC__)
-#pragma mark - Value Retrieval
+#pragma mark - LuaStateSnapshot
 #endif
 
-		bool GetBoolean() {
-			return ToBoolean();
+	// A LuaStateSnapshot captures everything a state's scripts have set
+	// up - its globals, the modules in package.loaded, the string
+	// metatable, and every table, function and value reachable from
+	// them - so that new states can be created from it without running
+	// the scripts again:
+	//
+	//   LuaState prototype(options);
+	//   prototype.DoFile("framework.lua");
+	//   LuaStateSnapshot snapshot(prototype);
+	//   ...
+	//   LuaState request_state(snapshot);	// Once per request.
+	//
+	// Lua functions are kept as bytecode, dumped once when the snapshot
+	// is taken.  Each new state loads that bytecode rather than parsing
+	// source, and gets its upvalues back (including ones shared between
+	// closures).  Prototypes are garbage-collected objects owned by a
+	// single Lua state in 5.2, so they cannot be shared across states.
+	//
+	// Restoring is not always cheaper than running the scripts again.
+	// Each function's bytecode carries its chunk name, which for a chunk
+	// loaded by luaL_loadstring is the whole source, so function-heavy
+	// chunks loaded that way may restore more slowly than they run.  Give
+	// such chunks a short name (for example, through luaL_loadbuffer with
+	// "=name"), and measure before relying on a snapshot for speed.
+	//
+	// Libraries listed in the Options are opened in each new state before
+	// the snapshot is restored, and the snapshot is then merged into what
+	// they create: a captured table, full userdata or C function that sits
+	// at the same place as one in the new state (such as 'io.stdout', or
+	// 'require') becomes that value.  Other full userdata and threads
+	// cannot be copied, and fields holding them are left out.  Nothing in
+	// the registry is captured beyond package.loaded, so LuaObjects and
+	// LuaClass registrations are not carried over.
+	//
+	// A snapshot doesn't refer back to the state it was taken from, and
+	// is never modified once taken, so any number of threads may restore
+	// it at once.
+	class LuaStateSnapshot {
+	public:
+		// Throws a LuaException if the state runs out of memory, or
+		// reaches Options::memory_limit, while it is captured.
+		explicit LuaStateSnapshot(LuaState & state) : options_(state.GetOptions()), globals_(-1), loaded_(-1), string_metatable_(-1) {
+			std::map<void *, std::pair<int, int> > upvalue_ids;
+			CaptureCall call = { this, &upvalue_ids };
+			CallProtected(state.GetCState(), &LuaStateSnapshot::CaptureProtected, &call, false);
 		}
 		
-		double GetDouble() {
-			return GetDouble();
+		const LuaState::Options & GetOptions() const {
+			return options_;
 		}
 		
-		float GetFloat() {
-			return GetNumber();
+		// Restores the snapshot into 'state', which should have been
+		// created with the snapshot's Options, and not used since.  Throws
+		// a LuaException if a function's bytecode cannot be loaded, or if
+		// the state runs out of memory.
+		void Restore(LuaState & state) const {
+			std::vector<int> order;
+			std::vector<char> mapped(nodes_.size(), UNMAPPED);
+			RestoreCall call = { this, &order, &mapped };
+			// Everything built here stays reachable, so incremental steps
+			// along the way would only re-mark and re-sweep it.
+			CallProtected(state.GetCState(), &LuaStateSnapshot::RestoreProtected, &call, true);
 		}
 		
-		lua_Integer GetInteger() {
-			return ToInteger();
-		}
+	private:
+		// Capturing and restoring are done under lua_pcall, so that a Lua
+		// error, such as a memory error, becomes a LuaException.  The work
+		// done there keeps no C++ objects of its own on the stack, as the
+		// error would skip their destructors, and catches C++ exceptions
+		// before they reach Lua.
+		struct CaptureCall {
+			LuaStateSnapshot * snapshot;
+			std::map<void *, std::pair<int, int> > * upvalue_ids;
+		};
 		
-		void * GetLightUserData() {
-			return ToUserData();
-		}
+		struct RestoreCall {
+			const LuaStateSnapshot * snapshot;
+			std::vector<int> * order;
+			std::vector<char> * mapped;
+		};
 		
-		lua_Number GetNumber() {
-			return ToNumber();
+		// Calls 'function' with 'argument' as a light userdata, and throws
+		// if it fails, once the stack and the collector are as they were.
+		static void CallProtected(lua_State * L, lua_CFunction function, void * argument, bool stop_gc) {
+			if ( ! lua_checkstack(L, 2)) {
+				throw LuaException("stack overflow");
+			}
+			const int old_top = lua_gettop(L);
+			const bool gc_was_running = lua_gc(L, LUA_GCISRUNNING, 0) != 0;
+			if (stop_gc) {
+				lua_gc(L, LUA_GCSTOP, 0);
+			}
+			lua_pushcfunction(L, function);
+			lua_pushlightuserdata(L, argument);
+			const int status = lua_pcall(L, 1, 0, 0);
+			const char * error_message = (status != LUA_OK) ? lua_tostring(L, -1) : NULL;
+			const std::string message = (status != LUA_OK) ? (error_message ? error_message : "(error object is not a string)") : "";
+			lua_settop(L, old_top);
+			if (stop_gc && gc_was_running) {
+				lua_gc(L, LUA_GCRESTART, 0);
+			}
+			if (status != LUA_OK) {
+				throw LuaException(message);
+			}
 		}
 		
-		const char * GetString() {
-			return ToString();
+		static int CaptureProtected(lua_State * L) {
+			CaptureCall * call = static_cast<CaptureCall *>(lua_touserdata(L, 1));
+			try {
+				call->snapshot->CaptureAll(L, call->upvalue_ids);
+				return 0;
+			} catch (std::exception & e) {
+				lua_pushstring(L, e.what());
+			} catch (...) {
+				lua_pushstring(L, "unknown C++ exception");
+			}
+			return lua_error(L);
 		}
 		
-		void * GetUserData() {
-			return GetUserData();
+		static int RestoreProtected(lua_State * L) {
+			RestoreCall * call = static_cast<RestoreCall *>(lua_touserdata(L, 1));
+			try {
+				call->snapshot->RestoreObjects(L, call->order, call->mapped);
+				return 0;
+			} catch (std::exception & e) {
+				lua_pushstring(L, e.what());
+			} catch (...) {
+				lua_pushstring(L, "unknown C++ exception");
+			}
+			return lua_error(L);
 		}
-
-		bool ToBoolean() {
-			if ( ! lua_state_) {
-				return false;
+		
+		void CaptureAll(lua_State * L, std::map<void *, std::pair<int, int> > * upvalue_ids) {
+			lua_newtable(L);	// Captured value -> node index.
+			lua_newtable(L);	// Node index -> captured value.
+			const int seen = lua_gettop(L) - 1;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+			globals_ = Capture(L, -1, seen);
+			lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+			loaded_ = Capture(L, -1, seen);
+			lua_pushliteral(L, "");
+			if (lua_getmetatable(L, -1)) {
+				string_metatable_ = Capture(L, -1, seen);
 			}
-			Push();
-			int value = lua_toboolean(lua_state_->GetCState(), -1);
-#if LuaPlusLite__ToXYZ_methods_convert_internal_value_types == 1
-			if (Type() != lua_state_->Stack(-1).Type()) {
-				lua_rawsetp(lua_state_->GetCState(), LUA_REGISTRYINDEX, this);
-				return value;
+			lua_settop(L, seen + 1);
+			
+			// Nodes are appended as they are found, so this reaches every
+			// node, including those found along the way.
+			for (size_t i = 0; i < nodes_.size(); ++i) {
+				if (nodes_[i].type != LUA_TTABLE && nodes_[i].type != LUA_TFUNCTION) {
+					continue;
+				}
+				lua_rawgeti(L, seen + 1, (int)i + 1);
+				if (nodes_[i].type == LUA_TTABLE) {
+					CaptureTable(L, (int)i, seen);
+				} else {
+					CaptureFunction(L, (int)i, seen, upvalue_ids);
+				}
+				lua_pop(L, 1);
 			}
-#endif
-			lua_pop(lua_state_->GetCState(), 1);
-			return value;
 		}
 		
-		lua_Integer ToInteger(int * isnum = NULL) {
-			luapluslite_assert(IsInteger() == true);
-			Push();
-			lua_Integer value = lua_tointegerx(lua_state_->GetCState(), -1, isnum);
-#if LuaPlusLite__ToXYZ_methods_convert_internal_value_types == 1
-			if (Type() != lua_state_->Stack(-1).Type()) {
-				lua_rawsetp(lua_state_->GetCState(), LUA_REGISTRYINDEX, this);
-				return value;
+		// Does the work of Restore.  'order' and 'mapped' are kept by the
+		// caller, outside of the protected call.
+		void RestoreObjects(lua_State * L, std::vector<int> * order, std::vector<char> * mapped) const {
+			lua_createtable(L, (int)nodes_.size(), 0);	// Node index -> restored value.
+			const int objects = lua_gettop(L);
+			
+			// First, find or create a value for every table and function,
+			// starting from the roots that the new state already has.
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+			Map(L, globals_, objects, mapped, order);
+			lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+			if (lua_istable(L, -1)) {
+				Map(L, loaded_, objects, mapped, order);
+			} else {
+				lua_pop(L, 1);
+			}
+			lua_pushliteral(L, "");
+			if (lua_getmetatable(L, -1) && string_metatable_ >= 0) {
+				Map(L, string_metatable_, objects, mapped, order);
+			}
+			lua_settop(L, objects);
+			for (size_t i = 0; i < order->size(); ++i) {
+				const Node & node = nodes_[(*order)[i]];
+				lua_rawgeti(L, objects, (*order)[i] + 1);
+				if (node.type == LUA_TTABLE) {
+					for (size_t j = 0; j < node.fields.size(); ++j) {
+						if (PushNode(L, node.fields[j].first, objects, mapped, order)) {
+							MapField(L, node.fields[j].second, objects, mapped, order);
+							lua_pop(L, 1);
+						}
+					}
+					if (node.metatable >= 0 && ! (*mapped)[node.metatable]) {
+						if (lua_getmetatable(L, -1) && nodes_[node.metatable].type == LUA_TTABLE) {
+							Map(L, node.metatable, objects, mapped, order);
+						} else {
+							lua_settop(L, objects + 1);
+							Create(L, node.metatable, objects, mapped, order);
+						}
+					}
+				} else {
+					for (size_t j = 0; j < node.upvalues.size(); ++j) {
+						if (node.upvalues[j].value >= 0 && ! (*mapped)[node.upvalues[j].value]) {
+							Create(L, node.upvalues[j].value, objects, mapped, order);
+						}
+					}
+				}
+				lua_settop(L, objects);
+			}
+			
+			// Then fill them in.
+			for (size_t i = 0; i < order->size(); ++i) {
+				const Node & node = nodes_[(*order)[i]];
+				lua_rawgeti(L, objects, (*order)[i] + 1);
+				if (node.type == LUA_TTABLE) {
+					for (size_t j = 0; j < node.fields.size(); ++j) {
+						if (PushNode(L, node.fields[j].first, objects, NULL, NULL)) {
+							if (PushNode(L, node.fields[j].second, objects, NULL, NULL)) {
+								lua_rawset(L, -3);
+							} else {
+								lua_pop(L, 1);
+							}
+						}
+					}
+					if (node.metatable >= 0 && PushNode(L, node.metatable, objects, NULL, NULL)) {
+						lua_setmetatable(L, -2);
+					}
+				} else if ((*mapped)[(*order)[i]] == CREATED) {
+					RestoreUpvalues(L, node, objects);
+				}
+				lua_settop(L, objects);
 			}
-#endif
-			lua_pop(lua_state_->GetCState(), 1);
-			return value;
 		}
 		
-		lua_Number ToNumber(int * isnum = NULL) {
-			luapluslite_assert(IsNumber() == true);
-			Push();
-			lua_Number value = lua_tonumberx(lua_state_->GetCState(), -1, isnum);
-#if LuaPlusLite__ToXYZ_methods_convert_internal_value_types == 1
-			if (Type() != lua_state_->Stack(-1).Type()) {
-				lua_rawsetp(lua_state_->GetCState(), LUA_REGISTRYINDEX, this);
-				return value;
+		// How each node was restored.
+		enum {
+			UNMAPPED = 0,
+			REUSED,		// Mapped to a value the new state already had.
+			CREATED
+		};
+		
+		struct Upvalue {
+			int value;			// Node index, or -1 for nil.
+			int shared_node;	// Where this upvalue was first seen, if
+			int shared_index;	// it is shared between closures, or -1.
+		};
+		
+		struct Node {
+			int type;
+			lua_Number number;
+			bool boolean;
+			void * light_userdata;
+			lua_CFunction cfunction;
+			std::string data;	// A string's contents, or a Lua function's bytecode.
+			std::vector<std::pair<int, int> > fields;
+			int metatable;
+			std::vector<Upvalue> upvalues;
+			
+			Node() : type(LUA_TNIL), number(0), boolean(false), light_userdata(NULL), cfunction(NULL), metatable(-1) {
 			}
-#endif
-			lua_pop(lua_state_->GetCState(), 1);
-			return value;
+		};
+		
+		static int Writer(lua_State *, const void * p, size_t sz, void * ud) {
+			try {
+				static_cast<std::string *>(ud)->append(static_cast<const char *>(p), sz);
+			} catch (...) {
+				return 1;
+			}
+			return 0;
 		}
 		
-		const char * ToString(size_t * len = NULL) {
-			luapluslite_assert(IsString() == true);
-			Push();
-			const char * value = lua_tolstring(lua_state_->GetCState(), -1, len);
-#if LuaPlusLite__ToXYZ_methods_convert_internal_value_types == 1
-			if (Type() != lua_state_->Stack(-1).Type()) {
-				lua_rawsetp(lua_state_->GetCState(), LUA_REGISTRYINDEX, this);
-				return value;
+		static const char * Reader(lua_State *, void * ud, size_t * size) {
+			std::pair<const std::string *, bool> * state = static_cast<std::pair<const std::string *, bool> *>(ud);
+			if (state->second) {
+				*size = 0;
+				return NULL;
 			}
-#endif
-			lua_pop(lua_state_->GetCState(), 1);
-			return value;
+			state->second = true;
+			*size = state->first->size();
+			return state->first->data();
 		}
 		
-		void * ToUserData() {
-			luapluslite_assert(IsUserData() == true);
-			Push();
-			switch (Type()) {
-				case LUA_TUSERDATA:
-				{
-					// TODO: prevent certain, maybe all, userdata objects from being dereferenced in ToUserData
-					void ** inner_value = (void **)lua_touserdata(lua_state_->GetCState(), -1);
-					lua_pop(lua_state_->GetCState(), 1);
-					return *inner_value;
-				}
-				
+		// Returns the node for the value at 'index', adding one if the
+		// value hasn't been seen.  Tables and functions are only
+		// registered here; their contents are captured later.  Returns -1
+		// for nil.
+		int Capture(lua_State * L, int index, int seen) {
+			index = lua_absindex(L, index);
+			const int type = lua_type(L, index);
+			switch (type) {
+				case LUA_TNIL:
+				case LUA_TNONE:
+					return -1;
+				case LUA_TNUMBER:
+				case LUA_TBOOLEAN:
 				case LUA_TLIGHTUSERDATA:
-				{
-					void * value = lua_touserdata(lua_state_->GetCState(), -1);
-					lua_pop(lua_state_->GetCState(), 1);
-					return value;
+					break;
+				default:
+					lua_pushvalue(L, index);
+					lua_rawget(L, seen);
+					if ( ! lua_isnil(L, -1)) {
+						int existing = (int)lua_tointeger(L, -1);
+						lua_pop(L, 1);
+						return existing;
+					}
+					lua_pop(L, 1);
+					break;
+			}
+			nodes_.push_back(Node());
+			Node & node = nodes_.back();
+			node.type = type;
+			switch (type) {
+				case LUA_TNUMBER:
+					node.number = lua_tonumber(L, index);
+					return (int)nodes_.size() - 1;
+				case LUA_TBOOLEAN:
+					node.boolean = lua_toboolean(L, index) != 0;
+					return (int)nodes_.size() - 1;
+				case LUA_TLIGHTUSERDATA:
+					node.light_userdata = lua_touserdata(L, index);
+					return (int)nodes_.size() - 1;
+				case LUA_TSTRING: {
+					size_t len = 0;
+					const char * value = lua_tolstring(L, index, &len);
+					node.data.assign(value, len);
+					break;
 				}
-				
 				default:
-					luapluslite_assert(Type() == LUA_TUSERDATA || Type() == LUA_TLIGHTUSERDATA);
-					return NULL;
+					break;
 			}
+			const int node_index = (int)nodes_.size() - 1;
+			lua_pushvalue(L, index);
+			lua_pushinteger(L, node_index);
+			lua_rawset(L, seen);
+			lua_pushvalue(L, index);
+			lua_rawseti(L, seen + 1, node_index + 1);
+			return node_index;
 		}
-
-#if defined(__clang__) || defined(__GNUC__)
-#pragma mark - Type Checking
-#endif
-
-		int Type() const {
-			if ( ! lua_state_) {
-				return LUA_TNONE;
+		
+		// Captures the fields and metatable of the table at the top of the stack.
+		void CaptureTable(lua_State * L, int node_index, int seen) {
+			lua_pushnil(L);
+			while (lua_next(L, -2) != 0) {
+				int key = Capture(L, -2, seen);
+				int value = Capture(L, -1, seen);
+				if (key >= 0 && value >= 0) {
+					nodes_[node_index].fields.push_back(std::make_pair(key, value));
+				}
+				lua_pop(L, 1);
+			}
+			if (lua_getmetatable(L, -1)) {
+				int metatable = Capture(L, -1, seen);
+				nodes_[node_index].metatable = metatable;
+				lua_pop(L, 1);
 			}
-			Push();
-			int type = lua_type(lua_state_->GetCState(), -1);
-			lua_pop(lua_state_->GetCState(), 1);
-			return type;
 		}
 		
-		const char * TypeName() {
-			int type = Type();
-			if (lua_state_) {
-				return lua_typename(lua_state_->GetCState(), type);
+		// Captures the code and upvalues of the function at the top of the stack.
+		// Upvalues are identified by lua_upvalueid, and 'upvalue_ids' maps
+		// each one to the first closure, and index, it was seen at.
+		void CaptureFunction(lua_State * L, int node_index, int seen, std::map<void *, std::pair<int, int> > * upvalue_ids) {
+			const bool is_lua_function = ! lua_iscfunction(L, -1);
+			if (is_lua_function) {
+				lua_pushvalue(L, -1);
+				if (lua_dump(L, &LuaStateSnapshot::Writer, &nodes_[node_index].data) != 0) {
+					luaL_error(L, "not enough memory");
+				}
+				lua_pop(L, 1);
 			} else {
-				return lua_typename(NULL, type);
+				nodes_[node_index].cfunction = lua_tocfunction(L, -1);
 			}
-		}
-		
-		bool IsBoolean() const {
-			if ( ! lua_state_) {
-				return false;
+			for (int i = 1; lua_getupvalue(L, -1, i) != NULL; ++i) {
+				Upvalue upvalue = { Capture(L, -1, seen), -1, -1 };
+				lua_pop(L, 1);
+				if (is_lua_function) {
+					std::map<void *, std::pair<int, int> >::iterator shared = upvalue_ids->find(lua_upvalueid(L, -1, i));
+					if (shared != upvalue_ids->end()) {
+						upvalue.shared_node = shared->second.first;
+						upvalue.shared_index = shared->second.second;
+					} else {
+						(*upvalue_ids)[lua_upvalueid(L, -1, i)] = std::make_pair(node_index, i);
+					}
+				}
+				nodes_[node_index].upvalues.push_back(upvalue);
 			}
-			Push();
-			const bool is_match = lua_isboolean(lua_state_->GetCState(), -1);
-			lua_state_->Pop(1);
-			return is_match;
 		}
 		
-		bool IsConvertibleToString() const {
-			if ( ! lua_state_) {
-				return false;
+		// Records the value at the top of the stack, which is popped, as
+		// the restored form of 'node_index'.  Tables and functions are
+		// queued so that their contents are mapped too.
+		void Map(lua_State * L, int node_index, int objects, std::vector<char> * mapped, std::vector<int> * order) const {
+			if (node_index < 0 || (*mapped)[node_index]) {
+				lua_pop(L, 1);
+				return;
+			}
+			lua_rawseti(L, objects, node_index + 1);
+			(*mapped)[node_index] = REUSED;
+			if (nodes_[node_index].type == LUA_TTABLE || nodes_[node_index].type == LUA_TFUNCTION) {
+				order->push_back(node_index);
 			}
-			Push();
-			const bool is_match = lua_isstring(lua_state_->GetCState(), -1);
-			lua_state_->Pop(1);
-			return is_match;
 		}
 		
-		bool IsInteger() const {
-			return IsNumber();
+		// Maps the value of a field, given its key at the top of the stack
+		// and its table below that.  Values that the new state already has
+		// at the same place are reused.
+		void MapField(lua_State * L, int node_index, int objects, std::vector<char> * mapped, std::vector<int> * order) const {
+			if (node_index < 0 || (*mapped)[node_index]) {
+				return;
+			}
+			const Node & node = nodes_[node_index];
+			if (node.type == LUA_TTABLE || node.type == LUA_TUSERDATA || node.type == LUA_TFUNCTION) {
+				lua_pushvalue(L, -1);
+				lua_rawget(L, -3);
+				const bool matches = (lua_type(L, -1) == node.type) && (node.type != LUA_TFUNCTION || (node.data.empty() && lua_tocfunction(L, -1) == node.cfunction));
+				if (matches) {
+					Map(L, node_index, objects, mapped, order);
+					return;
+				}
+				lua_pop(L, 1);
+			}
+			Create(L, node_index, objects, mapped, order);
 		}
 		
-		bool IsString() const {
-#if LuaPlusLite__IsString_and_IsNumber_only_match_explicitly == 1
-			return Type() == LUA_TSTRING;
-#else
-			return IsConvertibleToString();
-#endif
+		// Creates a new, empty table, or a function with unset upvalues,
+		// for 'node_index'.  Other userdata and threads are left unmapped.
+		void Create(lua_State * L, int node_index, int objects, std::vector<char> * mapped, std::vector<int> * order) const {
+			const Node & node = nodes_[node_index];
+			if (node.type == LUA_TTABLE) {
+				lua_createtable(L, 0, (int)node.fields.size());
+			} else if (node.type == LUA_TFUNCTION && node.data.empty()) {
+				luaL_checkstack(L, (int)node.upvalues.size(), NULL);
+				for (size_t i = 0; i < node.upvalues.size(); ++i) {
+					lua_pushnil(L);
+				}
+				lua_pushcclosure(L, node.cfunction, (int)node.upvalues.size());
+			} else if (node.type == LUA_TFUNCTION) {
+				std::pair<const std::string *, bool> reader_state(&node.data, false);
+				if (lua_load(L, &LuaStateSnapshot::Reader, &reader_state, "=(snapshot)", "b") != LUA_OK) {
+					const char * error_message = lua_tostring(L, -1);
+					luaL_error(L, "cannot restore a function from a snapshot: %s", error_message ? error_message : "(error object is not a string)");
+				}
+			} else {
+				return;
+			}
+			lua_rawseti(L, objects, node_index + 1);
+			(*mapped)[node_index] = CREATED;
+			order->push_back(node_index);
 		}
 		
-		bool IsNumber() const {
-			if ( ! lua_state_) {
+		// Pushes the restored form of 'node_index'.  Returns false, and
+		// pushes nothing, if it has none.  If 'mapped' is given, tables
+		// and functions not yet mapped are created first.
+		bool PushNode(lua_State * L, int node_index, int objects, std::vector<char> * mapped, std::vector<int> * order) const {
+			if (node_index < 0) {
 				return false;
 			}
-#if LuaPlusLite__IsString_and_IsNumber_only_match_explicitly == 1
-			return Type() == LUA_TNUMBER;
-#else
-			Push();
-			const bool is_match = lua_isnumber(lua_state_->GetCState(), -1);
-			lua_state_->Pop(1);
-			return is_match;
-#endif
-		}
-		
-		bool IsTable() const {
-			if ( ! lua_state_) {
+			const Node & node = nodes_[node_index];
+			switch (node.type) {
+				case LUA_TNUMBER:
+					lua_pushnumber(L, node.number);
+					return true;
+				case LUA_TBOOLEAN:
+					lua_pushboolean(L, node.boolean);
+					return true;
+				case LUA_TLIGHTUSERDATA:
+					lua_pushlightuserdata(L, node.light_userdata);
+					return true;
+				case LUA_TSTRING:
+					// Strings are interned once, and then kept with the
+					// restored objects, as most are used many times over.
+					lua_rawgeti(L, objects, node_index + 1);
+					if (lua_isnil(L, -1)) {
+						lua_pop(L, 1);
+						lua_pushlstring(L, node.data.data(), node.data.size());
+						lua_pushvalue(L, -1);
+						lua_rawseti(L, objects, node_index + 1);
+					}
+					return true;
+				default:
+					break;
+			}
+			if (mapped && ! (*mapped)[node_index]) {
+				Create(L, node_index, objects, mapped, order);
+			}
+			lua_rawgeti(L, objects, node_index + 1);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
 				return false;
 			}
-			Push();
-			const bool is_match = lua_istable(lua_state_->GetCState(), -1);
-			lua_state_->Pop(1);
-			return is_match;
+			return true;
 		}
 		
-		bool IsNil() const {
-			if ( ! lua_state_) {
-				return false;
+		// Sets the upvalues of the function at the top of the stack.
+		void RestoreUpvalues(lua_State * L, const Node & node, int objects) const {
+			const int function_index = lua_gettop(L);
+			for (size_t i = 0; i < node.upvalues.size(); ++i) {
+				const Upvalue & upvalue = node.upvalues[i];
+				if (upvalue.shared_node >= 0) {
+					lua_rawgeti(L, objects, upvalue.shared_node + 1);
+					if (lua_isfunction(L, -1) && ! lua_iscfunction(L, -1)) {
+						lua_upvaluejoin(L, function_index, (int)i + 1, -1, upvalue.shared_index);
+						lua_pop(L, 1);
+						continue;
+					}
+					lua_pop(L, 1);
+				}
+				if ( ! PushNode(L, upvalue.value, objects, NULL, NULL)) {
+					lua_pushnil(L);
+				}
+				if (lua_setupvalue(L, function_index, (int)i + 1) == NULL) {
+					lua_pop(L, 1);
+				}
 			}
-			Push();
-			const bool is_match = lua_isnil(lua_state_->GetCState(), -1);
-			lua_state_->Pop(1);
-			return is_match;
 		}
 		
-		bool IsNone() const {
-			// API DIFFERENCE: LuaPlus will return 'false' if IsNone() is called
-			// on an uninitialized LuaObject.  LuaPlusLite will return 'true'
-			// instead.
-			if ( ! lua_state_) {
-				return true;
+		LuaState::Options options_;
+		std::vector<Node> nodes_;
+		int globals_;
+		int loaded_;
+		int string_metatable_;
+	};
+	
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - LuaStatePool
+#endif
+
+	// A LuaStatePool keeps warmed-up LuaStates for worker threads to
+	// borrow, so that a request doesn't pay for creating a state, opening
+	// its libraries and running its scripts:
+	//
+	//   LuaStatePool pool(snapshot, 16);
+	//   ...
+	//   {
+	//       LuaStatePool::Lease lease = pool.Acquire();	// On any thread.
+	//       lease->DoString(...);
+	//   }	// The state goes back to the pool here.
+	//
+	// States are created as they are needed, up to 'capacity', either from
+	// a LuaStateSnapshot (which must outlive the pool) or from Options and
+	// an initializer function.  Acquire() waits when every state is out;
+	// TryAcquire() returns an empty Lease instead.
+	//
+	// When a state comes back, the pool clears its stack, puts its globals
+	// back the way they were once it was initialized, and runs an
+	// incremental GC step.  The baseline is shallow: the globals table and
+	// each table in package.loaded get their original fields and
+	// metatables back, and fields added since are removed, but changes made
+	// further in (to a table stored in a global, say) are kept.  LuaObjects
+	// referring into a state must be destroyed before it is returned.  If
+	// resetting a state raises an error (running out of memory, or a
+	// failing __gc metamethod), the state is closed rather than reused.
+	class LuaStatePool {
+	private:
+		struct Entry;
+		
+	public:
+		struct Stats {
+			size_t acquires;				// Successful Acquire() and TryAcquire() calls...
+			size_t hits;					// ...and how many of them got an idle state.
+			size_t waits;					// Acquire() calls that had to block.
+			size_t failed_try_acquires;		// TryAcquire() calls that came back empty.
+			size_t states_created;
+			size_t states_discarded;		// States closed because they couldn't be reset.
+			size_t resets;
+			double total_reset_seconds;
+			double max_reset_seconds;
+			
+			Stats() : acquires(0), hits(0), waits(0), failed_try_acquires(0), states_created(0), states_discarded(0), resets(0), total_reset_seconds(0), max_reset_seconds(0) {
 			}
-			Push();
-			const bool is_match = lua_isnone(lua_state_->GetCState(), -1);
-			lua_state_->Pop(1);
-			return is_match;
-		}
+			
+			double HitRate() const {
+				return acquires ? (double)hits / acquires : 0.0;
+			}
+			
+			double AverageResetSeconds() const {
+				return resets ? total_reset_seconds / resets : 0.0;
+			}
+		};
 		
-		bool IsNoneOrNil() const {
-			if ( ! lua_state_) {
-				return true;
+		// Gives one thread the use of a pooled state, and returns the state
+		// to its pool when destroyed or Release()d.  A lease that outlives
+		// its pool closes the state instead.  Leases can be moved but not
+		// copied.
+		class Lease {
+		public:
+			Lease() : entry_(NULL) {
 			}
-			Push();
-			const bool is_match = lua_isnoneornil(lua_state_->GetCState(), -1);
+			
+			Lease(Lease && src) : entry_(src.entry_) {
+				src.entry_ = NULL;
+			}
+			
+			Lease & operator=(Lease && src) {
+				if (this != &src) {
+					Release();
+					entry_ = src.entry_;
+					src.entry_ = NULL;
+				}
+				return *this;
+			}
+			
+			~Lease() {
+				Release();
+			}
+			
+			bool IsValid() const {
+				return entry_ != NULL;
+			}
+			
+			explicit operator bool() const {
+				return entry_ != NULL;
+			}
+			
+			LuaState * Get() const {
+				return entry_ ? entry_->state : NULL;
+			}
+			
+			LuaState & operator*() const {
+				luapluslite_assert(entry_ != NULL);
+				return *entry_->state;
+			}
+			
+			LuaState * operator->() const {
+				luapluslite_assert(entry_ != NULL);
+				return entry_->state;
+			}
+			
+			void Release() {
+				if (entry_) {
+					Entry * entry = entry_;
+					entry_ = NULL;
+					if (entry->pool) {
+						entry->pool->Return(entry);
+					} else {
+						delete entry;
+					}
+				}
+			}
+			
+		private:
+			friend class LuaStatePool;
+			
+			explicit Lease(Entry * entry) : entry_(entry) {
+			}
+			
+			Lease(const Lease &);
+			Lease & operator=(const Lease &);
+			
+			Entry * entry_;
+		};
+		
+		// Creates 'prewarm' states straight away, and the rest on demand.
+		LuaStatePool(const LuaStateSnapshot & snapshot, size_t capacity, size_t prewarm = 0) : snapshot_(&snapshot), capacity_(capacity), num_states_(0) {
+			Prewarm(prewarm);
+		}
+		
+		// States are created with 'options', and then passed to
+		// 'initializer', if there is one, to run their scripts.
+		LuaStatePool(const LuaState::Options & options, std::function<void (LuaState &)> initializer, size_t capacity, size_t prewarm = 0)
+			: snapshot_(NULL), options_(options), initializer_(initializer), capacity_(capacity), num_states_(0) {
+			Prewarm(prewarm);
+		}
+		
+		// Leases still held are detached from the pool, and close their
+		// states when released.  They must not be released while the pool
+		// is being destroyed.
+		~LuaStatePool() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (size_t i = 0; i < entries_.size(); ++i) {
+				entries_[i]->pool = NULL;
+			}
+			for (size_t i = 0; i < idle_.size(); ++i) {
+				delete idle_[i];
+			}
+		}
+		
+		// Returns an idle state, creates one if there is room, or else
+		// waits for one to be returned.
+		Lease Acquire() {
+			std::unique_lock<std::mutex> lock(mutex_);
+			bool waited = false;
+			while (idle_.empty() && num_states_ >= capacity_) {
+				if ( ! waited) {
+					++stats_.waits;
+					waited = true;
+				}
+				available_.wait(lock);
+			}
+			return AcquireLocked(lock);
+		}
+		
+		// As Acquire(), but returns an empty Lease rather than waiting.
+		Lease TryAcquire() {
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (idle_.empty() && num_states_ >= capacity_) {
+				++stats_.failed_try_acquires;
+				return Lease();
+			}
+			return AcquireLocked(lock);
+		}
+		
+		size_t GetCapacity() const {
+			return capacity_;
+		}
+		
+		size_t GetIdleCount() const {
+			std::lock_guard<std::mutex> lock(mutex_);
+			return idle_.size();
+		}
+		
+		Stats GetStats() const {
+			std::lock_guard<std::mutex> lock(mutex_);
+			return stats_;
+		}
+		
+	private:
+		LuaStatePool(const LuaStatePool &);
+		LuaStatePool & operator=(const LuaStatePool &);
+		
+		struct Entry {
+			LuaStatePool * pool;		// NULL once the pool is destroyed.
+			LuaState * state;
+			int baseline_ref;
+			
+			Entry() : pool(NULL), state(NULL), baseline_ref(LUA_NOREF) {
+			}
+			
+			~Entry() {
+				delete state;
+			}
+		};
+		
+		void Prewarm(size_t count) {
+			luapluslite_assert(capacity_ > 0);
+			// Adding an entry, or returning one, then never allocates.
+			entries_.reserve(capacity_);
+			idle_.reserve(capacity_);
+			for (size_t i = 0; i < count && i < capacity_; ++i) {
+				Entry * entry = CreateEntry();
+				entries_.push_back(entry);
+				idle_.push_back(entry);
+				++num_states_;
+				++stats_.states_created;
+			}
+		}
+		
+		// Called with a state available, or room to create one.
+		Lease AcquireLocked(std::unique_lock<std::mutex> & lock) {
+			if ( ! idle_.empty()) {
+				Entry * entry = idle_.back();
+				idle_.pop_back();
+				++stats_.acquires;
+				++stats_.hits;
+				return Lease(entry);
+			}
+			
+			// Hold the place while the state is created outside the lock.
+			++num_states_;
+			lock.unlock();
+			Entry * entry = NULL;
+			try {
+				entry = CreateEntry();
+			} catch (...) {
+				lock.lock();
+				--num_states_;
+				available_.notify_one();
+				throw;
+			}
+			lock.lock();
+			entries_.push_back(entry);
+			++stats_.acquires;
+			++stats_.states_created;
+			return Lease(entry);
+		}
+		
+		Entry * CreateEntry() {
+			Entry * entry = new Entry;
+			entry->pool = this;
+			try {
+				if (snapshot_) {
+					entry->state = new LuaState(*snapshot_);
+				} else {
+					entry->state = new LuaState(options_);
+					if (initializer_) {
+						initializer_(*entry->state);
+					}
+				}
+				lua_State * L = entry->state->GetCState();
+				lua_settop(L, 0);
+				lua_pushcfunction(L, &LuaStatePool::CaptureBaseline);
+				if (lua_pcall(L, 0, 1, 0) != LUA_OK) {
+					throw LuaException(lua_tostring(L, -1) ? lua_tostring(L, -1) : "error capturing a pooled state's baseline");
+				}
+				entry->baseline_ref = (int)lua_tointeger(L, -1);
+				lua_pop(L, 1);
+			} catch (...) {
+				delete entry;
+				throw;
+			}
+			return entry;
+		}
+		
+		void Return(Entry * entry) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			lua_State * L = entry->state->GetCState();
+			lua_settop(L, 0);
+			lua_pushcfunction(L, &LuaStatePool::RestoreBaseline);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, entry->baseline_ref);
+			const bool reset = lua_pcall(L, 1, 0, 0) == LUA_OK;
+			lua_settop(L, 0);
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			
+			std::lock_guard<std::mutex> lock(mutex_);
+			++stats_.resets;
+			stats_.total_reset_seconds += seconds;
+			if (seconds > stats_.max_reset_seconds) {
+				stats_.max_reset_seconds = seconds;
+			}
+			if (reset) {
+				idle_.push_back(entry);
+			} else {
+				entries_.erase(std::find(entries_.begin(), entries_.end(), entry));
+				delete entry;
+				--num_states_;
+				++stats_.states_discarded;
+			}
+			available_.notify_one();
+		}
+		
+		// Returns a registry reference to the baseline: a sequence holding,
+		// for the globals table and each table in package.loaded, the
+		// table, a shallow copy of it and its metatable (or false).
+		static int CaptureBaseline(lua_State * L) {
+			lua_newtable(L);
+			const int baseline = lua_gettop(L);
+			lua_newtable(L);	// Tables already added.
+			const int seen = lua_gettop(L);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+			AddToBaseline(L, baseline, seen);
+			lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+			if (lua_istable(L, -1)) {
+				lua_pushnil(L);
+				while (lua_next(L, -2) != 0) {
+					if (lua_istable(L, -1)) {
+						AddToBaseline(L, baseline, seen);
+					} else {
+						lua_pop(L, 1);
+					}
+				}
+				AddToBaseline(L, baseline, seen);
+			} else {
+				lua_pop(L, 1);
+			}
+			lua_settop(L, baseline);
+			lua_pushinteger(L, luaL_ref(L, LUA_REGISTRYINDEX));
+			return 1;
+		}
+		
+		// Pops the table on top of the stack and adds it to the baseline.
+		static void AddToBaseline(lua_State * L, int baseline, int seen) {
+			lua_pushvalue(L, -1);
+			lua_rawget(L, seen);
+			if ( ! lua_isnil(L, -1)) {
+				lua_pop(L, 2);
+				return;
+			}
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, seen);
+			
+			const int table = lua_gettop(L);
+			const int n = (int)lua_rawlen(L, baseline);
+			lua_newtable(L);
+			lua_pushnil(L);
+			while (lua_next(L, table) != 0) {
+				lua_pushvalue(L, -2);
+				lua_insert(L, -2);
+				lua_rawset(L, table + 1);
+			}
+			if ( ! lua_getmetatable(L, table)) {
+				lua_pushboolean(L, 0);
+			}
+			lua_rawseti(L, baseline, n + 3);
+			lua_rawseti(L, baseline, n + 2);
+			lua_rawseti(L, baseline, n + 1);
+		}
+		
+		static int RestoreBaseline(lua_State * L) {
+			const int baseline = 1;
+			const int count = (int)lua_rawlen(L, baseline);
+			for (int i = 1; i + 2 <= count; i += 3) {
+				lua_rawgeti(L, baseline, i);
+				const int table = lua_gettop(L);
+				lua_rawgeti(L, baseline, i + 1);
+				const int copy = table + 1;
+				
+				// Remove fields added since the baseline was taken.  Clearing
+				// a field while traversing the table is allowed.
+				lua_pushnil(L);
+				while (lua_next(L, table) != 0) {
+					lua_pop(L, 1);
+					lua_pushvalue(L, -1);
+					lua_rawget(L, copy);
+					if (lua_isnil(L, -1)) {
+						lua_pop(L, 1);
+						lua_pushvalue(L, -1);
+						lua_pushnil(L);
+						lua_rawset(L, table);
+					} else {
+						lua_pop(L, 1);
+					}
+				}
+				
+				// Put back fields that were changed or removed.
+				lua_pushnil(L);
+				while (lua_next(L, copy) != 0) {
+					lua_pushvalue(L, -2);
+					lua_rawget(L, table);
+					if ( ! lua_rawequal(L, -1, -2)) {
+						lua_pop(L, 1);
+						lua_pushvalue(L, -2);
+						lua_insert(L, -2);
+						lua_rawset(L, table);
+					} else {
+						lua_pop(L, 2);
+					}
+				}
+				
+				lua_rawgeti(L, baseline, i + 2);
+				if (lua_toboolean(L, -1) == 0) {
+					lua_pop(L, 1);
+					lua_pushnil(L);
+				}
+				lua_setmetatable(L, table);
+				lua_settop(L, baseline);
+			}
+			
+			// Collect some of what the request left behind.  This is done
+			// here, where an error from a __gc metamethod is caught.
+			lua_gc(L, LUA_GCSTEP, 0);
+			return 0;
+		}
+		
+		const LuaStateSnapshot * snapshot_;
+		LuaState::Options options_;
+		std::function<void (LuaState &)> initializer_;
+		const size_t capacity_;
+		
+		mutable std::mutex mutex_;
+		std::condition_variable available_;
+		std::vector<Entry *> entries_;	// Idle and leased.
+		std::vector<Entry *> idle_;
+		size_t num_states_;		// Idle and leased, counting those being created.
+		Stats stats_;
+	};
+	
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - LuaStringView
+#endif
+
+	// A pointer and a length, referring to characters owned by someone
+	// else, usually a Lua string.  Strings read through a LuaStringView are
+	// neither copied nor measured with strlen, and may contain embedded
+	// zeros.  Under C++17, a LuaStringView converts to a std::string_view.
+	class LuaStringView {
+	public:
+		typedef const char * const_iterator;
+		
+		LuaStringView() : data_(NULL), size_(0)
+		{
+		}
+		
+		LuaStringView(const char * data, size_t size) : data_(data), size_(size)
+		{
+		}
+		
+		LuaStringView(const char * str) : data_(str), size_(str ? std::char_traits<char>::length(str) : 0)
+		{
+		}
+		
+		LuaStringView(const std::string & str) : data_(str.data()), size_(str.size())
+		{
+		}
+		
+#if __cplusplus >= 201703L
+		LuaStringView(std::string_view str) : data_(str.data()), size_(str.size())
+		{
+		}
+		
+		operator std::string_view() const {
+			return std::string_view(data_, size_);
+		}
+#endif
+		
+		const char * data() const {
+			return data_;
+		}
+		
+		size_t size() const {
+			return size_;
+		}
+		
+		size_t length() const {
+			return size_;
+		}
+		
+		bool empty() const {
+			return size_ == 0;
+		}
+		
+		const_iterator begin() const {
+			return data_;
+		}
+		
+		const_iterator end() const {
+			return data_ + size_;
+		}
+		
+		char operator[](size_t index) const {
+			return data_[index];
+		}
+		
+		std::string ToStdString() const {
+			return data_ ? std::string(data_, size_) : std::string();
+		}
+		
+		bool operator==(const LuaStringView & other) const {
+			return size_ == other.size_ && (size_ == 0 || std::char_traits<char>::compare(data_, other.data_, size_) == 0);
+		}
+		
+		bool operator!=(const LuaStringView & other) const {
+			return ! (*this == other);
+		}
+		
+	private:
+		const char * data_;
+		size_t size_;
+	};
+	
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - LuaMessage
+#endif
+
+	class LuaMessageQueue;
+	
+	// How deeply tables may nest in a LuaMessage, which keeps encoding
+	// and decoding them from running out of C stack.
+	static const int LUAPLUSLITE_MESSAGE_MAX_DEPTH = 200;
+	
+	// A LuaMessage carries values from one LuaState to another, usually on
+	// another thread.  Lua values can't be shared between states, so they
+	// are serialized into one flat buffer: nil, booleans, numbers, strings,
+	// light userdata, and tables of those, including tables that refer to
+	// themselves or share subtables.  Metatables are not sent, and sending
+	// a function, full userdata or thread throws a LuaException.
+	//
+	// A string is copied out of the sending state into the buffer, and the
+	// receiving state lua_pushlstring()s it straight from there.  Every Lua
+	// 5.2 string belongs to one state's collector, so those two copies are
+	// as few as there can be; C++ code reading a message through a Reader
+	// gets LuaStringViews into the buffer, and makes none.
+	//
+	// A message can also name a global function for a LuaWorkerPool to
+	// call with its values, and a queue for the results.
+	class LuaMessage {
+	public:
+		LuaMessage() : count_(0), num_tables_(0), is_error_(false), reply_to_(NULL), next_(NULL) {
+		}
+		
+		explicit LuaMessage(const std::string & function_name) : count_(0), num_tables_(0), function_name_(function_name), is_error_(false), reply_to_(NULL), next_(NULL) {
+		}
+		
+		void AddNil() {
+			buffer_ += (char)TAG_NIL;
+			++count_;
+		}
+		
+		void AddBoolean(bool value) {
+			buffer_ += (char)(value ? TAG_TRUE : TAG_FALSE);
+			++count_;
+		}
+		
+		void AddNumber(lua_Number value) {
+			AppendNumber(value);
+			++count_;
+		}
+		
+		void AddInteger(lua_Integer value) {
+			AddNumber((lua_Number)value);
+		}
+		
+		void AddString(const char * str) {
+			luapluslite_assert(str != NULL);
+			AddString(str, strlen(str));
+		}
+		
+		void AddString(const char * str, size_t len) {
+			AppendString(str, len);
+			++count_;
+		}
+		
+		void AddString(const std::string & str) {
+			AddString(str.data(), str.size());
+		}
+		
+		void AddString(const LuaStringView & str) {
+			AddString(str.data(), str.size());
+		}
+		
+		void AddLightUserData(void * value) {
+			buffer_ += (char)TAG_LIGHTUSERDATA;
+			buffer_.append((const char *)&value, sizeof(value));
+			++count_;
+		}
+		
+		// Serializes the value at 'index' in 'L'.  If it can't be sent,
+		// or holds tables nested more than LUAPLUSLITE_MESSAGE_MAX_DEPTH
+		// deep, throws a LuaException and leaves the message as it was.
+		void AddValue(lua_State * L, int index) {
+			index = lua_absindex(L, index);
+			const size_t old_size = buffer_.size();
+			const int old_num_tables = num_tables_;
+			const int old_top = lua_gettop(L);
+			try {
+				if (lua_type(L, index) == LUA_TTABLE) {
+					if ( ! lua_checkstack(L, 4)) {
+						throw LuaException("stack overflow");
+					}
+					lua_newtable(L);	// Table -> table number, for repeats.
+					Encode(L, index, lua_gettop(L), 0);
+				} else {
+					Encode(L, index, 0, 0);
+				}
+			} catch (...) {
+				lua_settop(L, old_top);
+				buffer_.resize(old_size);
+				num_tables_ = old_num_tables;
+				throw;
+			}
+			lua_settop(L, old_top);
+			++count_;
+		}
+		
+		void AddValues(lua_State * L, int first, int count) {
+			first = lua_absindex(L, first);
+			for (int i = 0; i < count; ++i) {
+				AddValue(L, first + i);
+			}
+		}
+		
+		// Pushes the message's values onto 'L', and returns how many there
+		// were.
+		int Push(lua_State * L) const {
+			const int count = PushValues(L);
+			if (count < 0) {
+				throw LuaException("stack overflow");
+			}
+			return count;
+		}
+		
+		// As Push, but returns -1, with the stack as it was, if the stack
+		// can't grow enough, for callers that must not throw (such as
+		// lua_CFunctions).
+		int PushValues(lua_State * L) const {
+			const int old_top = lua_gettop(L);
+			if ( ! lua_checkstack(L, (int)count_ + 4)) {
+				return -1;
+			}
+			int refs = 0;
+			if (num_tables_ > 0) {
+				lua_createtable(L, num_tables_, 0);	// Table number -> table.
+				refs = lua_gettop(L);
+			}
+			const char * p = buffer_.data();
+			int num_tables = 0;
+			for (size_t i = 0; i < count_; ++i) {
+				p = Decode(L, p, refs, &num_tables);
+				if (p == NULL) {
+					lua_settop(L, old_top);
+					return -1;
+				}
+			}
+			if (refs != 0) {
+				lua_remove(L, refs);
+			}
+			return (int)count_;
+		}
+		
+		int Push(LuaState & state) const {
+			return Push(state.GetCState());
+		}
+		
+		size_t GetCount() const {
+			return count_;
+		}
+		
+		// The serialized values.
+		const std::string & GetData() const {
+			return buffer_;
+		}
+		
+		// Removes the values, keeping the function name and reply queue.
+		void Clear() {
+			buffer_.clear();
+			count_ = 0;
+			num_tables_ = 0;
+		}
+		
+		const std::string & GetFunctionName() const {
+			return function_name_;
+		}
+		
+		void SetFunctionName(const std::string & function_name) {
+			function_name_ = function_name;
+		}
+		
+		LuaMessageQueue * GetReplyTo() const {
+			return reply_to_;
+		}
+		
+		void SetReplyTo(LuaMessageQueue * reply_to) {
+			reply_to_ = reply_to;
+		}
+		
+		// A reply from a call that failed holds just the error message.
+		bool IsError() const {
+			return is_error_;
+		}
+		
+		void SetError(bool is_error) {
+			is_error_ = is_error;
+		}
+		
+		// Walks a message's values from C++, without a LuaState:
+		//
+		//   LuaMessage::Reader reader(message);
+		//   while (reader.Next()) {
+		//       if (reader.Type() == LUA_TSTRING) { LuaStringView s = reader.ToStringView(); ... }
+		//   }
+		//
+		// Tables are skipped over as single values.  Views and the reader
+		// itself are valid while the message is unchanged.
+		class Reader {
+		public:
+			explicit Reader(const LuaMessage & message) : current_(NULL), next_(message.buffer_.data()), remaining_(message.count_) {
+			}
+			
+			// Moves to the next value, returning false when there are none
+			// left.  Call it once before reading the first value.
+			bool Next() {
+				if (remaining_ == 0) {
+					current_ = NULL;
+					return false;
+				}
+				current_ = next_;
+				next_ = Skip(current_);
+				--remaining_;
+				return true;
+			}
+			
+			int Type() const {
+				luapluslite_assert(current_ != NULL);
+				switch (*current_) {
+					case TAG_FALSE:
+					case TAG_TRUE:
+						return LUA_TBOOLEAN;
+					case TAG_NUMBER:
+						return LUA_TNUMBER;
+					case TAG_STRING:
+						return LUA_TSTRING;
+					case TAG_LIGHTUSERDATA:
+						return LUA_TLIGHTUSERDATA;
+					case TAG_TABLE:
+					case TAG_TABLE_REF:
+						return LUA_TTABLE;
+				}
+				return LUA_TNIL;
+			}
+			
+			bool ToBoolean() const {
+				luapluslite_assert(Type() == LUA_TBOOLEAN);
+				return *current_ == TAG_TRUE;
+			}
+			
+			lua_Number ToNumber() const {
+				luapluslite_assert(Type() == LUA_TNUMBER);
+				lua_Number value;
+				memcpy(&value, current_ + 1, sizeof(value));
+				return value;
+			}
+			
+			lua_Integer ToInteger() const {
+				return (lua_Integer)ToNumber();
+			}
+			
+			LuaStringView ToStringView() const {
+				luapluslite_assert(Type() == LUA_TSTRING);
+				size_t len;
+				memcpy(&len, current_ + 1, sizeof(len));
+				return LuaStringView(current_ + 1 + sizeof(len), len);
+			}
+			
+			void * ToLightUserData() const {
+				luapluslite_assert(Type() == LUA_TLIGHTUSERDATA);
+				void * value;
+				memcpy(&value, current_ + 1, sizeof(value));
+				return value;
+			}
+			
+		private:
+			const char * current_;
+			const char * next_;
+			size_t remaining_;
+		};
+		
+	private:
+		friend class LuaMessageQueue;
+		
+		LuaMessage(const LuaMessage &);
+		LuaMessage & operator=(const LuaMessage &);
+		
+		enum {
+			TAG_NIL,
+			TAG_FALSE,
+			TAG_TRUE,
+			TAG_NUMBER,				// Followed by a lua_Number.
+			TAG_STRING,				// Followed by a size_t length and the characters.
+			TAG_LIGHTUSERDATA,		// Followed by a void *.
+			TAG_TABLE,				// Followed by keys and values, then TAG_END.
+			TAG_TABLE_REF,			// Followed by the int number of a table already sent.
+			TAG_END
+		};
+		
+		void AppendNumber(lua_Number value) {
+			buffer_ += (char)TAG_NUMBER;
+			buffer_.append((const char *)&value, sizeof(value));
+		}
+		
+		void AppendString(const char * str, size_t len) {
+			buffer_ += (char)TAG_STRING;
+			buffer_.append((const char *)&len, sizeof(len));
+			buffer_.append(str, len);
+		}
+		
+		void Encode(lua_State * L, int index, int seen, int depth) {
+			switch (lua_type(L, index)) {
+				case LUA_TNIL:
+					buffer_ += (char)TAG_NIL;
+					break;
+				case LUA_TBOOLEAN:
+					buffer_ += (char)(lua_toboolean(L, index) ? TAG_TRUE : TAG_FALSE);
+					break;
+				case LUA_TNUMBER:
+					AppendNumber(lua_tonumber(L, index));
+					break;
+				case LUA_TSTRING: {
+					size_t len;
+					const char * str = lua_tolstring(L, index, &len);
+					AppendString(str, len);
+					break;
+				}
+				case LUA_TLIGHTUSERDATA: {
+					void * value = lua_touserdata(L, index);
+					buffer_ += (char)TAG_LIGHTUSERDATA;
+					buffer_.append((const char *)&value, sizeof(value));
+					break;
+				}
+				case LUA_TTABLE: {
+					lua_pushvalue(L, index);
+					lua_rawget(L, seen);
+					if (lua_isnumber(L, -1)) {
+						const int number = (int)lua_tointeger(L, -1);
+						lua_pop(L, 1);
+						buffer_ += (char)TAG_TABLE_REF;
+						buffer_.append((const char *)&number, sizeof(number));
+						break;
+					}
+					lua_pop(L, 1);
+					if (depth >= LUAPLUSLITE_MESSAGE_MAX_DEPTH) {
+						throw LuaException("tables nest too deeply to be sent in a LuaMessage");
+					}
+					if ( ! lua_checkstack(L, 4)) {
+						throw LuaException("stack overflow");
+					}
+					lua_pushvalue(L, index);
+					lua_pushinteger(L, num_tables_++);
+					lua_rawset(L, seen);
+					buffer_ += (char)TAG_TABLE;
+					lua_pushnil(L);
+					while (lua_next(L, index) != 0) {
+						const int top = lua_gettop(L);
+						Encode(L, top - 1, seen, depth + 1);
+						Encode(L, top, seen, depth + 1);
+						lua_pop(L, 1);
+					}
+					buffer_ += (char)TAG_END;
+					break;
+				}
+				default:
+					throw LuaException(std::string("a ") + luaL_typename(L, index) + " can't be sent in a LuaMessage");
+			}
+		}
+		
+		// Pushes the value starting at 'p', and returns the end of it, or
+		// NULL if the stack can't grow enough.
+		static const char * Decode(lua_State * L, const char * p, int refs, int * num_tables) {
+			switch (*p++) {
+				case TAG_NIL:
+					lua_pushnil(L);
+					break;
+				case TAG_FALSE:
+					lua_pushboolean(L, 0);
+					break;
+				case TAG_TRUE:
+					lua_pushboolean(L, 1);
+					break;
+				case TAG_NUMBER: {
+					lua_Number value;
+					memcpy(&value, p, sizeof(value));
+					lua_pushnumber(L, value);
+					p += sizeof(value);
+					break;
+				}
+				case TAG_STRING: {
+					size_t len;
+					memcpy(&len, p, sizeof(len));
+					p += sizeof(len);
+					lua_pushlstring(L, p, len);
+					p += len;
+					break;
+				}
+				case TAG_LIGHTUSERDATA: {
+					void * value;
+					memcpy(&value, p, sizeof(value));
+					lua_pushlightuserdata(L, value);
+					p += sizeof(value);
+					break;
+				}
+				case TAG_TABLE: {
+					if ( ! lua_checkstack(L, 4)) {
+						return NULL;
+					}
+					lua_newtable(L);
+					lua_pushvalue(L, -1);
+					lua_rawseti(L, refs, ++*num_tables);
+					while (*p != TAG_END) {
+						p = Decode(L, p, refs, num_tables);
+						if (p != NULL) {
+							p = Decode(L, p, refs, num_tables);
+						}
+						if (p == NULL) {
+							return NULL;
+						}
+						lua_rawset(L, -3);
+					}
+					++p;
+					break;
+				}
+				case TAG_TABLE_REF: {
+					int number;
+					memcpy(&number, p, sizeof(number));
+					lua_rawgeti(L, refs, number + 1);
+					p += sizeof(number);
+					break;
+				}
+			}
+			return p;
+		}
+		
+		// Returns the end of the value starting at 'p'.
+		static const char * Skip(const char * p) {
+			switch (*p++) {
+				case TAG_NUMBER:
+					return p + sizeof(lua_Number);
+				case TAG_STRING: {
+					size_t len;
+					memcpy(&len, p, sizeof(len));
+					return p + sizeof(len) + len;
+				}
+				case TAG_LIGHTUSERDATA:
+					return p + sizeof(void *);
+				case TAG_TABLE:
+					while (*p != TAG_END) {
+						p = Skip(Skip(p));
+					}
+					return p + 1;
+				case TAG_TABLE_REF:
+					return p + sizeof(int);
+			}
+			return p;
+		}
+		
+		std::string buffer_;
+		size_t count_;
+		int num_tables_;
+		std::string function_name_;
+		bool is_error_;
+		LuaMessageQueue * reply_to_;
+		std::atomic<LuaMessage *> next_;	// For LuaMessageQueue.
+	};
+	
+	// A multiple-producer, single-consumer queue of LuaMessages.  Any
+	// thread may Push(), but only one thread at a time may Pop() or
+	// TryPop().  Pushing takes no lock: it is an atomic exchange and a
+	// store, as in Dmitry Vyukov's intrusive MPSC queue, and the lock and
+	// condition variable behind Pop() are only touched when the consumer
+	// is asleep.  Messages left in the queue are deleted with it.
+	class LuaMessageQueue {
+	public:
+		LuaMessageQueue() : head_(&stub_), tail_(&stub_), consumer_waiting_(false), closed_(false) {
+		}
+		
+		~LuaMessageQueue() {
+			while (LuaMessage * message = PopNode()) {
+				delete message;
+			}
+		}
+		
+		void Push(std::unique_ptr<LuaMessage> message) {
+			luapluslite_assert(message.get() != NULL);
+			PushNode(message.release());
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (consumer_waiting_.load(std::memory_order_relaxed)) {
+				std::lock_guard<std::mutex> lock(mutex_);
+				wakeup_.notify_one();
+			}
+		}
+		
+		// Returns NULL if the queue is empty, or a Push() to it is only
+		// partly done.
+		std::unique_ptr<LuaMessage> TryPop() {
+			return std::unique_ptr<LuaMessage>(PopNode());
+		}
+		
+		// Waits for a message.  Returns NULL once the queue is closed and
+		// there is nothing left in it.
+		std::unique_ptr<LuaMessage> Pop() {
+			LuaMessage * message = PopNode();
+			if (message == NULL) {
+				std::unique_lock<std::mutex> lock(mutex_);
+				consumer_waiting_.store(true, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				while ((message = PopNode()) == NULL && ! closed_) {
+					wakeup_.wait(lock);
+				}
+				consumer_waiting_.store(false, std::memory_order_relaxed);
+			}
+			return std::unique_ptr<LuaMessage>(message);
+		}
+		
+		// Wakes the consumer, whose Pop() then returns NULL when the queue
+		// runs dry.  Messages can still be pushed afterwards.
+		void Close() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			closed_ = true;
+			wakeup_.notify_all();
+		}
+		
+	private:
+		LuaMessageQueue(const LuaMessageQueue &);
+		LuaMessageQueue & operator=(const LuaMessageQueue &);
+		
+		void PushNode(LuaMessage * node) {
+			node->next_.store(NULL, std::memory_order_relaxed);
+			LuaMessage * prev = head_.exchange(node, std::memory_order_acq_rel);
+			prev->next_.store(node, std::memory_order_release);
+		}
+		
+		LuaMessage * PopNode() {
+			LuaMessage * tail = tail_;
+			LuaMessage * next = tail->next_.load(std::memory_order_acquire);
+			if (tail == &stub_) {
+				if (next == NULL) {
+					return NULL;
+				}
+				tail_ = next;
+				tail = next;
+				next = next->next_.load(std::memory_order_acquire);
+			}
+			if (next != NULL) {
+				tail_ = next;
+				return tail;
+			}
+			if (tail != head_.load(std::memory_order_acquire)) {
+				return NULL;	// A push is partly done.
+			}
+			
+			// 'tail' is the last message.  Put the stub behind it, so that
+			// it can be taken without leaving the queue without a node.
+			PushNode(&stub_);
+			next = tail->next_.load(std::memory_order_acquire);
+			if (next != NULL) {
+				tail_ = next;
+				return tail;
+			}
+			return NULL;
+		}
+		
+		LuaMessage stub_;
+		std::atomic<LuaMessage *> head_;	// Where producers push.
+		LuaMessage * tail_;					// Where the consumer pops.
+		std::atomic<bool> consumer_waiting_;
+		std::mutex mutex_;
+		std::condition_variable wakeup_;
+		bool closed_;
+	};
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - LuaWorkerPool
+#endif
+
+	// LuaStates are single-threaded (lua_lock and lua_unlock do nothing in
+	// a stock Lua 5.2 build), so the way to use every core is a state per
+	// thread.  A LuaWorkerPool starts that many threads, each owning a
+	// state created from a snapshot, or from Options and an initializer,
+	// and a LuaMessageQueue.  For each message it's sent, a worker calls
+	// the global function the message names with the message's values,
+	// and, if the message has a reply queue, pushes a message holding the
+	// results (or the error) there:
+	//
+	//   LuaWorkerPool workers(std::thread::hardware_concurrency(), snapshot);
+	//   LuaMessageQueue results;
+	//   std::unique_ptr<LuaMessage> job(new LuaMessage("render"));
+	//   job->AddString(template_name);
+	//   job->SetReplyTo(&results);
+	//   workers.Post(std::move(job));
+	//   std::unique_ptr<LuaMessage> result = results.Pop();
+	//
+	// Post() hands messages out round-robin; PostTo() picks the worker.
+	// Workers finish what has been posted to them before the pool's
+	// destructor returns.
+	class LuaWorkerPool {
+	public:
+		LuaWorkerPool(size_t num_workers, const LuaStateSnapshot & snapshot) : next_worker_(0), num_errors_(0) {
+			luapluslite_assert(num_workers > 0);
+			try {
+				for (size_t i = 0; i < num_workers; ++i) {
+					workers_.push_back(new Worker);
+					workers_.back()->state = new LuaState(snapshot);
+				}
+			} catch (...) {
+				Stop();
+				throw;
+			}
+			Start();
+		}
+		
+		LuaWorkerPool(size_t num_workers, const LuaState::Options & options, std::function<void (LuaState &)> initializer) : next_worker_(0), num_errors_(0) {
+			luapluslite_assert(num_workers > 0);
+			try {
+				for (size_t i = 0; i < num_workers; ++i) {
+					workers_.push_back(new Worker);
+					workers_.back()->state = new LuaState(options);
+					if (initializer) {
+						initializer(*workers_.back()->state);
+					}
+				}
+			} catch (...) {
+				Stop();
+				throw;
+			}
+			Start();
+		}
+		
+		~LuaWorkerPool() {
+			Stop();
+		}
+		
+		size_t GetNumWorkers() const {
+			return workers_.size();
+		}
+		
+		void Post(std::unique_ptr<LuaMessage> message) {
+			const size_t worker = next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+			workers_[worker]->queue.Push(std::move(message));
+		}
+		
+		void PostTo(size_t worker, std::unique_ptr<LuaMessage> message) {
+			luapluslite_assert(worker < workers_.size());
+			workers_[worker]->queue.Push(std::move(message));
+		}
+		
+		// Calls that failed, whether or not there was a reply queue to
+		// report the error to.
+		size_t GetErrorCount() const {
+			return num_errors_.load(std::memory_order_relaxed);
+		}
+		
+	private:
+		LuaWorkerPool(const LuaWorkerPool &);
+		LuaWorkerPool & operator=(const LuaWorkerPool &);
+		
+		struct Worker {
+			LuaState * state;
+			LuaMessageQueue queue;
+			std::thread thread;
+			
+			Worker() : state(NULL) {
+			}
+			
+			~Worker() {
+				delete state;
+			}
+		};
+		
+		void Start() {
+			try {
+				for (size_t i = 0; i < workers_.size(); ++i) {
+					workers_[i]->thread = std::thread(&LuaWorkerPool::Run, this, workers_[i]);
+				}
+			} catch (...) {
+				Stop();
+				throw;
+			}
+		}
+		
+		void Stop() {
+			for (size_t i = 0; i < workers_.size(); ++i) {
+				workers_[i]->queue.Close();
+			}
+			for (size_t i = 0; i < workers_.size(); ++i) {
+				if (workers_[i]->thread.joinable()) {
+					workers_[i]->thread.join();
+				}
+				delete workers_[i];
+			}
+			workers_.clear();
+		}
+		
+		void Run(Worker * worker) {
+			while (std::unique_ptr<LuaMessage> message = worker->queue.Pop()) {
+				Handle(*worker->state, *message);
+			}
+		}
+		
+		void Handle(LuaState & state, const LuaMessage & message) {
+			lua_State * L = state.GetCState();
+			std::unique_ptr<LuaMessage> reply;
+			if (message.GetReplyTo() != NULL) {
+				reply.reset(new LuaMessage(message.GetFunctionName()));
+			}
+			std::string error;
+			bool failed = false;
+			CallArguments arguments = { &message, reply.get() };
+			lua_settop(L, 0);
+			lua_pushcfunction(L, &LuaWorkerPool::Call);
+			lua_pushlightuserdata(L, &arguments);
+			if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+				failed = true;
+				error = lua_isstring(L, -1) ? lua_tostring(L, -1) : "(error object is not a string)";
+			}
+			lua_settop(L, 0);
+			if (failed) {
+				num_errors_.fetch_add(1, std::memory_order_relaxed);
+				if (reply) {
+					reply->Clear();
+					reply->SetError(true);
+					reply->AddString(error);
+				}
+			}
+			if (reply) {
+				message.GetReplyTo()->Push(std::move(reply));
+			}
+		}
+		
+		struct CallArguments {
+			const LuaMessage * message;
+			LuaMessage * reply;		// NULL if no reply is wanted.
+		};
+		
+		// Looks up the message's function, decodes its values, calls it and
+		// encodes its results into the reply, under Handle's lua_pcall, so
+		// that any failure along the way (such as running out of memory, or
+		// an __index on _G that raises) comes back as an error rather than
+		// reaching the panic function.
+		static int Call(lua_State * L) {
+			CallArguments * arguments = static_cast<CallArguments *>(lua_touserdata(L, 1));
+			const LuaMessage * message = arguments->message;
+			lua_settop(L, 0);
+			lua_getglobal(L, message->GetFunctionName().c_str());
+			const int nargs = message->PushValues(L);
+			if (nargs < 0) {
+				return luaL_error(L, "stack overflow");
+			}
+			lua_call(L, nargs, LUA_MULTRET);
+			if (arguments->reply == NULL) {
+				return 0;
+			}
+			try {
+				arguments->reply->AddValues(L, 1, lua_gettop(L));
+				return 0;
+			} catch (const std::exception & e) {
+				lua_pushstring(L, e.what());
+			}
+			return lua_error(L);
+		}
+		
+		std::vector<Worker *> workers_;
+		std::atomic<size_t> next_worker_;
+		std::atomic<size_t> num_errors_;
+	};
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Type Marshalling
+#endif
+
+	// LuaStackTraits<T> describes how a C++ type is pushed onto, and read
+	// from, the Lua stack.  Templated code, such as LuaObject::Call, uses
+	// these to pick the right lua_push* and lua_to* function at compile
+	// time.  Specializations provide:
+	//
+	//   static void Push(lua_State * L, const T & value);
+	//   static T Get(lua_State * L, int stack_index);
+	//   static T TryGet(lua_State * L, int stack_index, bool * matched);
+	//   static bool Match(lua_State * L, int stack_index);
+	//   static const char * TypeName();
+	//
+	// Match() tells whether the value at stack_index can be converted to a
+	// T, following Lua's usual coercions (numeric strings match numbers,
+	// and numbers match strings).  TryGet() combines Get() and Match() into
+	// a single conversion.  TypeName() is used in error messages.
+	//
+	template <typename T, typename Enable = void>
+	struct LuaStackTraits;
+	
+	template <>
+	struct LuaStackTraits<bool> {
+		static void Push(lua_State * L, bool value) {
+			lua_pushboolean(L, value);
+		}
+		static bool Get(lua_State * L, int stack_index) {
+			return lua_toboolean(L, stack_index) != 0;
+		}
+		static bool TryGet(lua_State * L, int stack_index, bool * matched) {
+			*matched = Match(L, stack_index);
+			return Get(L, stack_index);
+		}
+		static bool Match(lua_State * L, int stack_index) {
+			// Any Lua value can be tested for truth.
+			return ! lua_isnone(L, stack_index);
+		}
+		static const char * TypeName() {
+			return "boolean";
+		}
+	};
+	
+	template <typename T>
+	struct LuaStackTraits<T, typename std::enable_if<std::is_integral<T>::value && ! std::is_same<T, bool>::value>::type> {
+		static void Push(lua_State * L, T value) {
+			lua_pushinteger(L, (lua_Integer)value);
+		}
+		static T Get(lua_State * L, int stack_index) {
+			return (T)lua_tointeger(L, stack_index);
+		}
+		static T TryGet(lua_State * L, int stack_index, bool * matched) {
+			int isnum = 0;
+			T value = (T)lua_tointegerx(L, stack_index, &isnum);
+			*matched = (isnum != 0);
+			return value;
+		}
+		static bool Match(lua_State * L, int stack_index) {
+			return lua_isnumber(L, stack_index);
+		}
+		static const char * TypeName() {
+			return "number";
+		}
+	};
+	
+	template <typename T>
+	struct LuaStackTraits<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+		static void Push(lua_State * L, T value) {
+			lua_pushnumber(L, (lua_Number)value);
+		}
+		static T Get(lua_State * L, int stack_index) {
+			return (T)lua_tonumber(L, stack_index);
+		}
+		static T TryGet(lua_State * L, int stack_index, bool * matched) {
+			int isnum = 0;
+			T value = (T)lua_tonumberx(L, stack_index, &isnum);
+			*matched = (isnum != 0);
+			return value;
+		}
+		static bool Match(lua_State * L, int stack_index) {
+			return lua_isnumber(L, stack_index);
+		}
+		static const char * TypeName() {
+			return "number";
+		}
+	};
+	
+	// Note: the returned pointer is only valid for as long as the Lua
+	// string it points into is; prefer std::string for values that need
+	// to outlive the stack slot they were read from.
+	template <>
+	struct LuaStackTraits<const char *> {
+		static void Push(lua_State * L, const char * value) {
+			if (value) {
+				lua_pushstring(L, value);
+			} else {
+				lua_pushnil(L);
+			}
+		}
+		static const char * Get(lua_State * L, int stack_index) {
+			return lua_tostring(L, stack_index);
+		}
+		static const char * TryGet(lua_State * L, int stack_index, bool * matched) {
+			const char * value = lua_tostring(L, stack_index);
+			*matched = (value != NULL);
+			return value;
+		}
+		static bool Match(lua_State * L, int stack_index) {
+			return lua_isstring(L, stack_index);
+		}
+		static const char * TypeName() {
+			return "string";
+		}
+	};
+	
+	template <>
+	struct LuaStackTraits<char *> : public LuaStackTraits<const char *> {
+	};
+	
+	template <>
+	struct LuaStackTraits<std::string> {
+		static void Push(lua_State * L, const std::string & value) {
+			lua_pushlstring(L, value.data(), value.size());
+		}
+		static std::string Get(lua_State * L, int stack_index) {
+			size_t len = 0;
+			const char * value = lua_tolstring(L, stack_index, &len);
+			return value ? std::string(value, len) : std::string();
+		}
+		static std::string TryGet(lua_State * L, int stack_index, bool * matched) {
+			size_t len = 0;
+			const char * value = lua_tolstring(L, stack_index, &len);
+			*matched = (value != NULL);
+			return value ? std::string(value, len) : std::string();
+		}
+		static bool Match(lua_State * L, int stack_index) {
+			return lua_isstring(L, stack_index);
+		}
+		static const char * TypeName() {
+			return "string";
+		}
+	};
+	
+	// As with const char *, a LuaStringView read from the stack is only
+	// valid for as long as the Lua string it refers to is.
+	template <>
+	struct LuaStackTraits<LuaStringView> {
+		static void Push(lua_State * L, const LuaStringView & value) {
+			if (value.data()) {
+				lua_pushlstring(L, value.data(), value.size());
+			} else {
+				lua_pushnil(L);
+			}
+		}
+		static LuaStringView Get(lua_State * L, int stack_index) {
+			size_t len = 0;
+			const char * value = lua_tolstring(L, stack_index, &len);
+			return LuaStringView(value, len);
+		}
+		static LuaStringView TryGet(lua_State * L, int stack_index, bool * matched) {
+			size_t len = 0;
+			const char * value = lua_tolstring(L, stack_index, &len);
+			*matched = (value != NULL);
+			return LuaStringView(value, len);
+		}
+		static bool Match(lua_State * L, int stack_index) {
+			return lua_isstring(L, stack_index);
+		}
+		static const char * TypeName() {
+			return "string";
+		}
+	};
+	
+#if __cplusplus >= 201703L
+	template <>
+	struct LuaStackTraits<std::string_view> {
+		static void Push(lua_State * L, std::string_view value) {
+			lua_pushlstring(L, value.data(), value.size());
+		}
+		static std::string_view Get(lua_State * L, int stack_index) {
+			return LuaStackTraits<LuaStringView>::Get(L, stack_index);
+		}
+		static std::string_view TryGet(lua_State * L, int stack_index, bool * matched) {
+			return LuaStackTraits<LuaStringView>::TryGet(L, stack_index, matched);
+		}
+		static bool Match(lua_State * L, int stack_index) {
+			return lua_isstring(L, stack_index);
+		}
+		static const char * TypeName() {
+			return "string";
+		}
+	};
+#endif
+	
+	template <>
+	struct LuaStackTraits<void *> {
+		static void Push(lua_State * L, void * value) {
+			lua_pushlightuserdata(L, value);
+		}
+		static void * Get(lua_State * L, int stack_index) {
+			return lua_touserdata(L, stack_index);
+		}
+		static void * TryGet(lua_State * L, int stack_index, bool * matched) {
+			void * value = lua_touserdata(L, stack_index);
+			*matched = (value != NULL || lua_isnil(L, stack_index));
+			return value;
+		}
+		static bool Match(lua_State * L, int stack_index) {
+			return lua_isuserdata(L, stack_index) || lua_isnil(L, stack_index);
+		}
+		static const char * TypeName() {
+			return "userdata";
+		}
+	};
+	
+	template <>
+	struct LuaStackTraits<lua_CFunction> {
+		static void Push(lua_State * L, lua_CFunction value) {
+			lua_pushcfunction(L, value);
+		}
+		static lua_CFunction Get(lua_State * L, int stack_index) {
+			return lua_tocfunction(L, stack_index);
+		}
+		static lua_CFunction TryGet(lua_State * L, int stack_index, bool * matched) {
+			lua_CFunction value = lua_tocfunction(L, stack_index);
+			*matched = (value != NULL);
+			return value;
+		}
+		static bool Match(lua_State * L, int stack_index) {
+			return lua_iscfunction(L, stack_index);
+		}
+		static const char * TypeName() {
+			return "C function";
+		}
+	};
+	
+	// Strips references and cv-qualifiers from a type, and turns arrays
+	// (such as string literals) into pointers, before its LuaStackTraits
+	// are looked up.
+	template <typename T>
+	struct LuaStackTraitsOf : public LuaStackTraits<typename std::decay<T>::type> {
+	};
+	
+	// LuaStackValueIsBorrowed<T> is true for types whose values point into
+	// the Lua value they were read from, rather than copying it.  Such a
+	// value dangles once that Lua value is popped, so code that pops its
+	// result before returning (LuaObject::Call, ToVector and ToMap) rejects
+	// these types at compile time.
+	template <typename T>
+	struct LuaStackValueIsBorrowed : public std::false_type {
+	};
+	
+	template <>
+	struct LuaStackValueIsBorrowed<const char *> : public std::true_type {
+	};
+	
+	template <>
+	struct LuaStackValueIsBorrowed<char *> : public std::true_type {
+	};
+	
+	template <>
+	struct LuaStackValueIsBorrowed<LuaStringView> : public std::true_type {
+	};
+	
+#if __cplusplus >= 201703L
+	template <>
+	struct LuaStackValueIsBorrowed<std::string_view> : public std::true_type {
+	};
+#endif
+	
+	inline void LuaPushArguments(lua_State *) {
+	}
+	
+	template <typename T, typename... Rest>
+	inline void LuaPushArguments(lua_State * L, const T & first, const Rest &... rest) {
+		LuaStackTraitsOf<T>::Push(L, first);
+		LuaPushArguments(L, rest...);
+	}
+	
+	// Writes the values in [first, last) into the table at 'table_index',
+	// at consecutive integer keys beginning with 'start_index'.  Metamethods
+	// are bypassed.
+	template <typename Iterator>
+	inline void LuaRawSetArray(lua_State * L, int table_index, Iterator first, Iterator last, int start_index) {
+		table_index = lua_absindex(L, table_index);
+		for (int i = start_index; first != last; ++first, ++i) {
+			LuaStackTraitsOf<typename std::iterator_traits<Iterator>::value_type>::Push(L, *first);
+			lua_rawseti(L, table_index, i);
+		}
+	}
+	
+	// Writes the key/value pairs in [first, last) into the table at
+	// 'table_index'.  Metamethods are bypassed.
+	template <typename Iterator>
+	inline void LuaRawSetFields(lua_State * L, int table_index, Iterator first, Iterator last) {
+		table_index = lua_absindex(L, table_index);
+		for ( ; first != last; ++first) {
+			LuaStackTraitsOf<decltype(first->first)>::Push(L, first->first);
+			LuaStackTraitsOf<decltype(first->second)>::Push(L, first->second);
+			lua_rawset(L, table_index);
+		}
+	}
+	
+	// Reads the result of a call made by LuaObject::Call (left at the top
+	// of the stack), then restores the stack to 'old_top'.
+	template <typename R>
+	struct LuaCallResult {
+		static_assert( ! LuaStackValueIsBorrowed<typename std::decay<R>::type>::value,
+			"the result of a call is popped before it is returned; use std::string or LuaObject instead");
+		static const int count = 1;
+		static R Pop(lua_State * L, int old_top) {
+			R result = LuaStackTraitsOf<R>::Get(L, -1);
+			lua_settop(L, old_top);
+			return result;
+		}
+	};
+	
+	template <>
+	struct LuaCallResult<void> {
+		static const int count = 0;
+		static void Pop(lua_State * L, int old_top) {
+			lua_settop(L, old_top);
+		}
+	};
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Direct Function Registration
+#endif
+
+	// RegisterDirect binds C++ functions, methods and function objects to
+	// Lua without hand-written lua_CFunctions.  A trampoline is generated,
+	// at compile time, for each bound signature.  The bound callable itself
+	// is copied into a full userdata, which the trampoline receives as its
+	// only upvalue.
+	//
+	// Lua errors unwind with longjmp, so no C++ object may be alive in the
+	// trampoline at the point one is raised.  Arguments are therefore
+	// converted, and the bound function called, in a nested function
+	// (Invoke), which reports mismatched arguments and C++ exceptions back
+	// to the trampoline.  The trampoline raises the matching Lua error once
+	// Invoke's locals have been destroyed.
+
+	template <int... Indices>
+	struct LuaIndices {
+	};
+	
+	template <int N, int... Indices>
+	struct LuaMakeIndices : public LuaMakeIndices<N - 1, N - 1, Indices...> {
+	};
+	
+	template <int... Indices>
+	struct LuaMakeIndices<0, Indices...> {
+		typedef LuaIndices<Indices...> type;
+	};
+	
+	// Invoke's result, when a C++ exception was caught.  Its message is
+	// left at the top of the stack.
+	static const int LUAPLUSLITE_DIRECT_EXCEPTION = -0x7fffffff;
+	
+	// Converts the argument at 'stack_index', and records the index of the
+	// first argument which fails to convert in 'bad_argument'.
+	template <typename T>
+	inline typename std::decay<T>::type LuaGetDirectArgument(lua_State * L, int stack_index, int * bad_argument) {
+		bool matched = true;
+		typename std::decay<T>::type value = LuaStackTraitsOf<T>::TryGet(L, stack_index, &matched);
+		if ( ! matched && *bad_argument == 0) {
+			*bad_argument = stack_index;
+		}
+		return value;
+	}
+	
+	// The name given to a T in the argument errors raised by trampolines.
+	// Specialized where the name depends on the calling closure, as it
+	// does for LuaClassSelf.
+	template <typename T>
+	struct LuaDirectArgumentName {
+		static const char * Get(lua_State *) {
+			return LuaStackTraitsOf<T>::TypeName();
+		}
+	};
+	
+	inline const char * LuaArgumentTypeName(lua_State *, int, int) {
+		return "value";
+	}
+	
+	template <typename T, typename... Rest>
+	inline const char * LuaArgumentTypeName(lua_State * L, int wanted_index, int index, T *, Rest *... rest) {
+		if (wanted_index == index) {
+			return LuaDirectArgumentName<T>::Get(L);
+		}
+		return LuaArgumentTypeName(L, wanted_index, index + 1, rest...);
+	}
+	
+	// Turns the result of an Invoke function into the result of a
+	// lua_CFunction, raising the Lua error it describes, if any.
+	template <typename... Args>
+	int LuaFinishDirectCall(lua_State * L, int result) {
+		if (result >= 0) {
+			return result;
+		} else if (result == LUAPLUSLITE_DIRECT_EXCEPTION) {
+			return lua_error(L);
+		} else {
+			int bad_argument = -result;
+			const char * expected = LuaArgumentTypeName(L, bad_argument, 1, (typename std::decay<Args>::type *)NULL...);
+			return luaL_argerror(L, bad_argument, lua_pushfstring(L, "%s expected, got %s", expected, luaL_typename(L, bad_argument)));
+		}
+	}
+	
+	template <typename R>
+	struct LuaDirectCaller {
+		template <typename F, typename... Values>
+		static int Call(lua_State * L, F & function, Values &&... values) {
+			LuaStackTraitsOf<R>::Push(L, function(std::forward<Values>(values)...));
+			return 1;
+		}
+	};
+	
+	template <>
+	struct LuaDirectCaller<void> {
+		template <typename F, typename... Values>
+		static int Call(lua_State *, F & function, Values &&... values) {
+			function(std::forward<Values>(values)...);
+			return 0;
+		}
+	};
+	
+	// LuaDirectSignature<F> extracts the result and parameter types of a
+	// function pointer, or of a function object's operator().
+	template <typename F>
+	struct LuaDirectSignature : public LuaDirectSignature<decltype(&F::operator())> {
+	};
+	
+	template <typename R, typename... Args>
+	struct LuaDirectSignature<R (*)(Args...)> {
+		// Returns the number of results pushed, -N if argument N could not
+		// be converted, or LUAPLUSLITE_DIRECT_EXCEPTION.
+		template <typename F, int... Indices>
+		static int Invoke(lua_State * L, LuaIndices<Indices...>) {
+			try {
+				int bad_argument = 0;
+				std::tuple<typename std::decay<Args>::type...> arguments { LuaGetDirectArgument<Args>(L, Indices + 1, &bad_argument)... };
+				if (bad_argument != 0) {
+					return -bad_argument;
+				}
+				F * function = static_cast<F *>(lua_touserdata(L, lua_upvalueindex(1)));
+				return LuaDirectCaller<R>::Call(L, *function, std::move(std::get<Indices>(arguments))...);
+			} catch (std::exception & e) {
+				lua_pushstring(L, e.what());
+			} catch (...) {
+				lua_pushstring(L, "unknown C++ exception");
+			}
+			return LUAPLUSLITE_DIRECT_EXCEPTION;
+		}
+		
+		template <typename F>
+		static int Trampoline(lua_State * L) {
+			return LuaFinishDirectCall<Args...>(L, Invoke<F>(L, typename LuaMakeIndices<sizeof...(Args)>::type()));
+		}
+	};
+	
+	template <typename C, typename R, typename... Args>
+	struct LuaDirectSignature<R (C::*)(Args...)> : public LuaDirectSignature<R (*)(Args...)> {
+	};
+	
+	template <typename C, typename R, typename... Args>
+	struct LuaDirectSignature<R (C::*)(Args...) const> : public LuaDirectSignature<R (*)(Args...)> {
+	};
+	
+	// Calls a member function on a fixed object.
+	template <typename Object, typename Method, typename R, typename... Args>
+	struct LuaMethodBinder {
+		Object * object;
+		Method method;
+		
+		R operator()(Args... args) const {
+			return (object->*method)(args...);
+		}
+	};
+	
+	template <typename F>
+	int LuaDestroyDirectFunction(lua_State * L) {
+		static_cast<F *>(lua_touserdata(L, 1))->~F();
+		return 0;
+	}
+	
+	// Pushes a C closure which calls 'function' (a function pointer or a
+	// copyable function object) through a generated trampoline.  The top
+	// 'num_extra_upvalues' values on the stack become the closure's
+	// upvalues 2 and up.
+	template <typename F>
+	void LuaPushDirectClosure(lua_State * L, const F & function, int num_extra_upvalues = 0) {
+		void * storage = lua_newuserdata(L, sizeof(F));
+		new (storage) F(function);
+		if ( ! std::is_trivially_destructible<F>::value) {
+			static const char metatable_key = 0;
+			lua_rawgetp(L, LUA_REGISTRYINDEX, &metatable_key);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				lua_createtable(L, 0, 1);
+				lua_pushcfunction(L, &LuaDestroyDirectFunction<F>);
+				lua_setfield(L, -2, "__gc");
+				lua_pushvalue(L, -1);
+				lua_rawsetp(L, LUA_REGISTRYINDEX, &metatable_key);
+			}
+			lua_setmetatable(L, -2);
+		}
+		lua_insert(L, -(num_extra_upvalues + 1));
+		lua_pushcclosure(L, &LuaDirectSignature<F>::template Trampoline<F>, num_extra_upvalues + 1);
+	}
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - LuaObject
+#endif
+
+	class LuaObject {
+	public:
+	
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Initialization and Destruction
+#endif
+
+		LuaObject() : lua_state_(NULL), ref_(LUA_NOREF), type_(LUA_TNONE)
+		{
+		}
+		
+		LuaObject(LuaState * state, int stack_position) : lua_state_(state), ref_(LUA_NOREF), type_(LUA_TNONE)
+		{
+			if (lua_state_->GetCState()) {
+				// TODO: check for valid stack position (and throw LuaException on failure)
+				lua_pushvalue(lua_state_->GetCState(), stack_position);
+				type_ = lua_type(lua_state_->GetCState(), -1);
+				ref_ = lua_state_->NewRef();
+			}
+		}
+		
+		// Refers to a value on any thread of a wrapped state.  Values on a
+		// coroutine's stack are moved to the main thread to be referenced.
+		LuaObject(lua_State * L, int stack_position) : lua_state_(LuaState::CastState(L)), ref_(LUA_NOREF), type_(LUA_TNONE)
+		{
+			if (lua_state_ == NULL) {
+				throw LuaException("lua_State has no LuaState");
+			}
+			RefValue(L, stack_position);
+		}
+		
+		explicit LuaObject(const LuaStackObject & src);
+		
+		LuaObject(const LuaObject & src) : lua_state_(src.lua_state_), ref_(LUA_NOREF), type_(src.type_)
+		{
+			if (lua_state_ && lua_state_->GetCState()) {
+				src.Push();
+				ref_ = lua_state_->NewRef();
+			}
+		}
+		
+		// Moving a LuaObject hands its reference pool slot to the new
+		// object, without touching the Lua stack.  Moves are noexcept so
+		// that containers such as std::vector<LuaObject> move, rather than
+		// copy, their elements when they grow.
+		LuaObject(LuaObject && src) noexcept : lua_state_(src.lua_state_), ref_(src.ref_), type_(src.type_)
+		{
+			src.lua_state_ = NULL;
+			src.ref_ = LUA_NOREF;
+			src.type_ = LUA_TNONE;
+		}
+		
+		~LuaObject() {
+			if (lua_state_ && ref_ != LUA_NOREF) {
+				lua_state_->FreeRef(ref_);
+			}
+		}
+		
+		// Two LuaObjects must never share a reference pool slot, so
+		// assignment copies the value rather than the slot.
+		LuaObject & operator=(const LuaObject & src) {
+			if (this == &src) {
+				return *this;
+			}
+			if (src.lua_state_ == NULL) {
+				Reset();
+				return *this;
+			}
+			src.Push();
+			AssignValueToState(src.lua_state_);
+			return *this;
+		}
+		
+		LuaObject & operator=(LuaObject && src) noexcept {
+			if (this == &src) {
+				return *this;
+			}
+			Reset();
+			lua_state_ = src.lua_state_;
+			ref_ = src.ref_;
+			type_ = src.type_;
+			src.lua_state_ = NULL;
+			src.ref_ = LUA_NOREF;
+			src.type_ = LUA_TNONE;
+			return *this;
+		}
+		
+		void Reset() {
+			if (lua_state_ != NULL) {
+				if (ref_ != LUA_NOREF) {
+					lua_state_->FreeRef(ref_);
+					ref_ = LUA_NOREF;
+				}
+				lua_state_ = NULL;
+				type_ = LUA_TNONE;
+			}
+		}
+		
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Stack Management
+#endif
+		
+		LuaState * GetState() const {
+			return lua_state_;
+		}
+		
+		void Push() const {
+			luapluslite_assert(lua_state_ != NULL);
+			lua_state_->PushRef(ref_);
+		}
+		
+		// Pushes the value onto 'L', which may be any thread of the state.
+		void Push(lua_State * L) const {
+			luapluslite_assert(lua_state_ != NULL);
+			lua_state_->PushRef(ref_);
+			if (L != lua_state_->GetCState()) {
+				lua_xmove(lua_state_->GetCState(), L, 1);
+			}
+		}
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Value Assignment
+#endif
+		
+		void AssignBoolean(LuaState * state, bool value) {
+			luapluslite_assert(state != NULL);
+			lua_pushboolean(state->GetCState(), value);
+			AssignValueToState(state);
+		}
+	
+		void AssignInteger(LuaState * state, lua_Integer value) {
+			luapluslite_assert(state != NULL);
+			lua_pushinteger(state->GetCState(), value);
+			AssignValueToState(state);
+		}
+		
+		void AssignLightUserData(LuaState * state, void * value) {
+			luapluslite_assert(state != NULL);
+			lua_pushlightuserdata(state->GetCState(), value);
+			AssignValueToState(state);
+		}
+		
+		void AssignNumber(LuaState * state, lua_Number value) {
+			luapluslite_assert(state != NULL);
+			lua_pushnumber(state->GetCState(), value);
+			AssignValueToState(state);
+		}
+		
+		void AssignString(LuaState * state, const char * value) {
+			luapluslite_assert(state != NULL);
+			lua_pushstring(state->GetCState(), value);
+			AssignValueToState(state);
+		}
+		
+		void AssignString(LuaState * state, const char * value, size_t len) {
+			luapluslite_assert(state != NULL);
+			lua_pushlstring(state->GetCState(), value, len);
+			AssignValueToState(state);
+		}
+		
+		void AssignString(LuaState * state, const std::string & value) {
+			AssignString(state, value.data(), value.size());
+		}
+		
+		void AssignString(LuaState * state, const LuaStringView & value) {
+			AssignString(state, value.data(), value.size());
+		}
+		
+		void AssignNil(LuaState * state) {
+			luapluslite_assert(state != NULL);
+			lua_pushnil(state->GetCState());
+			AssignValueToState(state);
+		}
+		
+		void AssignNewTable(LuaState * state, int narr = 0, int nrec = 0) {
+			luapluslite_assert(state != NULL);
+			lua_createtable(state->GetCState(), narr, nrec);
+			AssignValueToState(state);
+		}
+		
+		// Creates a new table, presized to hold the values in [first, last),
+		// and fills it in as a sequence starting at index 1.
+		template <typename Iterator>
+		void AssignNewArray(LuaState * state, Iterator first, Iterator last) {
+			luapluslite_assert(state != NULL);
+			lua_State * L = state->GetCState();
+			lua_createtable(L, (int)std::distance(first, last), 0);
+			LuaRawSetArray(L, -1, first, last, 1);
+			AssignValueToState(state);
+		}
+		
+		template <typename T, typename Allocator>
+		void AssignNewArray(LuaState * state, const std::vector<T, Allocator> & values) {
+			AssignNewArray(state, values.begin(), values.end());
+		}
+		
+		template <typename T>
+		void AssignNewArray(LuaState * state, std::initializer_list<T> values) {
+			AssignNewArray(state, values.begin(), values.end());
+		}
+		
+		// Creates a new table, presized to hold the key/value pairs in
+		// [first, last), and fills it in.
+		template <typename Iterator>
+		void AssignNewFields(LuaState * state, Iterator first, Iterator last) {
+			luapluslite_assert(state != NULL);
+			lua_State * L = state->GetCState();
+			lua_createtable(L, 0, (int)std::distance(first, last));
+			LuaRawSetFields(L, -1, first, last);
+			AssignValueToState(state);
+		}
+		
+		template <typename K, typename V, typename Compare, typename Allocator>
+		void AssignNewFields(LuaState * state, const std::map<K, V, Compare, Allocator> & fields) {
+			AssignNewFields(state, fields.begin(), fields.end());
+		}
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Value Retrieval
+#endif
+
+		bool GetBoolean() {
+			return ToBoolean();
+		}
+		
+		double GetDouble() {
+			return GetDouble();
+		}
+		
+		float GetFloat() {
+			return GetNumber();
+		}
+		
+		lua_Integer GetInteger() {
+			return ToInteger();
+		}
+		
+		void * GetLightUserData() {
+			return ToUserData();
+		}
+		
+		lua_Number GetNumber() {
+			return ToNumber();
+		}
+		
+		const char * GetString() {
+			return ToString();
+		}
+		
+		void * GetUserData() {
+			return GetUserData();
+		}
+
+		bool ToBoolean() {
+			if ( ! lua_state_) {
+				return false;
+			}
+			Push();
+			int value = lua_toboolean(lua_state_->GetCState(), -1);
+#if LuaPlusLite__ToXYZ_methods_convert_internal_value_types == 1
+			if (Type() != lua_type(lua_state_->GetCState(), -1)) {
+				type_ = lua_type(lua_state_->GetCState(), -1);
+				lua_state_->SetRef(ref_);
+				return value;
+			}
+#endif
+			lua_pop(lua_state_->GetCState(), 1);
+			return value;
+		}
+		
+		lua_Integer ToInteger(int * isnum = NULL) {
+			luapluslite_assert(IsInteger() == true);
+			Push();
+			lua_Integer value = lua_tointegerx(lua_state_->GetCState(), -1, isnum);
+#if LuaPlusLite__ToXYZ_methods_convert_internal_value_types == 1
+			if (Type() != lua_type(lua_state_->GetCState(), -1)) {
+				type_ = lua_type(lua_state_->GetCState(), -1);
+				lua_state_->SetRef(ref_);
+				return value;
+			}
+#endif
+			lua_pop(lua_state_->GetCState(), 1);
+			return value;
+		}
+		
+		lua_Number ToNumber(int * isnum = NULL) {
+			luapluslite_assert(IsNumber() == true);
+			Push();
+			lua_Number value = lua_tonumberx(lua_state_->GetCState(), -1, isnum);
+#if LuaPlusLite__ToXYZ_methods_convert_internal_value_types == 1
+			if (Type() != lua_type(lua_state_->GetCState(), -1)) {
+				type_ = lua_type(lua_state_->GetCState(), -1);
+				lua_state_->SetRef(ref_);
+				return value;
+			}
+#endif
+			lua_pop(lua_state_->GetCState(), 1);
+			return value;
+		}
+		
+		const char * ToString(size_t * len = NULL) {
+			luapluslite_assert(IsString() == true);
+			Push();
+			const char * value = lua_tolstring(lua_state_->GetCState(), -1, len);
+#if LuaPlusLite__ToXYZ_methods_convert_internal_value_types == 1
+			if (Type() != lua_type(lua_state_->GetCState(), -1)) {
+				type_ = lua_type(lua_state_->GetCState(), -1);
+				lua_state_->SetRef(ref_);
+				return value;
+			}
+#endif
+			lua_pop(lua_state_->GetCState(), 1);
+			return value;
+		}
+		
+		// Returns a view of the string held by this LuaObject, which stays
+		// valid for as long as the LuaObject holds it.  Only strings can be
+		// viewed: a number has no string storage of its own to point into.
+		LuaStringView ToStringView() const {
+			luapluslite_assert(Type() == LUA_TSTRING);
+			Push();
+			size_t len = 0;
+			const char * value = lua_tolstring(lua_state_->GetCState(), -1, &len);
+			lua_pop(lua_state_->GetCState(), 1);
+			return LuaStringView(value, len);
+		}
+		
+		void * ToUserData() {
+			luapluslite_assert(IsUserData() == true);
+			Push();
+			switch (Type()) {
+				case LUA_TUSERDATA:
+				{
+					// TODO: prevent certain, maybe all, userdata objects from being dereferenced in ToUserData
+					void ** inner_value = (void **)lua_touserdata(lua_state_->GetCState(), -1);
+					lua_pop(lua_state_->GetCState(), 1);
+					return *inner_value;
+				}
+				
+				case LUA_TLIGHTUSERDATA:
+				{
+					void * value = lua_touserdata(lua_state_->GetCState(), -1);
+					lua_pop(lua_state_->GetCState(), 1);
+					return value;
+				}
+				
+				default:
+					luapluslite_assert(Type() == LUA_TUSERDATA || Type() == LUA_TLIGHTUSERDATA);
+					return NULL;
+			}
+		}
+		
+		// Non-throwing accessors.  Each converts the value in one step and
+		// returns false, leaving '*value' untouched, if it cannot be
+		// converted.  Unlike the To* methods, there is no separate Is*
+		// check, and no exception-handling code in the caller.
+		
+		bool TryToInteger(lua_Integer * value) const {
+			if ( ! IsNumberOrString()) {
+				return false;
+			}
+			Push();
+			int isnum = 0;
+			lua_Integer result = lua_tointegerx(lua_state_->GetCState(), -1, &isnum);
+			lua_pop(lua_state_->GetCState(), 1);
+			if (isnum) {
+				*value = result;
+			}
+			return isnum != 0;
+		}
+		
+		bool TryToNumber(lua_Number * value) const {
+			if ( ! IsNumberOrString()) {
+				return false;
+			}
+			Push();
+			int isnum = 0;
+			lua_Number result = lua_tonumberx(lua_state_->GetCState(), -1, &isnum);
+			lua_pop(lua_state_->GetCState(), 1);
+			if (isnum) {
+				*value = result;
+			}
+			return isnum != 0;
+		}
+		
+		// As with ToStringView, only strings succeed: a number converted
+		// on the stack would leave '*value' pointing at a string that
+		// nothing refers to.
+		bool TryToString(const char ** value, size_t * len = NULL) const {
+			if (type_ != LUA_TSTRING) {
+				return false;
+			}
+			Push();
+			*value = lua_tolstring(lua_state_->GetCState(), -1, len);
+			lua_pop(lua_state_->GetCState(), 1);
+			return true;
+		}
+		
+		bool TryToUserData(void ** value) const {
+			if (type_ == LUA_TLIGHTUSERDATA) {
+				Push();
+				*value = lua_touserdata(lua_state_->GetCState(), -1);
+				lua_pop(lua_state_->GetCState(), 1);
+				return true;
+			} else if (type_ == LUA_TUSERDATA) {
+				Push();
+				*value = *(void **)lua_touserdata(lua_state_->GetCState(), -1);
+				lua_pop(lua_state_->GetCState(), 1);
+				return true;
+			}
+			return false;
+		}
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Type Checking
+#endif
+
+		// The type of a LuaObject's value is recorded whenever the value is
+		// assigned, which lets type queries skip a round trip through the
+		// reference pool.
+		int Type() const {
+			return type_;
+		}
+		
+		const char * TypeName() {
+			int type = Type();
+			if (lua_state_) {
+				return lua_typename(lua_state_->GetCState(), type);
+			} else {
+				return lua_typename(NULL, type);
+			}
+		}
+		
+		bool IsBoolean() const {
+			return type_ == LUA_TBOOLEAN;
+		}
+		
+		bool IsConvertibleToString() const {
+			return type_ == LUA_TSTRING || type_ == LUA_TNUMBER;
+		}
+		
+		bool IsInteger() const {
+			return IsNumber();
+		}
+		
+		bool IsString() const {
+#if LuaPlusLite__IsString_and_IsNumber_only_match_explicitly == 1
+			return Type() == LUA_TSTRING;
+#else
+			return IsConvertibleToString();
+#endif
+		}
+		
+		bool IsNumber() const {
+#if LuaPlusLite__IsString_and_IsNumber_only_match_explicitly == 1
+			return type_ == LUA_TNUMBER;
+#else
+			if (type_ != LUA_TSTRING) {
+				return type_ == LUA_TNUMBER;
+			}
+			// Strings may, or may not, be convertible to numbers.
+			Push();
+			const bool is_match = lua_isnumber(lua_state_->GetCState(), -1);
+			lua_state_->Pop(1);
+			return is_match;
+#endif
+		}
+		
+		bool IsTable() const {
+			return type_ == LUA_TTABLE;
+		}
+		
+		bool IsNil() const {
+			return type_ == LUA_TNIL;
+		}
+		
+		bool IsNone() const {
+			// API DIFFERENCE: LuaPlus will return 'false' if IsNone() is called
+			// on an uninitialized LuaObject.  LuaPlusLite will return 'true'
+			// instead.
+			return type_ == LUA_TNONE;
+		}
+		
+		bool IsNoneOrNil() const {
+			return type_ == LUA_TNONE || type_ == LUA_TNIL;
+		}
+		
+		bool IsUserData() const {
+			return type_ == LUA_TUSERDATA || type_ == LUA_TLIGHTUSERDATA;
+		}
+		
+		bool IsFunction() const {
+			return type_ == LUA_TFUNCTION;
+		}
+		
+		bool IsCFunction() const {
+			if (type_ != LUA_TFUNCTION) {
+				return false;
+			}
+			Push();
+			const bool is_match = lua_iscfunction(lua_state_->GetCState(), -1);
 			lua_state_->Pop(1);
 			return is_match;
 		}
 		
-		bool IsUserData() const {
-			if ( ! lua_state_) {
-				return false;
+		bool IsLightUserData() const {
+			return type_ == LUA_TLIGHTUSERDATA;
+		}
+		
+		bool IsThread() const {
+			return type_ == LUA_TTHREAD;
+		}
+		
+		
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Table Value Assignment
+#endif
+
+		// TODO: allow Set operation on userdata objects with appropriate metatables
+		
+		LuaObject CreateTable(const char * key, int narr = 0, int nrec = 0) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key != NULL);
+			Push();
+			lua_createtable(lua_state_->GetCState(), narr, nrec);
+			LuaObject value(lua_state_, -1);
+			lua_setfield(lua_state_->GetCState(), -2, key);
+			lua_pop(lua_state_->GetCState(), 1);
+			return value;
+		}
+
+		LuaObject CreateTable(int key, int narr = 0, int nrec = 0) {
+			luapluslite_assert(IsTable() == true);
+			Push();
+			lua_pushinteger(lua_state_->GetCState(), key);
+			lua_createtable(lua_state_->GetCState(), narr, nrec);
+			LuaObject value(lua_state_, -1);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+			return value;
+		}
+		
+		LuaObject CreateTable(const LuaObject & key, int narr = 0, int nrec = 0)
+		{
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key.IsNone() == false);
+			PushWithKey(key);
+			lua_createtable(lua_state_->GetCState(), narr, nrec);
+			LuaObject value(lua_state_, -1);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+			return value;
+		}
+		
+		// TODO: Implement Insert(LuaObject)
+
+		void SetBoolean(const char * key, bool value) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key != NULL);
+			Push();
+			lua_pushboolean(lua_state_->GetCState(), value);
+			lua_setfield(lua_state_->GetCState(), -2, key);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetBoolean(int key, bool value) {
+			luapluslite_assert(IsTable() == true);
+			Push();
+			lua_pushinteger(lua_state_->GetCState(), key);
+			lua_pushboolean(lua_state_->GetCState(), value);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetBoolean(const LuaObject & key, bool value) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key.IsNone() == false);
+			PushWithKey(key);
+			lua_pushboolean(lua_state_->GetCState(), value);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetInteger(const char * key, lua_Integer value) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key != NULL);
+			Push();
+			lua_pushinteger(lua_state_->GetCState(), value);
+			lua_setfield(lua_state_->GetCState(), -2, key);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetInteger(int key, lua_Integer value) {
+			luapluslite_assert(IsTable() == true);
+			Push();
+			lua_pushinteger(lua_state_->GetCState(), key);
+			lua_pushinteger(lua_state_->GetCState(), value);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetInteger(const LuaObject & key, lua_Integer value) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key.IsNone() == false);
+			PushWithKey(key);
+			lua_pushinteger(lua_state_->GetCState(), value);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetLightUserData(const char * key, void * value) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key != NULL);
+			Push();
+			lua_pushlightuserdata(lua_state_->GetCState(), value);
+			lua_setfield(lua_state_->GetCState(), -2, key);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetLightUserData(int key, void * value) {
+			luapluslite_assert(IsTable() == true);
+			Push();
+			lua_pushinteger(lua_state_->GetCState(), key);
+			lua_pushlightuserdata(lua_state_->GetCState(), value);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetLightUserData(const LuaObject & key, void * value) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key.IsNone() == false);
+			PushWithKey(key);
+			lua_pushlightuserdata(lua_state_->GetCState(), value);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetNil(const char * key) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key != NULL);
+			Push();
+			lua_pushnil(lua_state_->GetCState());
+			lua_setfield(lua_state_->GetCState(), -2, key);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetNil(int key) {
+			luapluslite_assert(IsTable() == true);
+			Push();
+			lua_pushinteger(lua_state_->GetCState(), key);
+			lua_pushnil(lua_state_->GetCState());
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetNil(const LuaObject & key) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key.IsNone() == false);
+			PushWithKey(key);
+			lua_pushnil(lua_state_->GetCState());
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetNumber(const char * key, lua_Number value) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key != NULL);
+			Push();
+			lua_pushnumber(lua_state_->GetCState(), value);
+			lua_setfield(lua_state_->GetCState(), -2, key);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetNumber(int key, lua_Number value) {
+			luapluslite_assert(IsTable() == true);
+			Push();
+			lua_pushinteger(lua_state_->GetCState(), key);
+			lua_pushnumber(lua_state_->GetCState(), value);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetNumber(const LuaObject & key, lua_Number value) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key.IsNone() == false);
+			PushWithKey(key);
+			lua_pushnumber(lua_state_->GetCState(), value);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetString(const char * key, const char * value) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key != NULL);
+			luapluslite_assert(value != NULL);
+			Push();
+			lua_pushstring(lua_state_->GetCState(), value);
+			lua_setfield(lua_state_->GetCState(), -2, key);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetString(int key, const char * value) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(value != NULL);
+			Push();
+			lua_pushinteger(lua_state_->GetCState(), key);
+			lua_pushstring(lua_state_->GetCState(), value);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetString(const LuaObject & key, const char * value) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key.IsNone() == false);
+			luapluslite_assert(value != NULL);
+			PushWithKey(key);
+			lua_pushstring(lua_state_->GetCState(), value);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetString(const char * key, const char * value, size_t len) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key != NULL);
+			luapluslite_assert(value != NULL);
+			Push();
+			lua_pushlstring(lua_state_->GetCState(), value, len);
+			lua_setfield(lua_state_->GetCState(), -2, key);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetString(int key, const char * value, size_t len) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(value != NULL);
+			Push();
+			lua_pushinteger(lua_state_->GetCState(), key);
+			lua_pushlstring(lua_state_->GetCState(), value, len);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetString(const LuaObject & key, const char * value, size_t len) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key.IsNone() == false);
+			luapluslite_assert(value != NULL);
+			PushWithKey(key);
+			lua_pushlstring(lua_state_->GetCState(), value, len);
+			lua_settable(lua_state_->GetCState(), -3);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		void SetString(const char * key, const std::string & value) {
+			SetString(key, value.data(), value.size());
+		}
+		
+		void SetString(int key, const std::string & value) {
+			SetString(key, value.data(), value.size());
+		}
+		
+		void SetString(const LuaObject & key, const std::string & value) {
+			SetString(key, value.data(), value.size());
+		}
+		
+		void SetString(const char * key, const LuaStringView & value) {
+			SetString(key, value.data(), value.size());
+		}
+		
+		void SetString(int key, const LuaStringView & value) {
+			SetString(key, value.data(), value.size());
+		}
+		
+		void SetString(const LuaObject & key, const LuaStringView & value) {
+			SetString(key, value.data(), value.size());
+		}
+		
+		void SetUserData(const char * key, void * value) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key != NULL);
+			Push();
+			lua_newuserdata(lua_state_->GetCState(), sizeof(void *));
+			void ** inner_value = (void **)lua_touserdata(lua_state_->GetCState(), -1);
+			*inner_value = value;
+			lua_setfield(lua_state_->GetCState(), -2, key);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		// Bulk assignment.  These push the table once and write every entry
+		// with a raw set, so they are much cheaper than calling SetNumber()
+		// and friends in a loop.  Like rawset, they bypass __newindex.
+		
+		template <typename Iterator>
+		void SetArray(Iterator first, Iterator last, int start_index = 1) {
+			luapluslite_assert(IsTable() == true);
+			Push();
+			LuaRawSetArray(lua_state_->GetCState(), -1, first, last, start_index);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		template <typename T, typename Allocator>
+		void SetArray(const std::vector<T, Allocator> & values, int start_index = 1) {
+			SetArray(values.begin(), values.end(), start_index);
+		}
+		
+		template <typename T>
+		void SetArray(std::initializer_list<T> values, int start_index = 1) {
+			SetArray(values.begin(), values.end(), start_index);
+		}
+		
+		template <typename Iterator>
+		void SetFields(Iterator first, Iterator last) {
+			luapluslite_assert(IsTable() == true);
+			Push();
+			LuaRawSetFields(lua_state_->GetCState(), -1, first, last);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		template <typename K, typename V, typename Compare, typename Allocator>
+		void SetFields(const std::map<K, V, Compare, Allocator> & fields) {
+			SetFields(fields.begin(), fields.end());
+		}
+		
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Table Value Retrieval
+#endif
+		
+		LuaObject GetByName(const char * key) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key != NULL);
+			Push();
+			lua_getfield(lua_state_->GetCState(), -1, key);
+			LuaObject value(lua_state_, -1);
+			lua_pop(lua_state_->GetCState(), 2);
+			return value;
+		}
+		
+		LuaObject GetByIndex(int key) {
+			luapluslite_assert(IsTable() == true);
+			Push();
+			lua_pushinteger(lua_state_->GetCState(), key);
+			lua_gettable(lua_state_->GetCState(), -2);
+			LuaObject value(lua_state_, -1);
+			lua_pop(lua_state_->GetCState(), 2);
+			return value;
+		}
+		
+		LuaObject GetByObject(const LuaObject & key) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(key.IsNone() == false);
+			PushWithKey(key);
+			lua_gettable(lua_state_->GetCState(), -2);
+			LuaObject value(lua_state_, -1);
+			lua_pop(lua_state_->GetCState(), 2);
+			return value;
+		}
+		
+		LuaObject operator[](const char * key) {
+			return GetByName(key);
+		}
+		
+		LuaObject operator[](int key) {
+			return GetByIndex(key);
+		}
+		
+		LuaObject operator[](const LuaObject & key) {
+			return GetByObject(key);
+		}
+		
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Table Iteration
+#endif
+		
+		// Calls 'callback(key, value)' once for each entry in the table,
+		// where 'key' and 'value' are LuaStackObjects.  The table is pushed
+		// once and walked with lua_next, so no references are created.
+		// As with lua_next, the callback must not modify the key (for
+		// example, by calling ToString() on a numeric key).
+		template <typename Callback>
+		void ForEach(Callback callback) const;
+		
+		// Range-based iteration over the table's entries, as in:
+		//
+		//   for (auto entry : table) { ... entry.first ... entry.second ... }
+		//
+		// See LuaTableIterator for the rules that apply while iterating.
+		LuaTableIterator begin() const;
+		LuaTableIterator end() const;
+		
+		// Converts the table's sequence, 1..#t, into a vector.  A LuaException
+		// is thrown if any element cannot be converted to a T, regardless of
+		// LuaPlusLite__assertions_throw_exceptions.  Each element is popped
+		// once converted, so T must own its value (std::string rather than
+		// const char *).
+		template <typename T>
+		std::vector<T> ToVector() const {
+			static_assert( ! LuaStackValueIsBorrowed<typename std::decay<T>::type>::value,
+				"ToVector pops each element after converting it; use std::string or LuaObject instead");
+			luapluslite_assert(IsTable() == true);
+			lua_State * L = lua_state_->GetCState();
+			Push();
+			size_t count = lua_rawlen(L, -1);
+			std::vector<T> values;
+			values.reserve(count);
+			for (size_t i = 1; i <= count; ++i) {
+				lua_rawgeti(L, -1, (int)i);
+				bool matched = false;
+				values.push_back(LuaStackTraitsOf<T>::TryGet(L, -1, &matched));
+				lua_pop(L, 1);
+				if ( ! matched) {
+					lua_pop(L, 1);
+					throw LuaException(std::string("cannot convert element to ") + LuaStackTraitsOf<T>::TypeName());
+				}
+			}
+			lua_pop(L, 1);
+			return values;
+		}
+		
+		// Converts the table into a map.  Entries whose key or value cannot
+		// be converted to a K or a V are skipped.  As with ToVector, K and V
+		// must own their values.
+		template <typename K, typename V>
+		std::map<K, V> ToMap() const {
+			static_assert( ! LuaStackValueIsBorrowed<typename std::decay<K>::type>::value && ! LuaStackValueIsBorrowed<typename std::decay<V>::type>::value,
+				"ToMap pops each entry after converting it; use std::string or LuaObject instead");
+			luapluslite_assert(IsTable() == true);
+			lua_State * L = lua_state_->GetCState();
+			Push();
+			std::map<K, V> values;
+			lua_pushnil(L);
+			while (lua_next(L, -2) != 0) {
+				// Convert a copy of the key, as converting a number to a
+				// string in place would confuse lua_next.
+				lua_pushvalue(L, -2);
+				bool key_matched = false;
+				bool value_matched = false;
+				K key = LuaStackTraitsOf<K>::TryGet(L, -1, &key_matched);
+				V value = LuaStackTraitsOf<V>::TryGet(L, -2, &value_matched);
+				if (key_matched && value_matched) {
+					values[key] = value;
+				}
+				lua_pop(L, 2);
+			}
+			lua_pop(L, 1);
+			return values;
+		}
+		
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Function Calling
+#endif
+
+		// Calls the function held by this LuaObject, converting arguments
+		// and the result via LuaStackTraits.  Lua errors are rethrown as
+		// LuaExceptions.  The result is popped before Call returns, so R
+		// must own its value: std::string rather than const char *, and
+		// LuaObject rather than LuaStackObject.  For example:
+		//
+		//   lua_Number sum = add_function.Call<lua_Number>(1, 2.5);
+		//
+		template <typename R, typename... Args>
+		R Call(const Args &... args) const {
+			luapluslite_assert(lua_state_ != NULL);
+			lua_State * L = lua_state_->GetCState();
+			if ( ! lua_checkstack(L, (int)sizeof...(Args) + 1)) {
+				throw LuaException("stack overflow");
+			}
+			const int old_top = lua_gettop(L);
+			Push();
+			LuaPushArguments(L, args...);
+			if (lua_pcall(L, (int)sizeof...(Args), LuaCallResult<R>::count, 0) != LUA_OK) {
+				const char * error_message = lua_tostring(L, -1);
+				LuaException exception(error_message ? error_message : "(error object is not a string)");
+				lua_settop(L, old_top);
+				throw exception;
+			}
+			return LuaCallResult<R>::Pop(L, old_top);
+		}
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Function Registration
+#endif
+
+		// Binds a function pointer, lambda or other function object to
+		// 'name' in this table.  For example:
+		//
+		//   globals.RegisterDirect("add", &Add);
+		//   globals.RegisterDirect("scale", [](double x) { return x * 2.0; });
+		//
+		template <typename F>
+		void RegisterDirect(const char * name, F function) {
+			luapluslite_assert(IsTable() == true);
+			luapluslite_assert(name != NULL);
+			Push();
+			LuaPushDirectClosure(lua_state_->GetCState(), function);
+			lua_setfield(lua_state_->GetCState(), -2, name);
+			lua_pop(lua_state_->GetCState(), 1);
+		}
+		
+		// Binds a member function, called on 'object', to 'name' in this
+		// table.  The object must outlive the binding.
+		template <typename Object, typename R, typename... Args>
+		void RegisterDirect(const char * name, Object & object, R (Object::*method)(Args...)) {
+			LuaMethodBinder<Object, R (Object::*)(Args...), R, Args...> binder = { &object, method };
+			RegisterDirect(name, binder);
+		}
+		
+		template <typename Object, typename R, typename... Args>
+		void RegisterDirect(const char * name, const Object & object, R (Object::*method)(Args...) const) {
+			LuaMethodBinder<const Object, R (Object::*)(Args...) const, R, Args...> binder = { &object, method };
+			RegisterDirect(name, binder);
+		}
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Private Stuff
+#endif
+	private:
+		// Whether the value is one that lua_tonumberx might convert.
+		bool IsNumberOrString() const {
+#if LuaPlusLite__IsString_and_IsNumber_only_match_explicitly == 1
+			return type_ == LUA_TNUMBER;
+#else
+			return type_ == LUA_TNUMBER || type_ == LUA_TSTRING;
+#endif
+		}
+		
+		// Pushes this table, then 'key', which must belong to the same LuaState.
+		void PushWithKey(const LuaObject & key) const {
+			luapluslite_assert(key.lua_state_ == lua_state_);
+			lua_state_->PushRefs(ref_, key.ref_);
+		}
+		
+		void AssignValueToState(LuaState * state) {
+			if (lua_state_ != NULL && lua_state_ != state) {
+				Reset();
+			}
+			lua_state_ = state;
+			type_ = lua_type(state->GetCState(), -1);
+			if (ref_ == LUA_NOREF) {
+				ref_ = state->NewRef();
+			} else {
+				state->SetRef(ref_);
+			}
+		}
+
+		// Takes a new reference to the value at 'stack_position' on 'L',
+		// a thread of lua_state_.
+		void RefValue(lua_State * L, int stack_position) {
+			lua_pushvalue(L, stack_position);
+			type_ = lua_type(L, -1);
+			if (L != lua_state_->GetCState()) {
+				lua_xmove(L, lua_state_->GetCState(), 1);
+			}
+			ref_ = lua_state_->NewRef();
+		}
+
+		LuaState * lua_state_;
+		int ref_;
+		int type_;
+	};
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - LuaKey
+#endif
+	
+	// A string key that is interned once and then held by the LuaState's
+	// reference pool, which keeps it from being collected.  Looking up a
+	// field by LuaKey pushes the existing string, rather than hashing and
+	// interning a C string on every access as lua_getfield does.  A LuaKey
+	// frees its reference when destroyed, so it must not outlive its
+	// LuaState; keep keys alongside the state they belong to, rather than
+	// in static storage:
+	//
+	//   struct Scene {
+	//       LuaState state;
+	//       LuaKey position;
+	//       Scene() : position(&state, "position") {}
+	//   };
+	//
+	//   LuaObject value = entity[scene.position];
+	//
+	class LuaKey : public LuaObject {
+	public:
+		LuaKey() {
+		}
+		
+		LuaKey(LuaState * state, const char * name) {
+			luapluslite_assert(name != NULL);
+			AssignString(state, name);
+		}
+		
+		const char * GetName() {
+			return GetString();
+		}
+	};
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - LuaStackObject
+#endif
+
+	// A LuaStackObject is a lightweight view of a single Lua stack slot.
+	// Unlike a LuaObject, it never copies its value anywhere: it is only
+	// valid for as long as the slot it refers to is, which makes it suited
+	// to reading the arguments of a lua_CFunction.  Construct a LuaObject
+	// from it whenever the value needs to outlive the stack slot.
+	class LuaStackObject {
+	public:
+	
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Initialization
+#endif
+
+		LuaStackObject() : lua_state_(NULL), c_state_(NULL), stack_index_(0)
+		{
+		}
+		
+		LuaStackObject(LuaState * state, int stack_index) : lua_state_(state), c_state_(NULL), stack_index_(0)
+		{
+			luapluslite_assert(state != NULL);
+			c_state_ = state->GetCState();
+			stack_index_ = lua_absindex(c_state_, stack_index);
+		}
+		
+		// A slot on any thread of a state, such as the coroutine that a
+		// lua_CFunction was called from.  The LuaState is only looked up
+		// if GetState is called.
+		LuaStackObject(lua_State * L, int stack_index) : lua_state_(NULL), c_state_(L), stack_index_(0)
+		{
+			luapluslite_assert(L != NULL);
+			stack_index_ = lua_absindex(L, stack_index);
+		}
+		
+		LuaState * GetState() const {
+			if ( ! lua_state_ && c_state_) {
+				lua_state_ = LuaState::CastState(c_state_);
 			}
-			Push();
-			const bool is_match = lua_isuserdata(lua_state_->GetCState(), -1);
-			lua_state_->Pop(1);
-			return is_match;
+			return lua_state_;
 		}
 		
-		bool IsFunction() const {
-			if ( ! lua_state_) {
+		// The thread whose stack the slot is on.
+		lua_State * GetCState() const {
+			return c_state_;
+		}
+		
+		int GetIndex() const {
+			return stack_index_;
+		}
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Stack Management
+#endif
+
+		void Push() const {
+			luapluslite_assert(c_state_ != NULL);
+			lua_pushvalue(c_state_, stack_index_);
+		}
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Value Retrieval
+#endif
+
+		bool GetBoolean() const {
+			return ToBoolean();
+		}
+		
+		double GetDouble() const {
+			return GetNumber();
+		}
+		
+		float GetFloat() const {
+			return GetNumber();
+		}
+		
+		lua_Integer GetInteger() const {
+			return ToInteger();
+		}
+		
+		void * GetLightUserData() const {
+			return ToUserData();
+		}
+		
+		lua_Number GetNumber() const {
+			return ToNumber();
+		}
+		
+		const char * GetString() const {
+			return ToString();
+		}
+		
+		void * GetUserData() const {
+			return ToUserData();
+		}
+
+		bool ToBoolean() const {
+			if ( ! c_state_) {
 				return false;
 			}
-			Push();
-			const bool is_match = lua_isfunction(lua_state_->GetCState(), -1);
-			lua_state_->Pop(1);
-			return is_match;
+			return lua_toboolean(c_state_, stack_index_);
 		}
 		
-		bool IsCFunction() const {
-			if ( ! lua_state_) {
-				return false;
+		lua_Integer ToInteger(int * isnum = NULL) const {
+			luapluslite_assert(IsInteger() == true);
+			return lua_tointegerx(c_state_, stack_index_, isnum);
+		}
+		
+		lua_Number ToNumber(int * isnum = NULL) const {
+			luapluslite_assert(IsNumber() == true);
+			return lua_tonumberx(c_state_, stack_index_, isnum);
+		}
+		
+		// Note: strings are converted in place, on the stack, as with lua_tolstring.
+		const char * ToString(size_t * len = NULL) const {
+			luapluslite_assert(IsString() == true);
+			return lua_tolstring(c_state_, stack_index_, len);
+		}
+		
+		LuaStringView ToStringView() const {
+			luapluslite_assert(IsString() == true);
+			size_t len = 0;
+			const char * value = lua_tolstring(c_state_, stack_index_, &len);
+			return LuaStringView(value, len);
+		}
+		
+		void * ToUserData() const {
+			luapluslite_assert(IsUserData() == true);
+			switch (Type()) {
+				case LUA_TUSERDATA:
+				{
+					// TODO: prevent certain, maybe all, userdata objects from being dereferenced in ToUserData
+					void ** inner_value = (void **)lua_touserdata(c_state_, stack_index_);
+					return *inner_value;
+				}
+				
+				case LUA_TLIGHTUSERDATA:
+					return lua_touserdata(c_state_, stack_index_);
+				
+				default:
+					luapluslite_assert(Type() == LUA_TUSERDATA || Type() == LUA_TLIGHTUSERDATA);
+					return NULL;
 			}
-			Push();
-			const bool is_match = lua_iscfunction(lua_state_->GetCState(), -1);
-			lua_state_->Pop(1);
-			return is_match;
 		}
 		
-		bool IsLightUserData() const {
-			if ( ! lua_state_) {
+		// Non-throwing accessors, as for LuaObject.
+		
+		bool TryToInteger(lua_Integer * value) const {
+			if ( ! c_state_) {
 				return false;
 			}
-			Push();
-			const bool is_match = lua_islightuserdata(lua_state_->GetCState(), -1);
-			lua_state_->Pop(1);
-			return is_match;
+#if LuaPlusLite__IsString_and_IsNumber_only_match_explicitly == 1
+			if (Type() != LUA_TNUMBER) {
+				return false;
+			}
+#endif
+			int isnum = 0;
+			lua_Integer result = lua_tointegerx(c_state_, stack_index_, &isnum);
+			if (isnum) {
+				*value = result;
+			}
+			return isnum != 0;
 		}
 		
-		bool IsThread() const {
-			if ( ! lua_state_) {
+		bool TryToNumber(lua_Number * value) const {
+			if ( ! c_state_) {
 				return false;
 			}
-			Push();
-			const bool is_match = lua_isthread(lua_state_->GetCState(), -1);
-			lua_state_->Pop(1);
-			return is_match;
+#if LuaPlusLite__IsString_and_IsNumber_only_match_explicitly == 1
+			if (Type() != LUA_TNUMBER) {
+				return false;
+			}
+#endif
+			int isnum = 0;
+			lua_Number result = lua_tonumberx(c_state_, stack_index_, &isnum);
+			if (isnum) {
+				*value = result;
+			}
+			return isnum != 0;
 		}
 		
+		// Note: as with ToString, numbers are converted in place.
+		bool TryToString(const char ** value, size_t * len = NULL) const {
+			if ( ! IsString()) {
+				return false;
+			}
+			*value = lua_tolstring(c_state_, stack_index_, len);
+			return true;
+		}
 		
+		bool TryToUserData(void ** value) const {
+			switch (Type()) {
+				case LUA_TUSERDATA:
+					*value = *(void **)lua_touserdata(c_state_, stack_index_);
+					return true;
+				
+				case LUA_TLIGHTUSERDATA:
+					*value = lua_touserdata(c_state_, stack_index_);
+					return true;
+				
+				default:
+					return false;
+			}
+		}
+
+
 #if defined(__clang__) || defined(__GNUC__)
-#pragma mark - Table Value Assignment
+#pragma mark - Type Checking
 #endif
 
-		// TODO: allow Set operation on userdata objects with appropriate metatables
-		// TODO: make Set operations with LuaObject-based keys check for compatible LuaStates
+		int Type() const {
+			if ( ! c_state_) {
+				return LUA_TNONE;
+			}
+			return lua_type(c_state_, stack_index_);
+		}
 		
-		LuaObject CreateTable(const char * key, int narr = 0, int nrec = 0) {
+		const char * TypeName() const {
+			int type = Type();
+			if (c_state_) {
+				return lua_typename(c_state_, type);
+			} else {
+				return lua_typename(NULL, type);
+			}
+		}
+		
+		bool IsBoolean() const {
+			return c_state_ && lua_isboolean(c_state_, stack_index_);
+		}
+		
+		bool IsConvertibleToString() const {
+			return c_state_ && lua_isstring(c_state_, stack_index_);
+		}
+		
+		bool IsInteger() const {
+			return IsNumber();
+		}
+		
+		bool IsString() const {
+#if LuaPlusLite__IsString_and_IsNumber_only_match_explicitly == 1
+			return Type() == LUA_TSTRING;
+#else
+			return IsConvertibleToString();
+#endif
+		}
+		
+		bool IsNumber() const {
+#if LuaPlusLite__IsString_and_IsNumber_only_match_explicitly == 1
+			return Type() == LUA_TNUMBER;
+#else
+			return c_state_ && lua_isnumber(c_state_, stack_index_);
+#endif
+		}
+		
+		bool IsTable() const {
+			return c_state_ && lua_istable(c_state_, stack_index_);
+		}
+		
+		bool IsNil() const {
+			return c_state_ && lua_isnil(c_state_, stack_index_);
+		}
+		
+		bool IsNone() const {
+			// API DIFFERENCE: as with LuaObject, LuaPlusLite returns 'true'
+			// for an uninitialized LuaStackObject.
+			return ! c_state_ || lua_isnone(c_state_, stack_index_);
+		}
+		
+		bool IsNoneOrNil() const {
+			return ! c_state_ || lua_isnoneornil(c_state_, stack_index_);
+		}
+		
+		bool IsUserData() const {
+			return c_state_ && lua_isuserdata(c_state_, stack_index_);
+		}
+		
+		bool IsFunction() const {
+			return c_state_ && lua_isfunction(c_state_, stack_index_);
+		}
+		
+		bool IsCFunction() const {
+			return c_state_ && lua_iscfunction(c_state_, stack_index_);
+		}
+		
+		bool IsLightUserData() const {
+			return c_state_ && lua_islightuserdata(c_state_, stack_index_);
+		}
+		
+		bool IsThread() const {
+			return c_state_ && lua_isthread(c_state_, stack_index_);
+		}
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Table Value Retrieval
+#endif
+
+		// Values retrieved from a table are returned as LuaObjects, as they
+		// do not have a stack slot of their own.
+
+		LuaObject GetByName(const char * key) const {
 			luapluslite_assert(IsTable() == true);
 			luapluslite_assert(key != NULL);
-			Push();
-			lua_createtable(lua_state_->GetCState(), narr, nrec);
-			LuaObject value(lua_state_, -1);
-			lua_setfield(lua_state_->GetCState(), -2, key);
-			lua_pop(lua_state_->GetCState(), 1);
+			lua_getfield(c_state_, stack_index_, key);
+			LuaObject value(c_state_, -1);
+			lua_pop(c_state_, 1);
 			return value;
 		}
-
-		LuaObject CreateTable(int key, int narr = 0, int nrec = 0) {
+		
+		LuaObject GetByIndex(int key) const {
 			luapluslite_assert(IsTable() == true);
-			Push();
-			lua_pushinteger(lua_state_->GetCState(), key);
-			lua_createtable(lua_state_->GetCState(), narr, nrec);
-			LuaObject value(lua_state_, -1);
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+			lua_pushinteger(c_state_, key);
+			lua_gettable(c_state_, stack_index_);
+			LuaObject value(c_state_, -1);
+			lua_pop(c_state_, 1);
 			return value;
 		}
 		
-		LuaObject CreateTable(LuaObject key, int narr = 0, int nrec = 0)
-		{
+		LuaObject GetByObject(const LuaObject & key) const {
 			luapluslite_assert(IsTable() == true);
 			luapluslite_assert(key.IsNone() == false);
-			Push();
-			key.Push();
-			lua_createtable(lua_state_->GetCState(), narr, nrec);
-			LuaObject value(lua_state_, -1);
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+			key.Push(c_state_);
+			lua_gettable(c_state_, stack_index_);
+			LuaObject value(c_state_, -1);
+			lua_pop(c_state_, 1);
 			return value;
 		}
 		
-		// TODO: Implement Insert(LuaObject)
-
-		void SetBoolean(const char * key, bool value) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key != NULL);
-			Push();
-			lua_pushboolean(lua_state_->GetCState(), value);
-			lua_setfield(lua_state_->GetCState(), -2, key);
-			lua_pop(lua_state_->GetCState(), 1);
+		LuaObject operator[](const char * key) const {
+			return GetByName(key);
+		}
+		
+		LuaObject operator[](int key) const {
+			return GetByIndex(key);
+		}
+		
+		LuaObject operator[](const LuaObject & key) const {
+			return GetByObject(key);
+		}
+		
+	private:
+		mutable LuaState * lua_state_;
+		lua_State * c_state_;
+		int stack_index_;
+	};
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - Type Marshalling for LuaObject and LuaStackObject
+#endif
+
+	template <>
+	struct LuaStackTraits<LuaObject> {
+		static void Push(lua_State * L, const LuaObject & value) {
+			if (value.GetState()) {
+				value.Push(L);
+			} else {
+				lua_pushnil(L);
+			}
+		}
+		static LuaObject Get(lua_State * L, int stack_index) {
+			return LuaObject(L, stack_index);
+		}
+		static LuaObject TryGet(lua_State * L, int stack_index, bool * matched) {
+			*matched = Match(L, stack_index);
+			return Get(L, stack_index);
+		}
+		static bool Match(lua_State * L, int stack_index) {
+			return ! lua_isnone(L, stack_index);
+		}
+		static const char * TypeName() {
+			return "value";
+		}
+	};
+	
+	template <>
+	struct LuaStackTraits<LuaStackObject> {
+		static void Push(lua_State * L, const LuaStackObject & value) {
+			if (value.GetCState() == L) {
+				lua_pushvalue(L, value.GetIndex());
+			} else {
+				value.Push();
+				lua_xmove(value.GetCState(), L, 1);
+			}
+		}
+		static LuaStackObject Get(lua_State * L, int stack_index) {
+			return LuaStackObject(L, stack_index);
+		}
+		static LuaStackObject TryGet(lua_State * L, int stack_index, bool * matched) {
+			*matched = Match(L, stack_index);
+			return Get(L, stack_index);
+		}
+		static bool Match(lua_State * L, int stack_index) {
+			return ! lua_isnone(L, stack_index);
+		}
+		static const char * TypeName() {
+			return "value";
+		}
+	};
+	
+	template <>
+	struct LuaStackValueIsBorrowed<LuaStackObject> : public std::true_type {
+	};
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - LuaTableIterator
+#endif
+	
+	// An input iterator over a table's key/value pairs, built on lua_next.
+	// Each entry is a pair of LuaStackObjects, and so is only valid until
+	// the iterator is advanced.
+	//
+	// For as long as it is iterating, the iterator keeps the table, the
+	// current key, and the current value on the Lua stack.  Code inside a
+	// loop must leave the stack as it found it, and must not modify the
+	// key.  Leaving a loop early is fine: the iterator's destructor pops
+	// whatever it pushed.
+	class LuaTableIterator {
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef std::pair<LuaStackObject, LuaStackObject> value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const value_type * pointer;
+		typedef const value_type & reference;
+		
+		LuaTableIterator() : lua_state_(NULL), table_index_(0)
+		{
+		}
+		
+		explicit LuaTableIterator(const LuaObject & table) : lua_state_(table.GetState()), table_index_(0)
+		{
+			luapluslite_assert(table.IsTable() == true);
+			lua_State * L = lua_state_->GetCState();
+			table.Push();
+			table_index_ = lua_gettop(L);
+			lua_pushnil(L);
+			Next();
 		}
 		
-		void SetBoolean(int key, bool value) {
-			luapluslite_assert(IsTable() == true);
-			Push();
-			lua_pushinteger(lua_state_->GetCState(), key);
-			lua_pushboolean(lua_state_->GetCState(), value);
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+		LuaTableIterator(LuaTableIterator && src) : lua_state_(src.lua_state_), table_index_(src.table_index_), entry_(src.entry_)
+		{
+			src.lua_state_ = NULL;
+			src.table_index_ = 0;
 		}
 		
-		void SetBoolean(LuaObject key, bool value) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key.IsNone() == false);
-			Push();
-			key.Push();
-			lua_pushboolean(lua_state_->GetCState(), value);
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+		~LuaTableIterator() {
+			if (lua_state_ != NULL) {
+				lua_settop(lua_state_->GetCState(), table_index_ - 1);
+			}
 		}
 		
-		void SetInteger(const char * key, lua_Integer value) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key != NULL);
-			Push();
-			lua_pushinteger(lua_state_->GetCState(), value);
-			lua_setfield(lua_state_->GetCState(), -2, key);
-			lua_pop(lua_state_->GetCState(), 1);
+		reference operator*() const {
+			return entry_;
 		}
 		
-		void SetInteger(int key, lua_Integer value) {
-			luapluslite_assert(IsTable() == true);
-			Push();
-			lua_pushinteger(lua_state_->GetCState(), key);
-			lua_pushinteger(lua_state_->GetCState(), value);
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+		pointer operator->() const {
+			return &entry_;
 		}
 		
-		void SetInteger(LuaObject key, lua_Integer value) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key.IsNone() == false);
-			Push();
-			key.Push();
-			lua_pushinteger(lua_state_->GetCState(), value);
-			lua_settable(lua_state_->GetCState(), -3);
+		LuaTableIterator & operator++() {
+			luapluslite_assert(lua_state_ != NULL);
 			lua_pop(lua_state_->GetCState(), 1);
+			Next();
+			return *this;
 		}
 		
-		void SetLightUserData(const char * key, void * value) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key != NULL);
-			Push();
-			lua_pushlightuserdata(lua_state_->GetCState(), value);
-			lua_setfield(lua_state_->GetCState(), -2, key);
-			lua_pop(lua_state_->GetCState(), 1);
+		// Iterators compare equal only when both have run off the end of
+		// their tables.
+		bool operator==(const LuaTableIterator & other) const {
+			return lua_state_ == NULL && other.lua_state_ == NULL;
 		}
 		
-		void SetLightUserData(int key, void * value) {
-			luapluslite_assert(IsTable() == true);
-			Push();
-			lua_pushinteger(lua_state_->GetCState(), key);
-			lua_pushlightuserdata(lua_state_->GetCState(), value);
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+		bool operator!=(const LuaTableIterator & other) const {
+			return ! (*this == other);
 		}
 		
-		void SetLightUserData(LuaObject key, void * value) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key.IsNone() == false);
-			Push();
-			key.Push();
-			lua_pushlightuserdata(lua_state_->GetCState(), value);
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+	private:
+		LuaTableIterator(const LuaTableIterator &);
+		LuaTableIterator & operator=(const LuaTableIterator &);
+		
+		// Expects the previous key at the top of the stack.
+		void Next() {
+			lua_State * L = lua_state_->GetCState();
+			if (lua_next(L, table_index_) != 0) {
+				entry_.first = LuaStackObject(lua_state_, -2);
+				entry_.second = LuaStackObject(lua_state_, -1);
+			} else {
+				lua_settop(L, table_index_ - 1);
+				lua_state_ = NULL;
+				table_index_ = 0;
+				entry_ = value_type();
+			}
 		}
 		
-		void SetNil(const char * key) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key != NULL);
-			Push();
-			lua_pushnil(lua_state_->GetCState());
-			lua_setfield(lua_state_->GetCState(), -2, key);
-			lua_pop(lua_state_->GetCState(), 1);
+		LuaState * lua_state_;
+		int table_index_;
+		value_type entry_;
+	};
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - LuaFunction
+#endif
+
+	// LuaFunction wraps a LuaObject holding a function, and gives it a
+	// C++ function signature:
+	//
+	//   LuaFunction<int (int, int)> add = state.GetGlobal("add");
+	//   int sum = add(1, 2);
+	//
+	template <typename Signature>
+	class LuaFunction;
+	
+	template <typename R, typename... Args>
+	class LuaFunction<R (Args...)> {
+	public:
+		LuaFunction() {
 		}
 		
-		void SetNil(int key) {
-			luapluslite_assert(IsTable() == true);
-			Push();
-			lua_pushinteger(lua_state_->GetCState(), key);
-			lua_pushnil(lua_state_->GetCState());
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+		LuaFunction(const LuaObject & function) : function_(function) {
 		}
 		
-		void SetNil(LuaObject key) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key.IsNone() == false);
-			Push();
-			key.Push();
-			lua_pushnil(lua_state_->GetCState());
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+		R operator()(Args... args) const {
+			return function_.Call<R>(args...);
 		}
 		
-		void SetNumber(const char * key, lua_Number value) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key != NULL);
-			Push();
-			lua_pushnumber(lua_state_->GetCState(), value);
-			lua_setfield(lua_state_->GetCState(), -2, key);
-			lua_pop(lua_state_->GetCState(), 1);
+		const LuaObject & GetObject() const {
+			return function_;
 		}
 		
-		void SetNumber(int key, lua_Number value) {
-			luapluslite_assert(IsTable() == true);
-			Push();
-			lua_pushinteger(lua_state_->GetCState(), key);
-			lua_pushnumber(lua_state_->GetCState(), value);
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+	private:
+		LuaObject function_;
+	};
+
+
+#if defined(__clang__) || defined(__GNUC__)
+#pragma mark - LuaClass
+#endif
+
+	// Per-type information for LuaClass<T>.  Each LuaState keeps the
+	// metatable shared by all of its T instances in the registry, under
+	// the address of 'metatable_key'.  The class's name is kept in that
+	// metatable, as __name, so that states may register T under different
+	// names.
+	template <typename T>
+	struct LuaClassInfo {
+		static const char metatable_key;
+	};
+	
+	template <typename T>
+	const char LuaClassInfo<T>::metatable_key = 0;
+	
+	// The 'self' argument of a LuaClass<T> method.
+	template <typename T>
+	struct LuaClassSelf {
+		T * object;
+	};
+	
+	// Only usable from LuaClass<T> trampolines, which keep T's metatable in
+	// upvalue 2.  Comparing metatables identifies T instances without any
+	// string lookups.
+	template <typename T>
+	struct LuaStackTraits<LuaClassSelf<T> > {
+		static LuaClassSelf<T> TryGet(lua_State * L, int stack_index, bool * matched) {
+			LuaClassSelf<T> self = { NULL };
+			if (lua_getmetatable(L, stack_index)) {
+				if (lua_rawequal(L, -1, lua_upvalueindex(2))) {
+					self.object = static_cast<T *>(lua_touserdata(L, stack_index));
+				}
+				lua_pop(L, 1);
+			}
+			*matched = (self.object != NULL);
+			return self;
+		}
+		static const char * TypeName() {
+			return "userdata";
+		}
+	};
+	
+	// Reads the class's name from the metatable in upvalue 2.  The name
+	// stays valid after the pop, as the metatable holds on to it.
+	template <typename T>
+	struct LuaDirectArgumentName<LuaClassSelf<T> > {
+		static const char * Get(lua_State * L) {
+			lua_getfield(L, lua_upvalueindex(2), "__name");
+			const char * name = lua_tostring(L, -1);
+			lua_pop(L, 1);
+			return name ? name : LuaStackTraits<LuaClassSelf<T> >::TypeName();
 		}
+	};
+	
+	template <typename T, typename Method, typename R, typename... Args>
+	struct LuaClassMethodBinder {
+		Method method;
 		
-		void SetNumber(LuaObject key, lua_Number value) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key.IsNone() == false);
-			Push();
-			key.Push();
-			lua_pushnumber(lua_state_->GetCState(), value);
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+		R operator()(LuaClassSelf<T> self, Args... args) const {
+			return (self.object->*method)(args...);
+		}
+	};
+	
+	// Constructs a T, in place, inside a new full userdata.  The metatable
+	// is kept in upvalue 1.  The userdata is allocated by the trampoline,
+	// before Invoke converts any arguments, so that running out of memory
+	// does not unwind through them.  Until its metatable is set, the
+	// userdata has no __gc, and so may be abandoned if construction fails.
+	template <typename T, typename... Args>
+	struct LuaClassConstructor {
+		template <int... Indices>
+		static int Invoke(lua_State * L, void * storage, LuaIndices<Indices...>) {
+			try {
+				int bad_argument = 0;
+				std::tuple<typename std::decay<Args>::type...> arguments { LuaGetDirectArgument<Args>(L, Indices + 1, &bad_argument)... };
+				if (bad_argument != 0) {
+					return -bad_argument;
+				}
+				new (storage) T(std::move(std::get<Indices>(arguments))...);
+				lua_pushvalue(L, lua_upvalueindex(1));
+				lua_setmetatable(L, -2);
+				return 1;
+			} catch (std::exception & e) {
+				lua_pushstring(L, e.what());
+			} catch (...) {
+				lua_pushstring(L, "unknown C++ exception");
+			}
+			return LUAPLUSLITE_DIRECT_EXCEPTION;
 		}
 		
-		void SetString(const char * key, const char * value) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key != NULL);
-			luapluslite_assert(value != NULL);
-			Push();
-			lua_pushstring(lua_state_->GetCState(), value);
-			lua_setfield(lua_state_->GetCState(), -2, key);
-			lua_pop(lua_state_->GetCState(), 1);
+		static int Trampoline(lua_State * L) {
+			void * storage = lua_newuserdata(L, sizeof(T));
+			return LuaFinishDirectCall<Args...>(L, Invoke(L, storage, typename LuaMakeIndices<sizeof...(Args)>::type()));
+		}
+	};
+	
+	// Allocates a full userdata under lua_pcall, leaving it at the top of
+	// the stack, so that running out of memory throws a LuaException rather
+	// than unwinding through the caller's C++ frames.
+	inline int LuaNewUserDataProtectedCall(lua_State * L) {
+		lua_newuserdata(L, *static_cast<size_t *>(lua_touserdata(L, 1)));
+		return 1;
+	}
+	
+	inline void * LuaNewUserDataProtected(lua_State * L, size_t size) {
+		lua_pushcfunction(L, &LuaNewUserDataProtectedCall);
+		lua_pushlightuserdata(L, &size);
+		if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+			const char * error_message = lua_tostring(L, -1);
+			LuaException exception(error_message ? error_message : "not enough memory");
+			lua_pop(L, 1);
+			throw exception;
+		}
+		return lua_touserdata(L, -1);
+	}
+	
+	// LuaClass<T> binds a C++ class to Lua.  Instances are constructed
+	// directly inside the memory of a full userdata (rather than being
+	// referenced through a boxed pointer, as SetUserData does), and are
+	// destroyed by the __gc metamethod.  Methods live in a prebuilt table,
+	// which serves as both the metatable's __index and a global named after
+	// the class:
+	//
+	//   LuaClass<Vector2> vector2(&state, "Vector2");
+	//   vector2.Constructor<float, float>().Method("Length", &Vector2::Length);
+	//   state.DoString("v = Vector2.new(3, 4); print(v:Length())");
+	//
+	template <typename T>
+	class LuaClass {
+	public:
+		LuaClass(LuaState * state, const char * name) : lua_state_(state) {
+			static_assert(std::alignment_of<T>::value <= std::alignment_of<double>::value, "LuaClass<T> cannot store over-aligned types in a userdata");
+			luapluslite_assert(state != NULL);
+			luapluslite_assert(name != NULL);
+			lua_State * L = state->GetCState();
+			lua_rawgetp(L, LUA_REGISTRYINDEX, &LuaClassInfo<T>::metatable_key);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				lua_createtable(L, 0, 4);
+				lua_createtable(L, 0, 0);
+				lua_pushvalue(L, -1);
+				lua_setfield(L, -3, "__index");
+				// Hides the real metatable (and its __gc) from Lua code.
+				lua_setfield(L, -2, "__metatable");
+				lua_pushvalue(L, -1);
+				lua_pushcclosure(L, &LuaClass::Destroy, 1);
+				lua_setfield(L, -2, "__gc");
+				lua_pushvalue(L, -1);
+				lua_rawsetp(L, LUA_REGISTRYINDEX, &LuaClassInfo<T>::metatable_key);
+			}
+			lua_pushstring(L, name);
+			lua_setfield(L, -2, "__name");
+			metatable_ = LuaObject(state, -1);
+			lua_getfield(L, -1, "__index");
+			methods_ = LuaObject(state, -1);
+			lua_setglobal(L, name);
+			lua_pop(L, 1);
 		}
 		
-		void SetString(int key, const char * value) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(value != NULL);
-			Push();
-			lua_pushinteger(lua_state_->GetCState(), key);
-			lua_pushstring(lua_state_->GetCState(), value);
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+		const LuaObject & GetMetatable() const {
+			return metatable_;
 		}
 		
-		void SetString(LuaObject key, const char * value) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key.IsNone() == false);
-			luapluslite_assert(value != NULL);
-			Push();
-			key.Push();
-			lua_pushstring(lua_state_->GetCState(), value);
-			lua_settable(lua_state_->GetCState(), -3);
-			lua_pop(lua_state_->GetCState(), 1);
+		const LuaObject & GetMethods() const {
+			return methods_;
 		}
 		
-		void SetUserData(const char * key, void * value) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key != NULL);
-			Push();
-			lua_newuserdata(lua_state_->GetCState(), sizeof(void *));
-			void ** inner_value = (void **)lua_touserdata(lua_state_->GetCState(), -1);
-			*inner_value = value;
-			lua_setfield(lua_state_->GetCState(), -2, key);
-			lua_pop(lua_state_->GetCState(), 1);
+		// Registers a constructor, callable from Lua as ClassName.new(...).
+		template <typename... Args>
+		LuaClass & Constructor(const char * name = "new") {
+			luapluslite_assert(name != NULL);
+			lua_State * L = lua_state_->GetCState();
+			methods_.Push();
+			metatable_.Push();
+			lua_pushcclosure(L, &LuaClassConstructor<T, Args...>::Trampoline, 1);
+			lua_setfield(L, -2, name);
+			lua_pop(L, 1);
+			return *this;
 		}
 		
-#if defined(__clang__) || defined(__GNUC__)
-#pragma mark - Table Value Retrieval
-#endif
+		template <typename R, typename... Args>
+		LuaClass & Method(const char * name, R (T::*method)(Args...)) {
+			LuaClassMethodBinder<T, R (T::*)(Args...), R, Args...> binder = { method };
+			return RegisterMethod(name, binder);
+		}
 		
-		LuaObject GetByName(const char * key) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key != NULL);
-			Push();
-			lua_getfield(lua_state_->GetCState(), -1, key);
-			LuaObject value(lua_state_, -1);
-			lua_pop(lua_state_->GetCState(), 2);
-			return value;
+		template <typename R, typename... Args>
+		LuaClass & Method(const char * name, R (T::*method)(Args...) const) {
+			LuaClassMethodBinder<T, R (T::*)(Args...) const, R, Args...> binder = { method };
+			return RegisterMethod(name, binder);
 		}
 		
-		LuaObject GetByIndex(int key) {
-			luapluslite_assert(IsTable() == true);
-			Push();
-			lua_pushinteger(lua_state_->GetCState(), key);
-			lua_gettable(lua_state_->GetCState(), -2);
-			LuaObject value(lua_state_, -1);
-			lua_pop(lua_state_->GetCState(), 2);
-			return value;
+		// Constructs a new T, from C++.  Throws a LuaException if the
+		// userdata cannot be allocated.
+		template <typename... Args>
+		LuaObject New(Args &&... args) {
+			lua_State * L = lua_state_->GetCState();
+			void * storage = LuaNewUserDataProtected(L, sizeof(T));
+			try {
+				new (storage) T(std::forward<Args>(args)...);
+			} catch (...) {
+				lua_pop(L, 1);
+				throw;
+			}
+			metatable_.Push();
+			lua_setmetatable(L, -2);
+			LuaObject instance(lua_state_, -1);
+			lua_pop(L, 1);
+			return instance;
 		}
 		
-		LuaObject GetByObject(LuaObject key) {
-			luapluslite_assert(IsTable() == true);
-			luapluslite_assert(key.IsNone() == false);
-			// TODO: check that key is in the same state as 'this'
-			Push();
-			key.Push();
-			lua_gettable(lua_state_->GetCState(), -2);
-			LuaObject value(lua_state_, -1);
-			lua_pop(lua_state_->GetCState(), 2);
-			return value;
+		// Returns the T held by 'object', or NULL if it doesn't hold one.
+		static T * ToObject(const LuaObject & object) {
+			if ( ! object.IsUserData()) {
+				return NULL;
+			}
+			lua_State * L = object.GetState()->GetCState();
+			object.Push();
+			T * instance = ToObject(L, -1);
+			lua_pop(L, 1);
+			return instance;
 		}
 		
-		LuaObject operator[](const char * key) {
-			return GetByName(key);
+		static T * ToObject(lua_State * L, int stack_index) {
+			stack_index = lua_absindex(L, stack_index);
+			T * instance = NULL;
+			if (lua_getmetatable(L, stack_index)) {
+				lua_rawgetp(L, LUA_REGISTRYINDEX, &LuaClassInfo<T>::metatable_key);
+				if (lua_rawequal(L, -1, -2)) {
+					instance = static_cast<T *>(lua_touserdata(L, stack_index));
+				}
+				lua_pop(L, 2);
+			}
+			return instance;
 		}
 		
-		LuaObject operator[](int key) {
-			return GetByIndex(key);
+	private:
+		template <typename F>
+		LuaClass & RegisterMethod(const char * name, const F & binder) {
+			luapluslite_assert(name != NULL);
+			lua_State * L = lua_state_->GetCState();
+			methods_.Push();
+			metatable_.Push();
+			LuaPushDirectClosure(L, binder, 1);
+			lua_setfield(L, -2, name);
+			lua_pop(L, 1);
+			return *this;
 		}
 		
-		LuaObject operator[](LuaObject key) {
-			return GetByObject(key);
+		static int Destroy(lua_State * L) {
+			if (lua_getmetatable(L, 1)) {
+				if (lua_rawequal(L, -1, lua_upvalueindex(1))) {
+					static_cast<T *>(lua_touserdata(L, 1))->~T();
+				}
+				lua_pop(L, 1);
+			}
+			return 0;
 		}
 		
+		LuaState * lua_state_;
+		LuaObject metatable_;
+		LuaObject methods_;
+	};
+
+
 #if defined(__clang__) || defined(__GNUC__)
-#pragma mark - Private Stuff
+#pragma mark - LuaObject Miscellany
 #endif
-	private:
-		void AssignValueToState(LuaState * state) {
-			if (lua_state_ != NULL && lua_state_ != state) {
-				Reset();
+
+	inline LuaObject::LuaObject(const LuaStackObject & src) : lua_state_(src.GetState()), ref_(LUA_NOREF), type_(LUA_TNONE)
+	{
+		if (lua_state_ && lua_state_->GetCState()) {
+			RefValue(src.GetCState(), src.GetIndex());
+		}
+	}
+
+	
+	template <typename Callback>
+	inline void LuaObject::ForEach(Callback callback) const {
+		luapluslite_assert(IsTable() == true);
+		lua_State * L = lua_state_->GetCState();
+		int old_top = lua_gettop(L);
+		Push();
+		lua_pushnil(L);
+		try {
+			while (lua_next(L, -2) != 0) {
+				callback(LuaStackObject(lua_state_, -2), LuaStackObject(lua_state_, -1));
+				lua_pop(L, 1);
 			}
-			lua_state_ = state;
-			lua_rawsetp(state->GetCState(), LUA_REGISTRYINDEX, this);
+		} catch (...) {
+			lua_settop(L, old_top);
+			throw;
 		}
+		lua_pop(L, 1);
+	}
 	
-		LuaState * lua_state_;
-	};
-
+	inline LuaTableIterator LuaObject::begin() const {
+		return LuaTableIterator(*this);
+	}
+	
+	inline LuaTableIterator LuaObject::end() const {
+		return LuaTableIterator();
+	}
 
 #if defined(__clang__) || defined(__GNUC__)
 #pragma mark - LuaState Miscellany
 #endif
 	
-	LuaObject LuaState::Stack(int index) {
+	LuaStackObject LuaState::Stack(int index) {
 		// TODO: check for a valid stack index
-		return LuaObject(this, index);
+		return LuaStackObject(this, index);
 	}
 	
 	LuaObject LuaState::GetGlobal(const char * key) {
 		return GetGlobals()[key];
 	}
 	
+	inline LuaState::LuaState(const LuaStateSnapshot & snapshot) : LuaState(snapshot.GetOptions()) {
+		snapshot.Restore(*this);
+	}
+	
 	LuaObject LuaState::GetGlobals() {
 		lua_rawgeti(c_state_, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
 		LuaObject globals(this, -1);
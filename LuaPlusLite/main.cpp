@@ -7,9 +7,14 @@
 //
 
 #include <assert.h>
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <thread>
 
 #include "LuaPlusLite.h"
 
@@ -20,6 +25,8 @@ using namespace LuaPlusLite;
 // #includes for testing purposes only!
 extern "C" {
 #include "lobject.h"
+#include "lopcodes.h"
+#include "lstate.h"
 }
 
 static int fail_count = 0;
@@ -50,6 +57,340 @@ static void _check(bool condition, const char * conditionAsString, int line)
         testFunction(); \
     }
 
+static bool run_benchmarks = false;
+
+#define BENCHMARK(STRING_NAME, ITERATIONS) \
+    if (run_benchmarks) { \
+        const char * benchmarkName = STRING_NAME; \
+        const int benchmarkIterations = ITERATIONS; \
+        auto benchmarkFunction = [] () -> double { \
+            LuaState myLuaState; \
+            chrono::steady_clock::time_point benchmarkStart;
+
+#define BENCHMARK_LOOP \
+            benchmarkStart = chrono::steady_clock::now(); \
+            for (int iteration = 0; iteration < benchmarkIterations; iteration++)
+
+#define BENCHMARK_END \
+            return chrono::duration<double>(chrono::steady_clock::now() - benchmarkStart).count(); \
+        }; \
+        double seconds = benchmarkFunction(); \
+        logprintf("BENCHMARK %s: %d iterations in %.3f ms (%.1f ns/iteration)\n", \
+            benchmarkName, benchmarkIterations, seconds * 1000.0, (seconds * 1.0e9) / benchmarkIterations); \
+    }
+
+// A lua_Alloc which counts allocations in '*ud'.
+static void * counting_alloc(void * ud, void * ptr, size_t, size_t nsize) {
+	if (nsize == 0) {
+		free(ptr);
+		return NULL;
+	}
+	if (ptr == NULL) {
+		++*(int *)ud;
+	}
+	return realloc(ptr, nsize);
+}
+
+// Lua source for a framework of 'num_functions' functions, which also
+// builds a lookup table when run.
+static string make_framework_script(int num_functions) {
+	string script = "framework = {}\n";
+	char line[256];
+	for (int i = 0; i < num_functions; i++) {
+		snprintf(line, sizeof(line), "function framework.handler%d(request) local total = 0 for i = 1, %d do total = total + i * request end return total end\n", i, i + 1);
+		script += line;
+	}
+	script += "lookup = {} for i = 1, 2000 do lookup['key' .. i] = {index = i, weight = i % 7} end\n";
+	return script;
+}
+
+// Scripts that spend their time in the Lua VM rather than in C, for
+// measuring the interpreter itself.
+static const char * const interpreter_benchmark_scripts[][2] = {
+	{ "fib",
+		"local function fib(n) if n < 2 then return n end return fib(n - 1) + fib(n - 2) end\n"
+		"result = fib(30)\n" },
+	{ "nbody",
+		"local sqrt = math.sqrt\n"
+		"local PI = math.pi\n"
+		"local SOLAR_MASS = 4 * PI * PI\n"
+		"local DAYS_PER_YEAR = 365.24\n"
+		"local bodies = {\n"
+		"  {x = 0, y = 0, z = 0, vx = 0, vy = 0, vz = 0, mass = SOLAR_MASS},\n"
+		"  {x = 4.84143144246472090e+00, y = -1.16032004402742839e+00, z = -1.03622044471123109e-01,\n"
+		"   vx = 1.66007664274403694e-03 * DAYS_PER_YEAR, vy = 7.69901118419740425e-03 * DAYS_PER_YEAR,\n"
+		"   vz = -6.90460016972063023e-05 * DAYS_PER_YEAR, mass = 9.54791938424326609e-04 * SOLAR_MASS},\n"
+		"  {x = 8.34336671824457987e+00, y = 4.12479856412430479e+00, z = -4.03523417114321381e-01,\n"
+		"   vx = -2.76742510726862411e-03 * DAYS_PER_YEAR, vy = 4.99852801234917238e-03 * DAYS_PER_YEAR,\n"
+		"   vz = 2.30417297573763929e-05 * DAYS_PER_YEAR, mass = 2.85885980666130812e-04 * SOLAR_MASS},\n"
+		"  {x = 1.28943695621391310e+01, y = -1.51111514016986312e+01, z = -2.23307578892655734e-01,\n"
+		"   vx = 2.96460137564761618e-03 * DAYS_PER_YEAR, vy = 2.37847173959480950e-03 * DAYS_PER_YEAR,\n"
+		"   vz = -2.96589568540237556e-05 * DAYS_PER_YEAR, mass = 4.36624404335156298e-05 * SOLAR_MASS},\n"
+		"  {x = 1.53796971148509165e+01, y = -2.59193146099879641e+01, z = 1.79258772950371181e-01,\n"
+		"   vx = 2.68067772490389322e-03 * DAYS_PER_YEAR, vy = 1.62824170038242295e-03 * DAYS_PER_YEAR,\n"
+		"   vz = -9.51592254519715870e-05 * DAYS_PER_YEAR, mass = 5.15138902046611451e-05 * SOLAR_MASS},\n"
+		"}\n"
+		"local function advance(bodies, nbody, dt)\n"
+		"  for i = 1, nbody do\n"
+		"    local bi = bodies[i]\n"
+		"    local bix, biy, biz, bimass = bi.x, bi.y, bi.z, bi.mass\n"
+		"    local bivx, bivy, bivz = bi.vx, bi.vy, bi.vz\n"
+		"    for j = i + 1, nbody do\n"
+		"      local bj = bodies[j]\n"
+		"      local dx, dy, dz = bix - bj.x, biy - bj.y, biz - bj.z\n"
+		"      local d2 = dx * dx + dy * dy + dz * dz\n"
+		"      local mag = sqrt(d2)\n"
+		"      mag = dt / (mag * d2)\n"
+		"      local bm = bj.mass * mag\n"
+		"      bivx = bivx - (dx * bm)\n"
+		"      bivy = bivy - (dy * bm)\n"
+		"      bivz = bivz - (dz * bm)\n"
+		"      bm = bimass * mag\n"
+		"      bj.vx = bj.vx + (dx * bm)\n"
+		"      bj.vy = bj.vy + (dy * bm)\n"
+		"      bj.vz = bj.vz + (dz * bm)\n"
+		"    end\n"
+		"    bi.vx = bivx\n"
+		"    bi.vy = bivy\n"
+		"    bi.vz = bivz\n"
+		"    bi.x = bix + dt * bivx\n"
+		"    bi.y = biy + dt * bivy\n"
+		"    bi.z = biz + dt * bivz\n"
+		"  end\n"
+		"end\n"
+		"for i = 1, 100000 do advance(bodies, #bodies, 0.01) end\n"
+		"result = bodies[1].x\n" },
+	{ "method calls",
+		"local Account = {}\n"
+		"Account.__index = Account\n"
+		"function Account.new(balance) return setmetatable({balance = balance, count = 0}, Account) end\n"
+		"function Account:deposit(v) self.balance = self.balance + v; self.count = self.count + 1 end\n"
+		"function Account:get() return self.balance end\n"
+		"local accounts = {}\n"
+		"for i = 1, 100 do accounts[i] = Account.new(i) end\n"
+		"local total = 0\n"
+		"for round = 1, 20000 do\n"
+		"  for i = 1, #accounts do\n"
+		"    local a = accounts[i]\n"
+		"    a:deposit(1)\n"
+		"    total = total + a:get()\n"
+		"  end\n"
+		"end\n"
+		"result = total\n" },
+	{ "string operations",
+		"local parts = {}\n"
+		"local count = 0\n"
+		"for i = 1, 100000 do\n"
+		"  local s = 'item' .. i\n"
+		"  local key = s:sub(1, 4) .. (i % 10)\n"
+		"  if key == 'item5' then count = count + #s end\n"
+		"  if i % 100 == 0 then parts[#parts + 1] = s:upper() end\n"
+		"end\n"
+		"result = count + #table.concat(parts, ',')\n" },
+	{ "table churn",
+		"local total = 0\n"
+		"for round = 1, 200 do\n"
+		"  local list = {}\n"
+		"  for i = 1, 1000 do list[i] = {id = i, value = i * 2, tags = {}} end\n"
+		"  local map = {}\n"
+		"  for i = 1, #list do local item = list[i]; map['k' .. (item.id % 100)] = item end\n"
+		"  for i = #list, 1, -2 do list[i] = nil end\n"
+		"  for _, item in pairs(map) do total = total + item.value end\n"
+		"end\n"
+		"result = total\n" },
+};
+
+static int benchmark_instruction_count;
+
+static void count_instructions_hook(lua_State *, lua_Debug *) {
+	benchmark_instruction_count += 1000;
+}
+
+// Runs 'script' once with a count hook, to find roughly how many VM
+// instructions it executes, and then best-of-three without it, and logs
+// the instruction rate.
+static void run_interpreter_benchmark(const char * name, const char * script) {
+	LuaState::Options options;
+	options.OpenStandardLibraries();
+	{
+		LuaState state(options);
+		benchmark_instruction_count = 0;
+		lua_sethook(state.GetCState(), count_instructions_hook, LUA_MASKCOUNT, 1000);
+		state.DoString(script);
+	}
+	double best_seconds = 0;
+	for (int run = 0; run < 3; run++) {
+		LuaState state(options);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		if (state.DoString(script) != LUA_OK) {
+			logprintf("... error: %s\n", state.Stack(-1).GetString());
+			++fail_count;
+			return;
+		}
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		if (run == 0 || seconds < best_seconds) {
+			best_seconds = seconds;
+		}
+	}
+	logprintf("BENCHMARK Interpreter-bound script '%s': %.1fM VM instructions in %.3f ms (%.1fM instructions/s)\n",
+		name, benchmark_instruction_count / 1.0e6, best_seconds * 1000.0, benchmark_instruction_count / best_seconds / 1.0e6);
+}
+
+static double opcode_pair_counts[NUM_OPCODES][NUM_OPCODES];
+
+// Called before every instruction: counts the instruction together with
+// the one that follows it in the code, whichever runs next.  Fused
+// opcodes are counted as the opcodes they start with, so the report
+// doesn't depend on the fusions already in place.
+static void count_opcode_pairs_hook(lua_State * L, lua_Debug *) {
+	CallInfo * ci = L->ci;
+	if (isLua(ci)) {
+		Proto * p = clLvalue(ci->func)->p;
+		int pc = (int)(ci->u.l.savedpc - p->code) - 1;
+		if (pc >= 0 && pc + 1 < p->sizecode) {
+			OpCode first = luaP_baseop(GET_OPCODE(p->code[pc]));
+			OpCode second = luaP_baseop(GET_OPCODE(p->code[pc + 1]));
+			opcode_pair_counts[first][second] += 1;
+		}
+	}
+}
+
+// Runs the interpreter benchmark scripts and reports which pairs of
+// adjacent opcodes execute most often: the candidates for fusing into
+// superinstructions.  Each script's counts are taken as fractions of the
+// instructions it ran, and averaged, so that long-running scripts don't
+// drown out the rest.
+static void report_opcode_pairs() {
+	LuaState::Options options;
+	options.OpenStandardLibraries();
+	const size_t num_scripts = sizeof(interpreter_benchmark_scripts) / sizeof(interpreter_benchmark_scripts[0]);
+	vector<double> shares(NUM_OPCODES * NUM_OPCODES, 0.0);
+	for (size_t i = 0; i < num_scripts; i++) {
+		memset(opcode_pair_counts, 0, sizeof(opcode_pair_counts));
+		LuaState state(options);
+		lua_sethook(state.GetCState(), count_opcode_pairs_hook, LUA_MASKCOUNT, 1);
+		state.DoString(interpreter_benchmark_scripts[i][1]);
+		double total = 0;
+		for (int a = 0; a < NUM_OPCODES; a++) {
+			for (int b = 0; b < NUM_OPCODES; b++) {
+				total += opcode_pair_counts[a][b];
+			}
+		}
+		for (int a = 0; a < NUM_OPCODES && total > 0; a++) {
+			for (int b = 0; b < NUM_OPCODES; b++) {
+				shares[a * NUM_OPCODES + b] += opcode_pair_counts[a][b] / total / num_scripts;
+			}
+		}
+	}
+	vector<pair<double, int> > pairs;
+	for (size_t i = 0; i < shares.size(); i++) {
+		if (shares[i] > 0) {
+			pairs.push_back(make_pair(shares[i], (int)i));
+		}
+	}
+	sort(pairs.rbegin(), pairs.rend());
+	logprintf("Most frequently executed pairs of adjacent opcodes, averaged over %d scripts:\n", (int)num_scripts);
+	for (size_t i = 0; i < pairs.size() && i < 30; i++) {
+		logprintf("  %-10s %-10s %6.2f%%\n", luaP_opnames[pairs[i].second / NUM_OPCODES],
+			luaP_opnames[pairs[i].second % NUM_OPCODES], pairs[i].first * 100.0);
+	}
+}
+
+// Runs 'jobs' calls of a CPU-bound Lua function across 'num_workers'
+// threads, returning the seconds taken from the first post to the last
+// result.
+static double run_worker_pool_benchmark(unsigned int num_workers, int jobs) {
+	LuaState::Options options;
+	options.OpenStandardLibraries();
+	LuaWorkerPool workers(num_workers, options, [] (LuaState & state) {
+		state.DoString("function work(n) local total = 0 for i = 1, n do total = total + math.sqrt(i) * (i % 7) end return total end");
+	});
+	LuaMessageQueue results;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int i = 0; i < jobs; i++) {
+		std::unique_ptr<LuaMessage> job(new LuaMessage("work"));
+		job->AddInteger(200000);
+		job->SetReplyTo(&results);
+		workers.Post(std::move(job));
+	}
+	for (int i = 0; i < jobs; i++) {
+		results.Pop();
+	}
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static int add_integers(int a, int b) {
+	return a + b;
+}
+
+static int add_integers_lua_CFunction(lua_State * L) {
+	lua_pushinteger(L, luaL_checkinteger(L, 1) + luaL_checkinteger(L, 2));
+	return 1;
+}
+
+static int hook_calls;
+
+static void counting_hook(lua_State * L, lua_Debug *) {
+	if (++hook_calls == 10) {
+		lua_sethook(L, NULL, 0, 0);
+	}
+}
+
+static int start_counting_lua_CFunction(lua_State * L) {
+	lua_sethook(L, counting_hook, LUA_MASKCOUNT, 1);
+	return 0;
+}
+
+class Counter {
+public:
+	Counter() : count_(0) {
+	}
+	
+	int Increment(int amount) {
+		count_ += amount;
+		return count_;
+	}
+	
+	int GetCount() const {
+		return count_;
+	}
+	
+private:
+	int count_;
+};
+
+class Vector2 {
+public:
+	Vector2(double x, double y) : x_(x), y_(y) {
+		++num_instances;
+	}
+	
+	~Vector2() {
+		--num_instances;
+	}
+	
+	double Length() const {
+		return sqrt(x_ * x_ + y_ * y_);
+	}
+	
+	void Scale(double factor) {
+		x_ *= factor;
+		y_ *= factor;
+	}
+	
+	double GetX() const {
+		return x_;
+	}
+	
+	static int num_instances;
+	
+private:
+	double x_;
+	double y_;
+};
+
+int Vector2::num_instances = 0;
+
 static string get_random_string(int num_chars = 15) {
 	string random_string;
 	random_string.resize(num_chars);
@@ -70,7 +411,8 @@ static bool is_string_convertible_to_number(const char * str) {
 	return (luaO_str2d(str, len, &result) != 0);
 }
 
-void log_and_check_types_via_Is_methods(LuaObject & obj, int actual) {
+template <typename T>
+void log_and_check_types_via_Is_methods(T & obj, int actual) {
 	logprintf("... checking type via Is methods:\n");
 	logprintf("....... IsBoolean?: %d\n", (int)obj.IsBoolean());
 	CHECK(obj.IsBoolean() == (actual == LUA_TBOOLEAN));
@@ -116,6 +458,14 @@ int main(int argc, const char * argv[])
 {
 	logprintf("Welcome to LuaPlusLite!\n");
 	srand(0);
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--benchmark") == 0) {
+			run_benchmarks = true;
+		} else if (strcmp(argv[i], "--opcode-pairs") == 0) {
+			report_opcode_pairs();
+			return 0;
+		}
+	}
 	
     TEST("Retrieving C-State") {
         //lua_State * myLuaState_CState = myLuaState.GetCState();
@@ -436,10 +786,39 @@ int main(int argc, const char * argv[])
 		int decoded_integer_from_Stack_method = myLuaState.Stack(1).ToInteger();
 		logprintf("... decoded integer from Stack(1): %d\n", decoded_integer_from_Stack_method);
 		CHECK(decoded_integer_from_Stack_method == random_number_2);
-//		log_and_check_types_via_Is_methods<LuaObject>(myLuaState.Stack(1), LUA_TNUMBER);
+		LuaStackObject stack_object = myLuaState.Stack(1);
+		log_and_check_types_via_Is_methods(stack_object, LUA_TNUMBER);
 		myLuaState.Pop(1);
 	} TEST_END;
 	
+	TEST("Reading lua_CFunction arguments via LuaStackObject") {
+		struct Callback {
+			static int SumAndConcat(lua_State * L) {
+				LuaState * state = LuaState::CastState(L);
+				LuaStackObject a = state->Stack(1);
+				LuaStackObject b = state->Stack(2);
+				LuaStackObject options = state->Stack(3);
+				CHECK(a.GetIndex() == 1);
+				CHECK(options.IsTable() == true);
+				CHECK(strcmp(options["separator"].ToString(), "-") == 0);
+				state->PushNumber(a.ToNumber() + b.ToNumber());
+				state->PushString(options.GetByName("prefix").ToString());
+				return 2;
+			}
+		};
+		myLuaState.PushCFunction(&Callback::SumAndConcat);
+		lua_setglobal(myLuaState_CState, "SumAndConcat");
+		int result = myLuaState.DoString("sum, prefix = SumAndConcat(1, 2, { separator = '-', prefix = 'pre' })");
+		CHECK(result == LUA_OK);
+		CHECK(myLuaState.GetGlobal("sum").ToInteger() == 3);
+		CHECK(strcmp(myLuaState.GetGlobal("prefix").ToString(), "pre") == 0);
+		lua_pushinteger(myLuaState_CState, 42);
+		LuaObject persisted(myLuaState.Stack(-1));
+		myLuaState.Pop(1);
+		CHECK(persisted.ToInteger() == 42);
+		CHECK(myLuaState.GetTop() == 0);
+	} TEST_END;
+	
 	TEST("Retrieving global table") {
 		LuaObject allGlobals = myLuaState.GetGlobals();
 		logprintf("... type: %d\n", allGlobals.Type());
@@ -484,6 +863,1105 @@ int main(int argc, const char * argv[])
 #endif
 	} TEST_END;
 	
+	TEST("Assigning one LuaObject to another, and recycling reference slots") {
+		lua_Integer random_number = rand();
+		LuaObject original;
+		original.AssignInteger(&myLuaState, random_number);
+		LuaObject assigned;
+		assigned = original;
+		CHECK(assigned.Type() == LUA_TNUMBER);
+		CHECK(assigned.ToInteger() == random_number);
+		original.AssignString(&myLuaState, "changed");
+		logprintf("... assigned value after changing the original: %td\n", assigned.ToInteger());
+		CHECK(assigned.ToInteger() == random_number);
+		assigned = LuaObject();
+		CHECK(assigned.IsNone() == true);
+		for (int i = 0; i < 1000; i++) {
+			LuaObject temporary(original);
+			CHECK(strcmp(temporary.ToString(), "changed") == 0);
+		}
+		CHECK(strcmp(original.ToString(), "changed") == 0);
+		CHECK(myLuaState.GetTop() == 0);
+	} TEST_END;
+	
+	TEST("Moving LuaObjects") {
+		lua_Integer random_number = rand();
+		LuaObject original;
+		original.AssignInteger(&myLuaState, random_number);
+		LuaObject moved(std::move(original));
+		CHECK(original.IsNone() == true);
+		CHECK(moved.ToInteger() == random_number);
+		LuaObject move_assigned;
+		move_assigned.AssignString(&myLuaState, "overwritten");
+		move_assigned = std::move(moved);
+		CHECK(moved.IsNone() == true);
+		CHECK(move_assigned.ToInteger() == random_number);
+		LuaObject myTable;
+		myTable.AssignNewTable(&myLuaState);
+		myTable.CreateTable("a").CreateTable("b").SetInteger("c", random_number);
+		CHECK(myTable["a"]["b"]["c"].ToInteger() == random_number);
+		CHECK(std::is_nothrow_move_constructible<LuaObject>::value);
+		CHECK(std::is_nothrow_move_assignable<LuaObject>::value);
+		CHECK(myLuaState.GetTop() == 0);
+	} TEST_END;
+	
+	TEST("Cached type tags follow reassignment") {
+		LuaObject value;
+		CHECK(value.Type() == LUA_TNONE);
+		value.AssignNewTable(&myLuaState);
+		CHECK(value.IsTable() == true);
+		value.AssignString(&myLuaState, "12");
+		CHECK(value.Type() == LUA_TSTRING);
+		log_and_check_types_via_Is_methods(value, LUA_TSTRING);
+		LuaObject copy(value);
+		CHECK(copy.Type() == LUA_TSTRING);
+		value.AssignBoolean(&myLuaState, true);
+		log_and_check_types_via_Is_methods(value, LUA_TBOOLEAN);
+		copy = value;
+		CHECK(copy.IsBoolean() == true);
+		LuaObject moved(std::move(copy));
+		CHECK(moved.IsBoolean() == true);
+		CHECK(copy.Type() == LUA_TNONE);
+		value.Reset();
+		CHECK(value.IsNone() == true);
+		CHECK(myLuaState.GetTop() == 0);
+	} TEST_END;
+	
+	TEST("Calling Lua functions via LuaObject::Call and LuaFunction") {
+		int result = myLuaState.DoString(
+			"function add(a, b) return a + b end\n"
+			"function concat(a, b) return a .. b end\n"
+			"function fail() local failure_message = nil; return failure_message.field end\n"
+			"function record(value) recorded = value end\n");
+		CHECK(result == LUA_OK);
+		LuaObject add = myLuaState.GetGlobal("add");
+		CHECK(add.Call<int>(1, 2) == 3);
+		CHECK(add.Call<lua_Number>(1, 2.5) == 3.5);
+		CHECK(myLuaState.GetGlobal("concat").Call<string>("abc", string("def")) == "abcdef");
+		LuaFunction<int (int, int)> typed_add = add;
+		CHECK(typed_add(40, 2) == 42);
+		LuaFunction<void (const char *)> record = myLuaState.GetGlobal("record");
+		record("recorded value");
+		CHECK(strcmp(myLuaState.GetGlobal("recorded").ToString(), "recorded value") == 0);
+		bool wasExceptionCaught = false;
+		string exceptionMessage;
+		try {
+			myLuaState.GetGlobal("fail").Call<void>();
+		} catch (LuaException & e) {
+			wasExceptionCaught = true;
+			exceptionMessage = e.what();
+		}
+		logprintf("... exception message: \"%s\"\n", exceptionMessage.c_str());
+		CHECK(wasExceptionCaught == true);
+		CHECK(exceptionMessage.find("failure_message") != string::npos);
+		CHECK(myLuaState.GetTop() == 0);
+	} TEST_END;
+	
+	TEST("Registering C++ functions, methods, and lambdas via RegisterDirect") {
+		LuaObject globals = myLuaState.GetGlobals();
+		globals.RegisterDirect("add", &add_integers);
+		string greeting_prefix = "hello, ";
+		globals.RegisterDirect("greet", [greeting_prefix](const string & name) { return greeting_prefix + name; });
+		globals.RegisterDirect("negate", [](bool value) { return ! value; });
+		globals.RegisterDirect("throws", [](int) -> int { throw LuaException("thrown from C++"); });
+		Counter counter;
+		globals.RegisterDirect("increment", counter, &Counter::Increment);
+		globals.RegisterDirect("count", counter, &Counter::GetCount);
+		int result = myLuaState.DoString(
+			"sum = add(40, 2)\n"
+			"greeting = greet('world')\n"
+			"negated = negate(nil)\n"
+			"increment(3)\n"
+			"increment(4)\n"
+			"counted = count()\n");
+		CHECK(result == LUA_OK);
+		CHECK(myLuaState.GetGlobal("sum").ToInteger() == 42);
+		CHECK(strcmp(myLuaState.GetGlobal("greeting").ToString(), "hello, world") == 0);
+		CHECK(myLuaState.GetGlobal("negated").ToBoolean() == true);
+		CHECK(counter.GetCount() == 7);
+		CHECK(myLuaState.GetGlobal("counted").ToInteger() == 7);
+		
+		result = myLuaState.DoString("add(1, {})");
+		CHECK(result != LUA_OK);
+		logprintf("... error from a mismatched argument: %s\n", lua_tostring(myLuaState_CState, -1));
+		CHECK(strstr(lua_tostring(myLuaState_CState, -1), "bad argument #2") != NULL);
+		myLuaState.Pop(1);
+		result = myLuaState.DoString("throws(1)");
+		CHECK(result != LUA_OK);
+		logprintf("... error from a C++ exception: %s\n", lua_tostring(myLuaState_CState, -1));
+		CHECK(strcmp(lua_tostring(myLuaState_CState, -1), "thrown from C++") == 0);
+		myLuaState.Pop(1);
+		CHECK(myLuaState.GetTop() == 0);
+
+		// LuaObject and LuaStackObject arguments are read from the calling
+		// thread, which need not be the main one.
+		LuaState::Options options;
+		options.OpenStandardLibraries();
+		LuaState threadLuaState(options);
+		LuaObject thread_globals = threadLuaState.GetGlobals();
+		thread_globals.RegisterDirect("tname", [](LuaObject value) { return string(value.TypeName()); });
+		thread_globals.RegisterDirect("sname", [](LuaStackObject value) { return string(value.TypeName()); });
+		thread_globals.RegisterDirect("echo", [](LuaObject value) { return value; });
+		thread_globals.RegisterDirect("secho", [](LuaStackObject value) { return value; });
+		thread_globals.RegisterDirect("field", [](LuaStackObject value) { return value.GetByName("x"); });
+		result = threadLuaState.DoString(
+			"assert(tname('x') == 'string' and sname('x') == 'string')\n"
+			"local t = {x = 5}\n"
+			"coroutine.wrap(function()\n"
+			"  assert(tname('x') == 'string' and sname('x') == 'string')\n"
+			"  assert(echo(t) == t and secho(t) == t and field(t) == 5)\n"
+			"  assert(coroutine.wrap(function() return echo('y') .. secho(1) end)() == 'y1')\n"
+			"end)()\n");
+		CHECK(result == LUA_OK);
+		if (result != LUA_OK) {
+			logprintf("... error: %s\n", lua_tostring(threadLuaState.GetCState(), -1));
+		}
+		CHECK(threadLuaState.GetTop() == 0);
+
+		// Without a LuaState, only LuaStackObjects can be made.
+		lua_State * bare = luaL_newstate();
+		LuaPushDirectClosure(bare, [](LuaStackObject value) { return value.IsNumber(); });
+		lua_pushinteger(bare, 1);
+		CHECK(lua_pcall(bare, 1, 1, 0) == LUA_OK && lua_toboolean(bare, -1));
+		lua_pop(bare, 1);
+		LuaPushDirectClosure(bare, [](LuaObject value) { return value.IsNumber(); });
+		lua_pushinteger(bare, 1);
+		CHECK(lua_pcall(bare, 1, 1, 0) != LUA_OK && strcmp(lua_tostring(bare, -1), "lua_State has no LuaState") == 0);
+		lua_close(bare);
+	} TEST_END;
+	
+	TEST("Binding a C++ class via LuaClass") {
+		{
+			LuaState classLuaState;
+			LuaClass<Vector2> vector2(&classLuaState, "Vector2");
+			vector2.Constructor<double, double>()
+				.Method("Length", &Vector2::Length)
+				.Method("Scale", &Vector2::Scale)
+				.Method("GetX", &Vector2::GetX);
+			int result = classLuaState.DoString(
+				"local v = Vector2.new(3, 4)\n"
+				"length = v:Length()\n"
+				"v:Scale(2)\n"
+				"scaled_x = v:GetX()\n"
+				"kept = Vector2.new(1, 0)\n");
+			CHECK(result == LUA_OK);
+			CHECK(classLuaState.GetGlobal("length").ToNumber() == 5.0);
+			CHECK(classLuaState.GetGlobal("scaled_x").ToNumber() == 6.0);
+			Vector2 * kept = LuaClass<Vector2>::ToObject(classLuaState.GetGlobal("kept"));
+			CHECK(kept != NULL && kept->GetX() == 1.0);
+			CHECK(LuaClass<Vector2>::ToObject(classLuaState.GetGlobal("length")) == NULL);
+			LuaObject from_cpp = vector2.New(0.0, 2.0);
+			CHECK(LuaClass<Vector2>::ToObject(from_cpp)->Length() == 2.0);
+			
+			result = classLuaState.DoString("Vector2.Length(42)");
+			CHECK(result != LUA_OK);
+			logprintf("... error from calling a method on a non-instance: %s\n", lua_tostring(classLuaState.GetCState(), -1));
+			CHECK(strstr(lua_tostring(classLuaState.GetCState(), -1), "Vector2 expected") != NULL);
+			classLuaState.Pop(1);
+			
+			// Each state keeps the name it registered the class under.
+			LuaState otherLuaState;
+			LuaClass<Vector2> point(&otherLuaState, "Point");
+			point.Method("Length", &Vector2::Length);
+			CHECK(otherLuaState.DoString("Point.Length(42)") != LUA_OK);
+			CHECK(strstr(lua_tostring(otherLuaState.GetCState(), -1), "Point expected") != NULL);
+			CHECK(classLuaState.DoString("Vector2.Length(42)") != LUA_OK);
+			CHECK(strstr(lua_tostring(classLuaState.GetCState(), -1), "Vector2 expected") != NULL);
+			classLuaState.Pop(1);
+			result = classLuaState.DoString("Vector2.new(1, 'x')");
+			CHECK(result != LUA_OK);
+			classLuaState.Pop(1);
+			
+			// Running out of memory in New throws, rather than panicking.
+			LuaState::Options limited_options;
+			limited_options.track_memory = true;
+			LuaState limitedLuaState(limited_options);
+			LuaClass<Vector2> limited(&limitedLuaState, "Vector2");
+			lua_gc(limitedLuaState.GetCState(), LUA_GCCOLLECT, 0);
+			limitedLuaState.SetMemoryLimit(limitedLuaState.GetMemoryStats().bytes_in_use);
+			bool wasExceptionCaught = false;
+			try {
+				limited.New(1.0, 2.0);
+			} catch (LuaException &) {
+				wasExceptionCaught = true;
+			}
+			limitedLuaState.SetMemoryLimit(0);
+			CHECK(wasExceptionCaught == true);
+			CHECK(limitedLuaState.GetTop() == 0);
+			CHECK(Vector2::num_instances == 3);
+			lua_gc(classLuaState.GetCState(), LUA_GCCOLLECT, 0);
+			CHECK(Vector2::num_instances == 2);
+		}
+		CHECK(Vector2::num_instances == 0);
+	} TEST_END;
+	
+	TEST("Filling tables in bulk via SetArray, SetFields, and AssignNew* methods") {
+		vector<double> samples;
+		for (int i = 1; i <= 100; ++i) {
+			samples.push_back(i * 0.5);
+		}
+		LuaObject array;
+		array.AssignNewArray(&myLuaState, samples);
+		CHECK(array.IsTable());
+		array.Push();
+		CHECK(lua_rawlen(myLuaState_CState, -1) == 100);
+		myLuaState.Pop(1);
+		CHECK(array[1].ToNumber() == 0.5);
+		CHECK(array[100].ToNumber() == 50.0);
+		
+		array.SetArray({"x", "y"}, 101);
+		CHECK(strcmp(array[102].ToString(), "y") == 0);
+		
+		// vector<bool>'s iterators return proxies, rather than bool &s.
+		vector<bool> flags;
+		flags.push_back(true);
+		flags.push_back(false);
+		array.SetArray(flags, 103);
+		CHECK(array[103].IsBoolean() && array[103].GetBoolean() == true);
+		CHECK(array[104].IsBoolean() && array[104].GetBoolean() == false);
+		
+		map<string, int> fields;
+		fields["width"] = 640;
+		fields["height"] = 480;
+		LuaObject table;
+		table.AssignNewFields(&myLuaState, fields);
+		CHECK(table["width"].ToInteger() == 640);
+		CHECK(table["height"].ToInteger() == 480);
+		
+		fields["depth"] = 32;
+		table.SetFields(fields);
+		CHECK(table["depth"].ToInteger() == 32);
+		
+		LuaObject list;
+		list.AssignNewArray(&myLuaState, {true, false});
+		CHECK(list[1].GetBoolean() == true && list[2].GetBoolean() == false);
+		CHECK(myLuaState.GetTop() == 0);
+	} TEST_END;
+	
+	TEST("Reading tables in bulk via ForEach, ToVector, and ToMap") {
+		myLuaState.DoString("samples = {1.5, 2.5, 3.5}; config = {width = 640, height = 480, name = 'main', 7}");
+		LuaObject samples = myLuaState.GetGlobal("samples");
+		vector<double> values = samples.ToVector<double>();
+		CHECK(values.size() == 3 && values[0] == 1.5 && values[2] == 3.5);
+		
+		bool wasExceptionCaught = false;
+		try {
+			myLuaState.GetGlobal("config").ToVector<bool>();
+			myLuaState.GetGlobal("config").ToVector<LuaObject>();
+			vector<string> strings = myLuaState.GetGlobal("config").ToVector<string>();
+			CHECK(strings.size() == 1 && strings[0] == "7");
+		} catch (LuaException &) {
+			wasExceptionCaught = true;
+		}
+		CHECK(wasExceptionCaught == false);
+		try {
+			samples.SetString(2, "not a number");
+			samples.ToVector<double>();
+		} catch (LuaException &) {
+			wasExceptionCaught = true;
+		}
+		CHECK(wasExceptionCaught == true);
+		CHECK(myLuaState.GetTop() == 0);
+		
+		LuaObject config = myLuaState.GetGlobal("config");
+		map<string, int> sizes = config.ToMap<string, int>();
+		CHECK(sizes.size() == 3);
+		CHECK(sizes["width"] == 640 && sizes["height"] == 480 && sizes["1"] == 7);
+		
+		int count = 0;
+		lua_Integer sum = 0;
+		config.ForEach([&] (const LuaStackObject &, const LuaStackObject & value) {
+			++count;
+			if (value.IsInteger()) {
+				sum += value.GetInteger();
+			}
+		});
+		CHECK(count == 4);
+		CHECK(sum == 640 + 480 + 7);
+		CHECK(myLuaState.GetTop() == 0);
+	} TEST_END;
+	
+	TEST("Iterating over a table via LuaTableIterator") {
+		myLuaState.DoString("grid = {{1, 2}, {3, 4, 5}, name = 'grid'}; empty = {}");
+		LuaObject grid = myLuaState.GetGlobal("grid");
+		int count = 0;
+		lua_Integer sum = 0;
+		for (auto row : grid) {
+			++count;
+			if (row.second.IsTable()) {
+				for (auto cell : LuaObject(row.second)) {
+					sum += cell.second.GetInteger();
+				}
+			} else {
+				CHECK(strcmp(row.first.GetString(), "name") == 0);
+			}
+		}
+		CHECK(count == 3);
+		CHECK(sum == 15);
+		CHECK(myLuaState.GetTop() == 0);
+		
+		for (auto entry : grid) {
+			if (entry.first.IsNumber()) {
+				break;
+			}
+		}
+		CHECK(myLuaState.GetTop() == 0);
+		
+		LuaObject empty = myLuaState.GetGlobal("empty");
+		CHECK(empty.begin() == empty.end());
+		CHECK(myLuaState.GetTop() == 0);
+	} TEST_END;
+	
+	TEST("Looking up fields via interned LuaKeys") {
+		LuaKey position(&myLuaState, "position");
+		LuaKey velocity(&myLuaState, "velocity");
+		CHECK(strcmp(position.GetName(), "position") == 0);
+		LuaObject entity;
+		entity.AssignNewTable(&myLuaState);
+		entity.SetNumber(position, 1.5);
+		entity.SetNumber(velocity, -2.0);
+		CHECK(entity.GetByName("position").ToNumber() == 1.5);
+		CHECK(entity[velocity].ToNumber() == -2.0);
+		lua_gc(myLuaState_CState, LUA_GCCOLLECT, 0);
+		CHECK(entity[position].ToNumber() == 1.5);
+		
+#if LuaPlusLite__assertions_throw_exceptions == 1
+		LuaState otherLuaState;
+		LuaKey foreign(&otherLuaState, "position");
+		bool wasExceptionCaught = false;
+		try {
+			entity.GetByObject(foreign);
+		} catch (LuaException &) {
+			wasExceptionCaught = true;
+		}
+		CHECK(wasExceptionCaught == true);
+#endif
+		CHECK(myLuaState.GetTop() == 0);
+	} TEST_END;
+	
+	TEST("Passing length-delimited strings via LuaStringView") {
+		const string binary("line one\0line two", 17);
+		LuaObject message;
+		message.AssignString(&myLuaState, binary);
+		CHECK(message.ToStringView().size() == 17);
+		CHECK(message.ToStringView() == LuaStringView(binary));
+		CHECK(message.ToStringView().ToStdString() == binary);
+		
+		LuaObject record;
+		record.AssignNewTable(&myLuaState);
+		record.SetString("text", binary);
+		record.SetString(1, LuaStringView(binary.data(), 8));
+		record.SetString(LuaKey(&myLuaState, "tail"), binary.data() + 9, 8);
+		CHECK(record["text"].ToStringView() == LuaStringView(binary));
+		CHECK(record[1].ToStringView() == "line one");
+		CHECK(record["tail"].ToStringView() == "line two");
+		
+		size_t total_length = 0;
+		record.GetState()->GetGlobals().RegisterDirect("measure", [&total_length] (LuaStringView text) {
+			total_length += text.size();
+			return text.size();
+		});
+		myLuaState.PushString(binary);
+		lua_setglobal(myLuaState_CState, "binary");
+		CHECK(myLuaState.DoString("measured = measure(binary)") == LUA_OK);
+		CHECK(myLuaState.GetGlobal("measured").ToInteger() == 17);
+		CHECK(total_length == 17);
+		
+		myLuaState.PushString(binary.data(), 4);
+		CHECK(myLuaState.Stack(-1).ToStringView() == "line");
+		myLuaState.Pop(1);
+		CHECK(myLuaState.GetTop() == 0);
+	} TEST_END;
+	
+	TEST("Reading values via non-throwing TryTo* accessors") {
+		myLuaState.DoString("values = {42, '2.5', 'abc', true}");
+		LuaObject values = myLuaState.GetGlobal("values");
+		lua_Integer integer = -1;
+		lua_Number number = -1;
+		const char * str = NULL;
+		void * userdata = NULL;
+		CHECK(values[1].TryToInteger(&integer) == true && integer == 42);
+		CHECK(values[3].TryToNumber(&number) == false && number == -1);
+		CHECK(values[4].TryToNumber(&number) == false && number == -1);
+		CHECK(values[3].TryToString(&str) == true && strcmp(str, "abc") == 0);
+		CHECK(values[4].TryToString(&str) == false);
+		CHECK(values[1].TryToString(&str) == false && strcmp(str, "abc") == 0);
+		CHECK(values[4].TryToUserData(&userdata) == false);
+		CHECK(LuaObject().TryToNumber(&number) == false);
+#if LuaPlusLite__IsString_and_IsNumber_only_match_explicitly == 0
+		CHECK(values[2].TryToNumber(&number) == true && number == 2.5);
+#endif
+		
+		values.SetLightUserData(5, &integer);
+		CHECK(values[5].TryToUserData(&userdata) == true && userdata == &integer);
+		
+		int count = 0;
+		for (auto entry : values) {
+			if (entry.second.TryToNumber(&number)) {
+				++count;
+			}
+		}
+#if LuaPlusLite__IsString_and_IsNumber_only_match_explicitly == 0
+		CHECK(count == 2);
+#else
+		CHECK(count == 1);
+#endif
+		CHECK(LuaStackObject().TryToInteger(&integer) == false);
+		CHECK(myLuaState.GetTop() == 0);
+	} TEST_END;
+	
+	TEST("Creating a LuaState with Options") {
+		int allocation_count = 0;
+		LuaState::Options options;
+		options.allocator = &counting_alloc;
+		options.allocator_ud = &allocation_count;
+		options.OpenLibrary("_G", luaopen_base).OpenLibrary(LUA_STRLIBNAME, luaopen_string);
+		options.stack_size = 200;
+		options.gc_pause = 150;
+		LuaState configuredState(options);
+		lua_State * L = configuredState.GetCState();
+		CHECK(allocation_count > 0);
+		CHECK(L->stack_last - L->top >= 200);
+		CHECK(lua_gc(L, LUA_GCSETPAUSE, 200) == 150);
+		CHECK(configuredState.DoString("result = string.rep('ab', 3); assert(type(result) == 'string')") == LUA_OK);
+		CHECK(strcmp(configuredState.GetGlobal("result").ToString(), "ababab") == 0);
+		CHECK(configuredState.GetGlobal("table").IsNil());
+		CHECK(LuaState::CastState(L) == &configuredState);
+		CHECK(configuredState.GetTop() == 0);
+		
+		LuaState standardState(LuaState::Options().OpenStandardLibraries());
+		CHECK(standardState.GetGlobal("table").IsTable());
+		CHECK(standardState.GetGlobal("math").IsTable());
+		
+		bool wasExceptionCaught = false;
+		try {
+			LuaState::Options failing_options;
+			failing_options.OpenLibrary("failing", [] (lua_State * L) { return luaL_error(L, "cannot open library"); });
+			LuaState failingState(failing_options);
+		} catch (LuaException & e) {
+			wasExceptionCaught = (strstr(e.what(), "cannot open library") != NULL);
+		}
+		CHECK(wasExceptionCaught == true);
+	} TEST_END;
+	
+	TEST("Allocating from a LuaPoolAllocator") {
+		LuaState::Options options;
+		options.use_pool_allocator = true;
+		options.OpenLibrary("_G", luaopen_base);
+		LuaState pooledState(options);
+		const LuaPoolAllocator * pool = pooledState.GetPoolAllocator();
+		CHECK(pool != NULL);
+		CHECK(myLuaState.GetPoolAllocator() == NULL);
+		CHECK(pooledState.DoString(
+			"local parts = {}\n"
+			"for i = 1, 1000 do parts[i] = {index = i, name = 'part' .. i} end\n"
+			"total = 0\n"
+			"for i, part in ipairs(parts) do total = total + part.index end\n") == LUA_OK);
+		CHECK(pooledState.GetGlobal("total").ToInteger() == 500500);
+		size_t small_allocations = 0;
+		size_t blocks_in_use = 0;
+		for (size_t i = 0; i < pool->GetNumClasses(); ++i) {
+			const LuaPoolAllocator::ClassStats & stats = pool->GetClassStats(i);
+			CHECK(stats.block_size == (i + 1) * 16);
+			CHECK(stats.blocks_in_use <= stats.blocks_reserved);
+			small_allocations += stats.allocations;
+			blocks_in_use += stats.blocks_in_use;
+		}
+		logprintf("... %d small allocations, %d blocks in use, %d large allocations, %d bytes reserved\n",
+			(int)small_allocations, (int)blocks_in_use, (int)pool->GetLargeAllocations(), (int)pool->GetBytesReserved());
+		CHECK(small_allocations > 2000);
+		CHECK(pool->GetLargeAllocations() > 0);
+		
+		lua_gc(pooledState.GetCState(), LUA_GCCOLLECT, 0);
+		size_t blocks_in_use_after_collection = 0;
+		for (size_t i = 0; i < pool->GetNumClasses(); ++i) {
+			blocks_in_use_after_collection += pool->GetClassStats(i).blocks_in_use;
+		}
+		CHECK(blocks_in_use_after_collection < blocks_in_use);
+		CHECK(pooledState.GetTop() == 0);
+
+		// A block that can't move to a smaller class is kept, and is still
+		// returned to its own class when freed.
+		LuaPoolAllocator allocator;
+		void * block = allocator.Realloc(NULL, 0, 40);
+		CHECK(block != NULL && allocator.GetClassStats(2).blocks_in_use == 1);
+		allocator.SetChunkLimit(1);
+		CHECK(allocator.Realloc(block, 40, 10) == block);
+		CHECK(allocator.Realloc(block, 10, 12) == block);
+		CHECK(allocator.Realloc(block, 12, 20) == NULL);
+		CHECK(allocator.GetClassStats(0).blocks_in_use == 0 && allocator.GetClassStats(0).blocks_reserved == 0);
+		allocator.Realloc(block, 12, 0);
+		CHECK(allocator.GetClassStats(0).blocks_in_use == 0);
+		CHECK(allocator.GetClassStats(2).blocks_in_use == 0);
+		CHECK(allocator.Realloc(NULL, 0, 40) == block);
+		allocator.Realloc(block, 40, 0);
+		allocator.SetChunkLimit(0);
+		void * small_block = allocator.Realloc(NULL, 0, 10);
+		CHECK(small_block != NULL && allocator.GetClassStats(0).blocks_in_use == 1);
+		allocator.Realloc(small_block, 10, 0);
+		CHECK(allocator.GetBytesReserved() == 2 * 16 * 1024);
+	} TEST_END;
+	
+	TEST("Running a sandbox on a LuaArenaAllocator") {
+		Vector2::num_instances = 0;
+		{
+			LuaState::Options options;
+			options.use_arena_allocator = true;
+			options.OpenLibrary("_G", luaopen_base).OpenLibrary(LUA_STRLIBNAME, luaopen_string);
+			LuaState sandbox(options);
+			CHECK(sandbox.GetPoolAllocator() == NULL);
+			CHECK(sandbox.GetArenaAllocator() != NULL);
+			LuaClass<Vector2> vector2(&sandbox, "Vector2");
+			vector2.Constructor<double, double>();
+			CHECK(sandbox.DoString(
+				"local parts = {}\n"
+				"for i = 1, 5000 do parts[i] = {index = i, name = 'part' .. i} end\n"
+				"big = string.rep('x', 100000)\n"
+				"v1 = Vector2.new(3, 4); v2 = Vector2.new(1, 1)\n"
+				"total = 0\n"
+				"for i, part in ipairs(parts) do total = total + part.index end\n") == LUA_OK);
+			CHECK(sandbox.GetGlobal("total").ToInteger() == 12502500);
+			CHECK(sandbox.GetGlobal("big").ToStringView().size() == 100000);
+			CHECK(sandbox.GetArenaAllocator()->GetBytesReserved() >= 100000);
+			CHECK(Vector2::num_instances == 2);
+			lua_gc(sandbox.GetCState(), LUA_GCCOLLECT, 0);
+			CHECK(sandbox.GetTop() == 0);
+		}
+		CHECK(Vector2::num_instances == 0);
+	} TEST_END;
+	
+	TEST("Tracking and limiting memory per LuaState") {
+		LuaMemoryStats untracked = myLuaState.GetMemoryStats();
+		CHECK(untracked.bytes_in_use > 0);
+		CHECK(untracked.peak_bytes_in_use == 0);
+		
+		LuaState::Options options;
+		options.OpenLibrary("_G", luaopen_base).OpenLibrary(LUA_STRLIBNAME, luaopen_string);
+		options.memory_limit = 256 * 1024;
+		options.use_pool_allocator = true;
+		LuaState tenant(options);
+		LuaMemoryStats stats = tenant.GetMemoryStats();
+		CHECK(stats.limit == 256 * 1024);
+		CHECK(stats.bytes_in_use == (size_t)lua_gc(tenant.GetCState(), LUA_GCCOUNT, 0) * 1024 + (size_t)lua_gc(tenant.GetCState(), LUA_GCCOUNTB, 0));
+		CHECK(stats.allocations_by_tag[LUA_TTABLE] > 0);
+		CHECK(stats.allocations_by_tag[LUA_TSTRING] > 0);
+		CHECK(stats.allocations_by_tag[LUA_TTHREAD] == 1);
+		
+		CHECK(tenant.DoString("hog = {} for i = 1, 1000000 do hog[i] = 'entry ' .. i end") != LUA_OK);
+		logprintf("... error: %s\n", lua_tostring(tenant.GetCState(), -1));
+		tenant.Pop(1);
+		stats = tenant.GetMemoryStats();
+		logprintf("... in use: %d bytes, peak: %d bytes, failed allocations: %d\n",
+			(int)stats.bytes_in_use, (int)stats.peak_bytes_in_use, (int)stats.failed_allocations);
+		CHECK(stats.failed_allocations > 0);
+		CHECK(stats.peak_bytes_in_use <= 256 * 1024);
+		
+		tenant.GetGlobals().SetNil("hog");
+		lua_gc(tenant.GetCState(), LUA_GCCOLLECT, 0);
+		CHECK(tenant.GetMemoryStats().bytes_in_use < 128 * 1024);
+		CHECK(tenant.DoString("small = string.rep('x', 1000)") == LUA_OK);
+		tenant.SetMemoryLimit(0);
+		CHECK(tenant.DoString("big = string.rep('x', 1000000)") == LUA_OK);
+		CHECK(tenant.GetMemoryStats().peak_bytes_in_use > 1000000);
+		CHECK(tenant.GetTop() == 0);
+		
+		// Limits too small to open the libraries make the constructor
+		// throw, whichever allocation fails.
+		int num_failures = 0;
+		for (size_t limit = 512; limit <= 64 * 1024; limit += 512) {
+			LuaState::Options small_options;
+			small_options.OpenStandardLibraries();
+			small_options.memory_limit = limit;
+			try {
+				LuaState small_tenant(small_options);
+				CHECK(small_tenant.GetGlobal("string").IsTable());
+			} catch (LuaException &) {
+				++num_failures;
+			}
+		}
+		CHECK(num_failures > 0);
+	} TEST_END;
+	
+	TEST("Creating LuaStates from a LuaStateSnapshot") {
+		LuaState::Options options;
+		options.OpenStandardLibraries();
+		LuaState prototype(options);
+		CHECK(prototype.DoString(
+			"package.preload.config = function() return {mode = 'fast'} end\n"
+			"local config = require 'config'\n"
+			"local counter = 0\n"
+			"function next_id() counter = counter + 1; return counter end\n"
+			"function peek_id() return counter end\n"
+			"framework = {version = '1.0', handlers = {}, config = config}\n"
+			"framework.self = framework\n"
+			"setmetatable(framework.handlers, {__index = function(t, k) return 'default ' .. k end})\n"
+			"squares = {} for i = 1, 100 do squares[i] = i * i end\n"
+			"next_id()\n") == LUA_OK);
+		LuaStateSnapshot snapshot(prototype);
+		CHECK(prototype.GetTop() == 0);
+		
+		LuaState first(snapshot);
+		LuaState second(snapshot);
+		CHECK(first.GetTop() == 0);
+		CHECK(first.DoString(
+			"assert(framework.version == '1.0')\n"
+			"assert(framework.self == framework)\n"
+			"assert(framework.handlers.missing == 'default missing')\n"
+			"assert(squares[100] == 10000)\n"
+			"assert(require('config') == framework.config)\n"
+			"assert(require('config').mode == 'fast')\n"
+			"assert(next_id() == 2 and next_id() == 3 and peek_id() == 3)\n"
+			"assert(string.format('%d', 7) == '7' and ('abc'):upper() == 'ABC')\n"
+			"assert(io.stdout ~= nil and io.type(io.stdout) == 'file')\n"
+			"framework.version = '2.0'\n") == LUA_OK);
+		if (first.GetTop() > 0) {
+			logprintf("... error: %s\n", first.Stack(-1).GetString());
+			first.SetTop(0);
+		}
+		CHECK(second.DoString("assert(framework.version == '1.0' and peek_id() == 1)") == LUA_OK);
+		CHECK(prototype.DoString("assert(peek_id() == 1)") == LUA_OK);
+		CHECK(strcmp(second.GetGlobal("framework")["config"]["mode"].GetString(), "fast") == 0);
+		CHECK(second.GetTop() == 0);
+		
+		// C closures may have up to 255 upvalues, all pushed at once.
+		lua_State * L = prototype.GetCState();
+		CHECK(lua_checkstack(L, 250) != 0);
+		for (int i = 1; i <= 250; ++i) {
+			lua_pushinteger(L, i);
+		}
+		lua_pushcclosure(L, [] (lua_State * L) { lua_pushvalue(L, lua_upvalueindex(250)); return 1; }, 250);
+		lua_setglobal(L, "last_upvalue");
+		LuaStateSnapshot wide_snapshot(prototype);
+		LuaState wide(wide_snapshot);
+		CHECK(wide.DoString("assert(last_upvalue() == 250)") == LUA_OK);
+		CHECK(wide.GetTop() == 0);
+
+		// Running out of memory while capturing or restoring throws.
+		LuaState::Options limited_options;
+		limited_options.OpenStandardLibraries();
+		limited_options.track_memory = true;
+		LuaState limited(limited_options);
+		CHECK(limited.DoString("parts = {} for i = 1, 2000 do parts[i] = {index = i, name = 'part' .. i} end") == LUA_OK);
+		limited.SetMemoryLimit(limited.GetMemoryStats().bytes_in_use + 1024);
+		bool capture_threw = false;
+		try {
+			LuaStateSnapshot limited_snapshot(limited);
+		} catch (const LuaException & e) {
+			capture_threw = strcmp(e.what(), "not enough memory") == 0;
+		}
+		CHECK(capture_threw);
+		CHECK(limited.GetTop() == 0);
+		limited.SetMemoryLimit(0);
+		LuaStateSnapshot parts_snapshot(limited);
+
+		LuaState target(limited_options);
+		target.SetMemoryLimit(target.GetMemoryStats().bytes_in_use + 1024);
+		bool restore_threw = false;
+		try {
+			parts_snapshot.Restore(target);
+		} catch (const LuaException & e) {
+			restore_threw = strcmp(e.what(), "not enough memory") == 0;
+		}
+		CHECK(restore_threw);
+		CHECK(target.GetTop() == 0);
+		CHECK(lua_gc(target.GetCState(), LUA_GCISRUNNING, 0) != 0);
+		target.SetMemoryLimit(0);
+		CHECK(target.DoString("assert(string.format('%d', 7) == '7')") == LUA_OK);
+		LuaState restored(parts_snapshot);
+		CHECK(restored.DoString("assert(#parts == 2000 and parts[2000].name == 'part2000')") == LUA_OK);
+	} TEST_END;
+	
+	TEST("Reusing LuaStates from a LuaStatePool") {
+		LuaState::Options options;
+		options.OpenStandardLibraries();
+		LuaState prototype(options);
+		CHECK(prototype.DoString("framework = {version = '1.0'}\nfunction handle(n) return n * 2 end\n") == LUA_OK);
+		LuaStateSnapshot snapshot(prototype);
+		LuaStatePool pool(snapshot, 2);
+		CHECK(pool.GetIdleCount() == 0);
+		
+		LuaState * first_state = NULL;
+		{
+			LuaStatePool::Lease lease = pool.Acquire();
+			CHECK(lease.IsValid());
+			first_state = lease.Get();
+			CHECK(lease->DoString(
+				"leaked = {}\n"
+				"handle = nil\n"
+				"string.shout = function(s) return s:upper() end\n"
+				"setmetatable(_G, {__index = function() return 'oops' end})\n"
+				"framework.version = '2.0'\n") == LUA_OK);
+			lease->PushInteger(1);
+		}
+		CHECK(pool.GetIdleCount() == 1);
+		{
+			LuaStatePool::Lease lease = pool.Acquire();
+			CHECK(lease.Get() == first_state);
+			CHECK(lease->GetTop() == 0);
+			CHECK(lease->DoString(
+				"assert(rawget(_G, 'leaked') == nil)\n"
+				"assert(getmetatable(_G) == nil)\n"
+				"assert(handle(21) == 42)\n"
+				"assert(string.shout == nil)\n"
+				"assert(framework.version == '2.0')\n") == LUA_OK);
+			CHECK(lease->GetTop() == 0);
+		}
+		
+		// Bounded capacity.
+		LuaStatePool::Lease a = pool.TryAcquire();
+		LuaStatePool::Lease b = pool.TryAcquire();
+		CHECK(a && b && a.Get() != b.Get());
+		LuaStatePool::Lease c = pool.TryAcquire();
+		CHECK( ! c.IsValid());
+		
+		LuaState * waited_for = NULL;
+		std::thread waiter([&pool, &waited_for] () {
+			LuaStatePool::Lease lease = pool.Acquire();
+			waited_for = lease.Get();
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		LuaState * released = b.Get();
+		b.Release();
+		waiter.join();
+		CHECK(waited_for == released);
+		a.Release();
+		
+		LuaStatePool::Stats stats = pool.GetStats();
+		logprintf("... acquires: %d, hits: %d, created: %d, waits: %d, average reset: %.1f us\n", (int)stats.acquires, (int)stats.hits,
+			(int)stats.states_created, (int)stats.waits, stats.AverageResetSeconds() * 1.0e6);
+		CHECK(stats.acquires == 5);
+		CHECK(stats.states_created == 2);
+		CHECK(stats.hits == 3);
+		CHECK(stats.failed_try_acquires == 1);
+		CHECK(stats.resets == 5);
+		CHECK(stats.states_discarded == 0);
+		CHECK(pool.GetIdleCount() == 2);
+		
+		// Options and an initializer, with a state created up front.
+		LuaStatePool initialized_pool(options, [] (LuaState & state) {
+			state.DoString("ready = true");
+		}, 4, 1);
+		CHECK(initialized_pool.GetStats().states_created == 1);
+		{
+			LuaStatePool::Lease lease = initialized_pool.Acquire();
+			CHECK(lease->GetGlobal("ready").GetBoolean() == true);
+		}
+		CHECK(initialized_pool.GetStats().HitRate() == 1.0);
+		
+		// A lease that outlives its pool closes its state when released.
+		LuaStatePool::Lease outliving;
+		{
+			LuaStatePool short_pool(options, nullptr, 2, 2);
+			outliving = short_pool.Acquire();
+		}
+		CHECK(outliving.IsValid());
+		CHECK(outliving->DoString("x = handle") == LUA_OK);
+		outliving.Release();
+		CHECK( ! outliving.IsValid());
+	} TEST_END;
+	
+	TEST("Setting debug hooks while Lua code runs") {
+		// The VM looks for hooks when a function starts, when a C function
+		// returns and on jumps, rather than before every instruction.
+		myLuaState.PushCFunction(&start_counting_lua_CFunction);
+		lua_setglobal(myLuaState_CState, "start_counting");
+		hook_calls = 0;
+		CHECK(myLuaState.DoString("local n = 0 for i = 1, 100 do n = n + i end") == LUA_OK);
+		CHECK(hook_calls == 0);
+		
+		// Set from a C function called by the script, and removed by the
+		// hook itself after ten instructions.
+		CHECK(myLuaState.DoString("start_counting() local n = 0 for i = 1, 100 do n = n + i end") == LUA_OK);
+		CHECK(hook_calls == 10);
+		CHECK(lua_gethook(myLuaState_CState) == NULL);
+		
+		// Set before the script starts.
+		hook_calls = 0;
+		lua_sethook(myLuaState_CState, counting_hook, LUA_MASKCOUNT, 1);
+		CHECK(myLuaState.DoString("local n = 0 while n < 100 do n = n + 1 end") == LUA_OK);
+		CHECK(hook_calls == 10);
+	} TEST_END;
+	
+	TEST("Looking up fields through the VM's inline caches") {
+		LuaState::Options options;
+		options.OpenStandardLibraries();
+		LuaState state(options);
+		CHECK(state.DoString(
+			"local Point = {}\n"
+			"Point.__index = Point\n"
+			"function Point.new(x, y) return setmetatable({x = x, y = y}, Point) end\n"
+			"function Point:sum() return self.x + self.y end\n"
+			"local Other = setmetatable({}, {__index = function(t, k) return k .. '!' end})\n"
+			"local function get(t) return t.x end\n"
+			"local shapes = {Point.new(1, 2), {x = 5}, {y = 1, x = 7}, Other, {}}\n"
+			"for round = 1, 3 do\n"
+			"  for i, t in ipairs(shapes) do\n"
+			"    local expected = rawget(t, 'x') or (t == Other and 'x!') or nil\n"
+			"    assert(get(t) == expected, 'lookup ' .. i)\n"
+			"  end\n"
+			"end\n"
+			"local p = Point.new(3, 4)\n"
+			"for i = 1, 10 do assert(p:sum() == 7) end\n"
+			"Point.sum = function(self) return self.x * self.y end\n"
+			"assert(p:sum() == 12)\n"
+			"p.x = nil\n"
+			"assert(get(p) == nil)\n"
+			"rawset(Point, 'x', 'inherited')\n"
+			"assert(get(p) == 'inherited')\n"
+			"p.x = 9\n"
+			"for i = 1, 100 do p['k' .. i] = i end\n"	// Rehashes 'p'.
+			"assert(get(p) == 9 and p:sum() == 36)\n"
+			"for i = 1, 100 do p['k' .. i] = nil end\n"
+			"collectgarbage()\n"
+			"assert(get(p) == 9)\n"
+			"x = 'global'\n"
+			"local function getglobal() return x end\n"
+			"assert(getglobal() == 'global')\n"
+			"x = nil\n"
+			"assert(getglobal() == nil)\n"
+			"setmetatable(_G, {__index = function(t, k) return 'missing ' .. k end})\n"
+			"assert(getglobal() == 'missing x')\n"
+			"setmetatable(_G, nil)\n"
+			"local ok = pcall(get, 42)\n"
+			"assert(not ok)\n") == LUA_OK);
+		if (state.GetTop() > 0) {
+			logprintf("... error: %s\n", state.Stack(-1).GetString());
+		}
+	} TEST_END;
+	
+	TEST("Running code that the compiler fuses into superinstructions") {
+		LuaState::Options options;
+		options.OpenStandardLibraries();
+		LuaState state(options);
+		CHECK(state.DoString(
+			"local t = {a = {b = {c = 2}}, n = 1}\n"
+			"local function fused(t, x)\n"
+			"  local v = {}\n"					// NEWTABLE, SETTABLE
+			"  v.sum = x * 3 + t.a.b.c\n"		// GETTABLE, GETTABLE; MUL, ADD; ADD, SETTABLE
+			"  return v.sum\n"
+			"end\n"
+			"assert(fused(t, 4) == 14)\n"
+			"local errors = {\n"
+			"  {function() return t.b.c end, \"field 'b'\"},\n"
+			"  {function() return t.n + t.missing end, \"field 'missing'\"},\n"
+			"  {function() return t:nomethod('x') end, \"method 'nomethod'\"},\n"
+			"}\n"
+			"for _, e in ipairs(errors) do\n"
+			"  local ok, message = pcall(e[1])\n"
+			"  assert(not ok and message:find(e[2], 1, true), message)\n"
+			"end\n"
+			"local yielding = setmetatable({}, {__index = function(_, k) return coroutine.yield(k) end})\n"
+			"local co = coroutine.wrap(function() return yielding.first.second + 1 end)\n"
+			"assert(co() == 'first')\n"
+			"assert(co({second = 41}) == 42)\n"
+			"local lines = {}\n"
+			"debug.sethook(function(_, line) lines[#lines + 1] = line end, 'l')\n"
+			"local v = {}\n"
+			"v.x = t.a.b.c * 2 + 1\n"
+			"debug.sethook()\n"
+			"assert(#lines == 3 and v.x == 5)\n") == LUA_OK);
+		if (state.GetTop() > 0) {
+			logprintf("... error: %s\n", state.Stack(-1).GetString());
+		}
+	} TEST_END;
+
+	TEST("Mixing integral and fractional numbers") {
+		LuaState::Options options;
+		options.OpenStandardLibraries();
+		LuaState state(options);
+		CHECK(state.DoString(
+			"local big = 2^53\n"
+			"assert(big + 1 == big and (big - 1) + 1 == big)\n"
+			"assert(1/(0 * -1) < 0 and 1/(-1 % 1) > 0 and 1/-(0) < 0)\n"
+			"assert(7 % -3 == -2 and -7 % 3 == 2 and 5.5 % 2 == 1.5)\n"
+			"assert(3 == 3.0 and 1 < 1.5 and 2 <= 2.0 and not (0/0 == 0/0))\n"
+			"local t = {}\n"
+			"t[1], t[2.0], t[1.5] = 'a', 'b', 'c'\n"
+			"assert(t[1.0] == 'a' and t[2] == 'b' and t[1.5] == 'c' and #t == 2)\n"
+			"t[3 * 0.5 + 1.5] = 'd'\n"
+			"assert(t[3] == 'd' and next({[4/2] = true}) == 2)\n"
+			"local n = 0\n"
+			"for i = 1, 3.5 do n = n + i end\n"
+			"for i = 3, 1.5, -1 do n = n + i end\n"
+			"for i = 0, 1, 0.25 do n = n + i end\n"
+			"for i = 9007199254740989, 9007199254740991 do n = n + (i - 9007199254740988) end\n"
+			"assert(n == 6 + 5 + 2.5 + 6)\n") == LUA_OK);
+		if (state.GetTop() > 0) {
+			logprintf("... error: %s\n", state.Stack(-1).GetString());
+		}
+	} TEST_END;
+
+	TEST("Passing values between LuaStates in a LuaMessage") {
+		CHECK(myLuaState.DoString(
+			"config = {name = 'main', sizes = {1, 2, 3}, enabled = true}\n"
+			"config.self = config\n"
+			"config.also_sizes = config.sizes\n") == LUA_OK);
+		LuaMessage message;
+		lua_getglobal(myLuaState_CState, "config");
+		message.AddValue(myLuaState_CState, -1);
+		lua_pop(myLuaState_CState, 1);
+		message.AddString("a\0b", 3);
+		message.AddInteger(42);
+		message.AddNil();
+		CHECK(message.GetCount() == 4);
+		
+		// Functions can't be sent, and a failed AddValue leaves the message alone.
+		const size_t size = message.GetData().size();
+		bool wasExceptionCaught = false;
+		myLuaState.DoString("bad = {1, 2, function() end}");
+		lua_getglobal(myLuaState_CState, "bad");
+		try {
+			message.AddValue(myLuaState_CState, -1);
+		} catch (LuaException &) {
+			wasExceptionCaught = true;
+		}
+		lua_pop(myLuaState_CState, 1);
+		CHECK(wasExceptionCaught == true);
+		CHECK(message.GetCount() == 4 && message.GetData().size() == size);
+		CHECK(myLuaState.GetTop() == 0);
+		
+		// Nor can tables nested deeper than LUAPLUSLITE_MESSAGE_MAX_DEPTH.
+		myLuaState.DoString("deep = {} local t = deep for i = 1, 100000 do t[1] = {} t = t[1] end");
+		lua_getglobal(myLuaState_CState, "deep");
+		wasExceptionCaught = false;
+		try {
+			message.AddValue(myLuaState_CState, -1);
+		} catch (LuaException &) {
+			wasExceptionCaught = true;
+		}
+		lua_pop(myLuaState_CState, 1);
+		myLuaState.DoString("deep = nil");
+		CHECK(wasExceptionCaught == true);
+		CHECK(message.GetCount() == 4 && message.GetData().size() == size);
+		CHECK(myLuaState.GetTop() == 0);
+		
+		LuaState other;
+		CHECK(message.Push(other) == 4);
+		lua_setglobal(other.GetCState(), "d");
+		lua_setglobal(other.GetCState(), "c");
+		lua_setglobal(other.GetCState(), "b");
+		lua_setglobal(other.GetCState(), "a");
+		CHECK(other.GetTop() == 0);
+		LuaObject a = other.GetGlobal("a");
+		CHECK(strcmp(a["name"].GetString(), "main") == 0);
+		CHECK(a["sizes"][3].GetInteger() == 3);
+		CHECK(a["enabled"].GetBoolean() == true);
+		CHECK(other.DoString("shared = (a.self == a and a.also_sizes == a.sizes)") == LUA_OK);
+		CHECK(other.GetGlobal("shared").GetBoolean() == true);
+		CHECK(other.GetGlobal("b").ToStringView() == LuaStringView("a\0b", 3));
+		CHECK(other.GetGlobal("c").GetInteger() == 42);
+		CHECK(other.GetGlobal("d").IsNil());
+		
+		// Strings read from C++ point into the message.
+		LuaMessage::Reader reader(message);
+		int count = 0;
+		while (reader.Next()) {
+			if (reader.Type() == LUA_TSTRING) {
+				LuaStringView view = reader.ToStringView();
+				CHECK(view.size() == 3);
+				CHECK(view.data() >= message.GetData().data() && view.data() < message.GetData().data() + message.GetData().size());
+			}
+			++count;
+		}
+		CHECK(count == 4);
+	} TEST_END;
+	
+	TEST("Pushing LuaMessages from several threads") {
+		LuaMessageQueue queue;
+		CHECK(queue.TryPop().get() == NULL);
+		const int kProducers = 4;
+		const int kMessagesPerProducer = 2000;
+		std::vector<std::thread> producers;
+		for (int i = 0; i < kProducers; ++i) {
+			producers.push_back(std::thread([&queue, i] () {
+				for (int j = 0; j < kMessagesPerProducer; ++j) {
+					std::unique_ptr<LuaMessage> message(new LuaMessage);
+					message->AddInteger(i);
+					message->AddInteger(j);
+					queue.Push(std::move(message));
+				}
+			}));
+		}
+		std::vector<int> next_expected(kProducers, 0);
+		int received = 0;
+		bool in_order = true;
+		while (received < kProducers * kMessagesPerProducer) {
+			std::unique_ptr<LuaMessage> message = queue.Pop();
+			LuaMessage::Reader reader(*message);
+			reader.Next();
+			const int producer = (int)reader.ToInteger();
+			reader.Next();
+			in_order = in_order && reader.ToInteger() == next_expected[producer]++;
+			++received;
+		}
+		for (size_t i = 0; i < producers.size(); ++i) {
+			producers[i].join();
+		}
+		CHECK(in_order == true);
+		CHECK(queue.TryPop().get() == NULL);
+		queue.Close();
+		CHECK(queue.Pop().get() == NULL);
+	} TEST_END;
+	
+	TEST("Calling functions on a LuaWorkerPool") {
+		LuaState::Options options;
+		options.OpenStandardLibraries();
+		LuaWorkerPool workers(3, options, [] (LuaState & state) {
+			state.DoString(
+				"calls = 0\n"
+				"function square(n) calls = calls + 1; return n * n, calls end\n"
+				"function fail() error('failed on purpose', 0) end\n"
+				"function unsendable() return 1, print end\n"
+				"setmetatable(_G, {__index = function(_, name) error('failed on purpose', 0) end})\n");
+		});
+		CHECK(workers.GetNumWorkers() == 3);
+		LuaMessageQueue results;
+		const int kJobs = 30;
+		for (int i = 0; i < kJobs; ++i) {
+			std::unique_ptr<LuaMessage> job(new LuaMessage("square"));
+			job->AddInteger(i);
+			job->SetReplyTo(&results);
+			workers.Post(std::move(job));
+		}
+		std::unique_ptr<LuaMessage> bad(new LuaMessage("fail"));
+		bad->SetReplyTo(&results);
+		workers.PostTo(1, std::move(bad));
+		// Looking the function up raises an error, through _G's __index.
+		std::unique_ptr<LuaMessage> missing(new LuaMessage("missing"));
+		missing->SetReplyTo(&results);
+		workers.PostTo(2, std::move(missing));
+		
+		lua_Integer sum = 0;
+		int errors = 0;
+		for (int i = 0; i < kJobs + 2; ++i) {
+			std::unique_ptr<LuaMessage> result = results.Pop();
+			LuaMessage::Reader reader(*result);
+			reader.Next();
+			if (result->IsError()) {
+				CHECK(reader.ToStringView() == LuaStringView("failed on purpose"));
+				++errors;
+			} else {
+				CHECK(result->GetFunctionName() == "square");
+				CHECK(result->GetCount() == 2);
+				sum += reader.ToInteger();
+			}
+		}
+		CHECK(sum == (lua_Integer)(kJobs - 1) * kJobs * (2 * kJobs - 1) / 6);
+		CHECK(errors == 2);
+		CHECK(workers.GetErrorCount() == 2);
+		
+		// Results that can't be sent come back as an error.
+		std::unique_ptr<LuaMessage> unsendable(new LuaMessage("unsendable"));
+		unsendable->SetReplyTo(&results);
+		workers.Post(std::move(unsendable));
+		std::unique_ptr<LuaMessage> result = results.Pop();
+		CHECK(result->IsError() && result->GetCount() == 1);
+		LuaMessage::Reader reader(*result);
+		CHECK(reader.Next() && string(reader.ToStringView().data(), reader.ToStringView().size()).find("can't be sent") != string::npos);
+		CHECK(workers.GetErrorCount() == 3);
+	} TEST_END;
+	
+#if LuaPlusLite__assertions_throw_exceptions == 1
 	TEST("SetInteger exception test (on a non-table)") {
 		LuaObject myNonTable;
 
@@ -512,7 +1990,336 @@ int main(int argc, const char * argv[])
 		CHECK(wasExceptionCaught == true);
         logprintf("... exception message: \"%s\"\n", exceptionMessage.c_str());
 	} TEST_END;
+#endif
     
+	BENCHMARK("Chained lookups via LuaObject::operator[]", 1000000) {
+		LuaObject myTable;
+		myTable.AssignNewTable(&myLuaState);
+		myTable.CreateTable("a").CreateTable("b").SetInteger("c", 123);
+		lua_Integer sum = 0;
+		BENCHMARK_LOOP {
+			sum += myTable["a"]["b"]["c"].ToInteger();
+		}
+		CHECK(sum == (lua_Integer)123 * benchmarkIterations);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Calling a Lua function via manual pushes and lua_pcall", 1000000) {
+		myLuaState.DoString("function add(a, b) return a + b end");
+		LuaObject add = myLuaState.GetGlobal("add");
+		lua_State * L = myLuaState.GetCState();
+		lua_Integer sum = 0;
+		BENCHMARK_LOOP {
+			add.Push();
+			lua_pushinteger(L, iteration);
+			lua_pushinteger(L, 1);
+			lua_pcall(L, 2, 1, 0);
+			sum += lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
+		CHECK(sum > 0);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Calling a Lua function via LuaFunction", 1000000) {
+		myLuaState.DoString("function add(a, b) return a + b end");
+		LuaFunction<lua_Integer (int, int)> add = myLuaState.GetGlobal("add");
+		lua_Integer sum = 0;
+		BENCHMARK_LOOP {
+			sum += add(iteration, 1);
+		}
+		CHECK(sum > 0);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Calling a hand-written lua_CFunction from Lua (10000 calls per iteration)", 500) {
+		myLuaState.PushCFunction(&add_integers_lua_CFunction);
+		lua_setglobal(myLuaState.GetCState(), "add");
+		myLuaState.LoadString("local add, sum = add, 0; for i = 1, 10000 do sum = add(sum, 1) end; return sum");
+		LuaObject chunk(myLuaState.Stack(-1));
+		myLuaState.Pop(1);
+		BENCHMARK_LOOP {
+			CHECK(chunk.Call<int>() == 10000);
+		}
+	} BENCHMARK_END;
+	
+	BENCHMARK("Calling a RegisterDirect-bound function from Lua (10000 calls per iteration)", 500) {
+		myLuaState.GetGlobals().RegisterDirect("add", &add_integers);
+		myLuaState.LoadString("local add, sum = add, 0; for i = 1, 10000 do sum = add(sum, 1) end; return sum");
+		LuaObject chunk(myLuaState.Stack(-1));
+		myLuaState.Pop(1);
+		BENCHMARK_LOOP {
+			CHECK(chunk.Call<int>() == 10000);
+		}
+	} BENCHMARK_END;
+	
+	BENCHMARK("Updating entity fields via C string keys", 1000000) {
+		LuaObject entity;
+		entity.AssignNewTable(&myLuaState);
+		entity.SetNumber("position", 0);
+		entity.SetNumber("velocity", 1);
+		BENCHMARK_LOOP {
+			entity.SetNumber("position", entity["position"].ToNumber() + entity["velocity"].ToNumber());
+		}
+		CHECK(entity["position"].ToNumber() == benchmarkIterations);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Updating entity fields via LuaKeys", 1000000) {
+		LuaKey position(&myLuaState, "position");
+		LuaKey velocity(&myLuaState, "velocity");
+		LuaObject entity;
+		entity.AssignNewTable(&myLuaState);
+		entity.SetNumber(position, 0);
+		entity.SetNumber(velocity, 1);
+		BENCHMARK_LOOP {
+			entity.SetNumber(position, entity[position].ToNumber() + entity[velocity].ToNumber());
+		}
+		CHECK(entity[position].ToNumber() == benchmarkIterations);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Filling a 10000-element array via SetNumber", 200) {
+		LuaObject array;
+		BENCHMARK_LOOP {
+			array.AssignNewTable(&myLuaState);
+			for (int i = 1; i <= 10000; ++i) {
+				array.SetNumber(i, i * 0.5);
+			}
+		}
+		CHECK(array[10000].ToNumber() == 5000.0);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Filling a 10000-element array via AssignNewArray", 200) {
+		vector<double> samples;
+		for (int i = 1; i <= 10000; ++i) {
+			samples.push_back(i * 0.5);
+		}
+		LuaObject array;
+		BENCHMARK_LOOP {
+			array.AssignNewArray(&myLuaState, samples);
+		}
+		CHECK(array[10000].ToNumber() == 5000.0);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Reading a 10000-element array via GetByIndex", 200) {
+		vector<double> samples(10000, 0.5);
+		LuaObject array;
+		array.AssignNewArray(&myLuaState, samples);
+		double sum = 0;
+		BENCHMARK_LOOP {
+			for (int i = 1; i <= 10000; ++i) {
+				sum += array.GetByIndex(i).GetNumber();
+			}
+		}
+		CHECK(sum == 5000.0 * benchmarkIterations);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Reading a 10000-element array via LuaTableIterator", 200) {
+		vector<double> samples(10000, 0.5);
+		LuaObject array;
+		array.AssignNewArray(&myLuaState, samples);
+		double sum = 0;
+		BENCHMARK_LOOP {
+			for (auto entry : array) {
+				sum += entry.second.GetNumber();
+			}
+		}
+		CHECK(sum == 5000.0 * benchmarkIterations);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Reading a 10000-element array via ToVector", 200) {
+		vector<double> samples(10000, 0.5);
+		LuaObject array;
+		array.AssignNewArray(&myLuaState, samples);
+		double sum = 0;
+		BENCHMARK_LOOP {
+			vector<double> values = array.ToVector<double>();
+			for (size_t i = 0; i < values.size(); ++i) {
+				sum += values[i];
+			}
+		}
+		CHECK(sum == 5000.0 * benchmarkIterations);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Reading a 10000-element array via LuaTableIterator and TryToNumber", 200) {
+		vector<double> samples(10000, 0.5);
+		LuaObject array;
+		array.AssignNewArray(&myLuaState, samples);
+		double sum = 0;
+		BENCHMARK_LOOP {
+			for (auto entry : array) {
+				lua_Number value = 0;
+				if (entry.second.TryToNumber(&value)) {
+					sum += value;
+				}
+			}
+		}
+		CHECK(sum == 5000.0 * benchmarkIterations);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Copying 1 KB log lines through Lua via const char * and std::string", 200000) {
+		string line(1024, 'x');
+		LuaObject record;
+		record.AssignNewTable(&myLuaState);
+		size_t total_length = 0;
+		BENCHMARK_LOOP {
+			record.SetString("line", line.c_str());
+			string copy(record["line"].ToString());
+			total_length += copy.size();
+		}
+		CHECK(total_length == (size_t)1024 * benchmarkIterations);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Copying 1 KB log lines through Lua via LuaStringView", 200000) {
+		string line(1024, 'x');
+		LuaObject record;
+		record.AssignNewTable(&myLuaState);
+		size_t total_length = 0;
+		BENCHMARK_LOOP {
+			record.SetString("line", line);
+			total_length += record["line"].ToStringView().size();
+		}
+		CHECK(total_length == (size_t)1024 * benchmarkIterations);
+	} BENCHMARK_END;
+	
+	BENCHMARK("Creating a LuaState and building 20000 small tables, via l_alloc", 20) {
+		size_t bytes_in_use = 0;
+		BENCHMARK_LOOP {
+			LuaState requestState;
+			requestState.DoString("local t = {} for i = 1, 20000 do t[i] = {x = i, name = 'n' .. i} end");
+			bytes_in_use = (size_t)lua_gc(requestState.GetCState(), LUA_GCCOUNT, 0) * 1024;
+		}
+		logprintf("... %d KB in use by Lua (l_alloc's overhead is not visible)\n", (int)(bytes_in_use / 1024));
+	} BENCHMARK_END;
+	
+	BENCHMARK("Creating a LuaState and building 20000 small tables, via LuaPoolAllocator", 20) {
+		LuaState::Options options;
+		options.use_pool_allocator = true;
+		size_t bytes_in_use = 0;
+		size_t bytes_reserved = 0;
+		BENCHMARK_LOOP {
+			LuaState requestState(options);
+			requestState.DoString("local t = {} for i = 1, 20000 do t[i] = {x = i, name = 'n' .. i} end");
+			bytes_in_use = (size_t)lua_gc(requestState.GetCState(), LUA_GCCOUNT, 0) * 1024;
+			bytes_reserved = requestState.GetPoolAllocator()->GetBytesReserved();
+		}
+		logprintf("... %d KB in use by Lua, %d KB reserved by the pool\n", (int)(bytes_in_use / 1024), (int)(bytes_reserved / 1024));
+	} BENCHMARK_END;
+	
+	BENCHMARK("Create/run/destroy cycles for a request script, via l_alloc", 200) {
+		const char * script = "local t = {} for i = 1, 2000 do t[i] = {x = i, name = 'n' .. i} end";
+		BENCHMARK_LOOP {
+			LuaState requestState;
+			requestState.DoString(script);
+		}
+	} BENCHMARK_END;
+	
+	BENCHMARK("Create/run/destroy cycles for a request script, via LuaPoolAllocator", 200) {
+		const char * script = "local t = {} for i = 1, 2000 do t[i] = {x = i, name = 'n' .. i} end";
+		LuaState::Options options;
+		options.use_pool_allocator = true;
+		BENCHMARK_LOOP {
+			LuaState requestState(options);
+			requestState.DoString(script);
+		}
+	} BENCHMARK_END;
+	
+	BENCHMARK("Create/run/destroy cycles for a request script, via LuaArenaAllocator", 200) {
+		const char * script = "local t = {} for i = 1, 2000 do t[i] = {x = i, name = 'n' .. i} end";
+		LuaState::Options options;
+		options.use_arena_allocator = true;
+		BENCHMARK_LOOP {
+			LuaState requestState(options);
+			requestState.DoString(script);
+		}
+	} BENCHMARK_END;
+	
+	BENCHMARK("Create/run/destroy cycles for a request script, via l_alloc and memory tracking", 200) {
+		const char * script = "local t = {} for i = 1, 2000 do t[i] = {x = i, name = 'n' .. i} end";
+		LuaState::Options options;
+		options.memory_limit = 64 * 1024 * 1024;
+		BENCHMARK_LOOP {
+			LuaState requestState(options);
+			requestState.DoString(script);
+		}
+	} BENCHMARK_END;
+	
+	BENCHMARK("Initializing a request state by running framework scripts", 200) {
+		string script = make_framework_script(200);
+		LuaState::Options options;
+		options.OpenStandardLibraries();
+		BENCHMARK_LOOP {
+			LuaState requestState(options);
+			requestState.LoadBuffer(script.data(), script.size(), "=framework");
+			requestState.PCall(0, 0, 0);
+		}
+	} BENCHMARK_END;
+	
+	BENCHMARK("Initializing a request state from a LuaStateSnapshot", 200) {
+		string script = make_framework_script(200);
+		LuaState::Options options;
+		options.OpenStandardLibraries();
+		LuaState prototype(options);
+		prototype.LoadBuffer(script.data(), script.size(), "=framework");
+		prototype.PCall(0, 0, 0);
+		LuaStateSnapshot snapshot(prototype);
+		BENCHMARK_LOOP {
+			LuaState requestState(snapshot);
+		}
+	} BENCHMARK_END;
+	
+	// Each function's bytecode carries its chunk name, which for
+	// luaL_loadstring is the whole script, so this restores more slowly
+	// than the snapshot of the "=framework" chunk above.
+	BENCHMARK("Initializing a request state from a LuaStateSnapshot of a luaL_loadstring script", 200) {
+		string script = make_framework_script(200);
+		LuaState::Options options;
+		options.OpenStandardLibraries();
+		LuaState prototype(options);
+		prototype.DoString(script.c_str());
+		LuaStateSnapshot snapshot(prototype);
+		BENCHMARK_LOOP {
+			LuaState requestState(snapshot);
+		}
+	} BENCHMARK_END;
+	
+	BENCHMARK("Handling a request with a LuaState from a LuaStatePool", 2000) {
+		string script = make_framework_script(200);
+		LuaState::Options options;
+		options.OpenStandardLibraries();
+		LuaState prototype(options);
+		prototype.LoadBuffer(script.data(), script.size(), "=framework");
+		prototype.PCall(0, 0, 0);
+		LuaStateSnapshot snapshot(prototype);
+		LuaStatePool pool(snapshot, 1, 1);
+		BENCHMARK_LOOP {
+			LuaStatePool::Lease lease = pool.Acquire();
+			lease->DoString("request = {id = 1} result = framework.handler1(request.id)");
+		}
+		LuaStatePool::Stats stats = pool.GetStats();
+		logprintf("... hit rate: %.3f, average reset: %.1f us, max reset: %.1f us\n", stats.HitRate(),
+			stats.AverageResetSeconds() * 1.0e6, stats.max_reset_seconds * 1.0e6);
+	} BENCHMARK_END;
+	
+	if (run_benchmarks) {
+		for (size_t i = 0; i < sizeof(interpreter_benchmark_scripts) / sizeof(interpreter_benchmark_scripts[0]); i++) {
+			run_interpreter_benchmark(interpreter_benchmark_scripts[i][0], interpreter_benchmark_scripts[i][1]);
+		}
+	}
+	
+	if (run_benchmarks) {
+		const int jobs = 64;
+		const unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+		double single_worker_seconds = 0;
+		for (unsigned int num_workers = 1; ; num_workers = std::min(num_workers * 2, cores)) {
+			double seconds = run_worker_pool_benchmark(num_workers, jobs);
+			if (num_workers == 1) {
+				single_worker_seconds = seconds;
+			}
+			logprintf("BENCHMARK Running a CPU-bound script on %u LuaWorkerPool threads: %d iterations in %.3f ms (%.1f ns/iteration, %.2fx)\n",
+				num_workers, jobs, seconds * 1000.0, (seconds * 1.0e9) / jobs, single_worker_seconds / seconds);
+			if (num_workers == cores) {
+				break;
+			}
+		}
+	}
+	
     if (fail_count > 0) {
         logprintf("FAIL COUNT: %d\n", fail_count);
     } else {
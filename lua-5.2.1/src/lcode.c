@@ -327,7 +327,7 @@ int luaK_numberK (FuncState *fs, lua_Number r) {
   int n;
   lua_State *L = fs->ls->L;
   TValue o;
-  setnvalue(&o, r);
+  setnumvalue(&o, r);
   if (r == 0 || luai_numisnan(NULL, r)) {  /* handle -0 and NaN */
     /* use raw representation as key to avoid numeric problems */
     setsvalue(L, L->top, luaS_newlstr(L, (char *)&r, sizeof(r)));
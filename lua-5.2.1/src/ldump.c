@@ -12,6 +12,7 @@
 #include "lua.h"
 
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 #include "lundump.h"
 
@@ -73,7 +74,23 @@ static void DumpString(const TString* s, DumpState* D)
  }
 }
 
-#define DumpCode(f,D)	 DumpVector(f->code,f->sizecode,sizeof(Instruction),D)
+/* superinstructions are dumped as the first of their two instructions */
+static void DumpCode(const Proto* f, DumpState* D)
+{
+ Instruction buff[64];
+ int i,j,n=f->sizecode;
+ DumpInt(n,D);
+ for (i=0; i<n; i+=j)
+ {
+  for (j=0; j<n-i && j<(int)(sizeof(buff)/sizeof(buff[0])); j++)
+  {
+   Instruction ins=f->code[i+j];
+   SET_OPCODE(ins,luaP_baseop(GET_OPCODE(ins)));
+   buff[j]=ins;
+  }
+  DumpMem(buff,j,sizeof(Instruction),D);
+ }
+}
 
 static void DumpFunction(const Proto* f, DumpState* D);
 
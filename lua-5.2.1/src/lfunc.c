@@ -116,6 +116,8 @@ Proto *luaF_newproto (lua_State *L) {
   f->code = NULL;
   f->cache = NULL;
   f->sizecode = 0;
+  f->fieldslots = NULL;
+  f->sizefieldslots = 0;
   f->lineinfo = NULL;
   f->sizelineinfo = 0;
   f->upvalues = NULL;
@@ -134,6 +136,7 @@ Proto *luaF_newproto (lua_State *L) {
 
 void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->code, f->sizecode);
+  luaM_freearray(L, f->fieldslots, f->sizefieldslots);
   luaM_freearray(L, f->p, f->sizep);
   luaM_freearray(L, f->k, f->sizek);
   luaM_freearray(L, f->lineinfo, f->sizelineinfo);
@@ -143,6 +146,19 @@ void luaF_freeproto (lua_State *L, Proto *f) {
 }
 
 
+/*
+** Give each instruction of a finished prototype an inline-cache entry
+** (see `gettablecached' in lvm.c).
+*/
+void luaF_initfieldslots (lua_State *L, Proto *f) {
+  int i;
+  luaM_reallocvector(L, f->fieldslots, f->sizefieldslots, f->sizecode, int);
+  f->sizefieldslots = f->sizecode;
+  for (i = 0; i < f->sizefieldslots; i++)
+    f->fieldslots[i] = 0;
+}
+
+
 /*
 ** Look for n-th local variable at line `line' in function `func'.
 ** Returns NULL if not found.
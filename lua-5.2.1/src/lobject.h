@@ -58,6 +58,14 @@
 #define LUA_TLNGSTR	(LUA_TSTRING | (1 << 4))  /* long strings */
 
 
+/*
+** LUA_TNUMBER variants: numbers that are integers may be kept as
+** LUAI_INTNUM (see luaconf.h) instead of lua_Number
+*/
+#define LUA_TNUMFLT	(LUA_TNUMBER | (0 << 4))  /* lua_Number */
+#define LUA_TNUMINT	(LUA_TNUMBER | (1 << 4))  /* LUAI_INTNUM */
+
+
 /* Bit mark for collectable types */
 #define BIT_ISCOLLECTABLE	(1 << 6)
 
@@ -93,7 +101,11 @@ typedef struct GCheader {
 typedef union Value Value;
 
 
+#if defined(LUAI_INTNUM)
+#define numfield	lua_Number n; LUAI_INTNUM i;    /* numbers */
+#else
 #define numfield	lua_Number n;    /* numbers */
+#endif
 
 
 
@@ -131,7 +143,7 @@ typedef struct lua_TValue TValue;
 /* Macros to test type */
 #define checktag(o,t)		(rttype(o) == (t))
 #define checktype(o,t)		(ttypenv(o) == (t))
-#define ttisnumber(o)		checktag((o), LUA_TNUMBER)
+#define ttisnumber(o)		checktype((o), LUA_TNUMBER)
 #define ttisnil(o)		checktag((o), LUA_TNIL)
 #define ttisboolean(o)		checktag((o), LUA_TBOOLEAN)
 #define ttislightuserdata(o)	checktag((o), LUA_TLIGHTUSERDATA)
@@ -148,10 +160,27 @@ typedef struct lua_TValue TValue;
 #define ttisthread(o)		checktag((o), ctb(LUA_TTHREAD))
 #define ttisdeadkey(o)		checktag((o), LUA_TDEADKEY)
 
-#define ttisequal(o1,o2)	(rttype(o1) == rttype(o2))
+#if defined(LUAI_INTNUM)
+#define ttisfltnum(o)		checktag((o), LUA_TNUMFLT)
+#define ttisintnum(o)		checktag((o), LUA_TNUMINT)
+#else
+#define ttisfltnum(o)		ttisnumber(o)
+#define ttisintnum(o)		0
+#endif
+
+/* whether two values have the same type for comparison purposes */
+#define ttisequal(o1,o2)  \
+	(rttype(o1) == rttype(o2) || (ttisnumber(o1) && ttisnumber(o2)))
 
 /* Macros to access values */
+#if defined(LUAI_INTNUM)
+#define nvalue(o)  \
+	check_exp(ttisnumber(o), ttisintnum(o) ? cast_num(val_(o).i) : num_(o))
+#define ivalue(o)	check_exp(ttisintnum(o), val_(o).i)
+#else
 #define nvalue(o)	check_exp(ttisnumber(o), num_(o))
+#endif
+#define fltvalue(o)	check_exp(ttisfltnum(o), num_(o))
 #define gcvalue(o)	check_exp(iscollectable(o), val_(o).gc)
 #define pvalue(o)	check_exp(ttislightuserdata(o), val_(o).p)
 #define rawtsvalue(o)	check_exp(ttisstring(o), &val_(o).gc->ts)
@@ -186,9 +215,29 @@ typedef struct lua_TValue TValue;
 #define settt_(o,t)	((o)->tt_=(t))
 
 #define setnvalue(obj,x) \
-  { TValue *io=(obj); num_(io)=(x); settt_(io, LUA_TNUMBER); }
+  { TValue *io=(obj); num_(io)=(x); settt_(io, LUA_TNUMFLT); }
+
+#define changenvalue(o,x)	check_exp(ttisnumber(o) && !ttisintnum(o), num_(o)=(x))
+
+#if defined(LUAI_INTNUM)
+
+/* 'x' must be an integer in range (see luai_intfits) */
+#define setivalue(obj,x) \
+  { TValue *io=(obj); val_(io).i=(x); settt_(io, LUA_TNUMINT); \
+    lua_assert(luai_intfits(val_(io).i)); }
 
-#define changenvalue(o,x)	check_exp(ttisnumber(o), num_(o)=(x))
+/* set a number, in integer form if it has one */
+#define setnumvalue(obj,x) \
+  { TValue *io_=(obj); lua_Number n_=(x); LUAI_INTNUM i_; \
+    if (luai_numisintnum(n_, i_)) { setivalue(io_, i_); } \
+    else { setnvalue(io_, n_); } }
+
+#else
+
+#define setivalue(obj,x)	setnvalue(obj, cast_num(x))
+#define setnumvalue		setnvalue
+
+#endif
 
 #define setnilvalue(obj) settt_(obj, LUA_TNIL)
 
@@ -476,10 +525,12 @@ typedef struct Proto {
   LocVar *locvars;  /* information about local variables (debug information) */
   Upvaldesc *upvalues;  /* upvalue information */
   union Closure *cache;  /* last created closure with this prototype */
+  int *fieldslots;  /* inline caches for field accesses, one per opcode */
   TString  *source;  /* used for debug information */
   int sizeupvalues;  /* size of 'upvalues' */
   int sizek;  /* size of `k' */
   int sizecode;
+  int sizefieldslots;
   int sizelineinfo;
   int sizep;  /* size of `p' */
   int sizelocvars;
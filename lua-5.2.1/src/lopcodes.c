@@ -55,6 +55,17 @@ LUAI_DDEF const char *const luaP_opnames[NUM_OPCODES+1] = {
   "CLOSURE",
   "VARARG",
   "EXTRAARG",
+  "ADD_SETTABLE",
+  "SETTABLE_FORLOOP",
+  "SUB_CALL",
+  "GETUPVAL_SUB",
+  "GETTABLE_ADD",
+  "LOADK_CALL",
+  "SELF_LOADK",
+  "NEWTABLE_SETTABLE",
+  "MUL_ADD",
+  "SETTABLE_GETTABLE",
+  "GETTABLE_GETTABLE",
   NULL
 };
 
@@ -103,5 +114,58 @@ LUAI_DDEF const lu_byte luaP_opmodes[NUM_OPCODES] = {
  ,opmode(0, 1, OpArgU, OpArgN, iABx)		/* OP_CLOSURE */
  ,opmode(0, 1, OpArgU, OpArgN, iABC)		/* OP_VARARG */
  ,opmode(0, 0, OpArgU, OpArgU, iAx)		/* OP_EXTRAARG */
+/* superinstructions have the modes of their first opcode */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_ADD_SETTABLE */
+ ,opmode(0, 0, OpArgK, OpArgK, iABC)		/* OP_SETTABLE_FORLOOP */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_SUB_CALL */
+ ,opmode(0, 1, OpArgU, OpArgN, iABC)		/* OP_GETUPVAL_SUB */
+ ,opmode(0, 1, OpArgR, OpArgK, iABC)		/* OP_GETTABLE_ADD */
+ ,opmode(0, 1, OpArgK, OpArgN, iABx)		/* OP_LOADK_CALL */
+ ,opmode(0, 1, OpArgR, OpArgK, iABC)		/* OP_SELF_LOADK */
+ ,opmode(0, 1, OpArgU, OpArgU, iABC)		/* OP_NEWTABLE_SETTABLE */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_MUL_ADD */
+ ,opmode(0, 0, OpArgK, OpArgK, iABC)		/* OP_SETTABLE_GETTABLE */
+ ,opmode(0, 1, OpArgR, OpArgK, iABC)		/* OP_GETTABLE_GETTABLE */
 };
 
+
+/* ORDER OP (superinstructions) */
+
+LUAI_DDEF const lu_byte luaP_fusedops[NUM_FUSEDOPS][2] = {
+  {OP_ADD, OP_SETTABLE},
+  {OP_SETTABLE, OP_FORLOOP},
+  {OP_SUB, OP_CALL},
+  {OP_GETUPVAL, OP_SUB},
+  {OP_GETTABLE, OP_ADD},
+  {OP_LOADK, OP_CALL},
+  {OP_SELF, OP_LOADK},
+  {OP_NEWTABLE, OP_SETTABLE},
+  {OP_MUL, OP_ADD},
+  {OP_SETTABLE, OP_GETTABLE},
+  {OP_GETTABLE, OP_GETTABLE}
+};
+
+
+/*
+** Replace each instruction that is followed by one it can be fused with
+** by the corresponding superinstruction.  The pairs come from counting
+** adjacent opcodes in typical scripts; instructions that may jump or
+** change frames (tests, calls, returns, loops) are never the first half.
+** Also run on loaded chunks, so opcodes are range-checked first.
+*/
+void luaP_fuse (Instruction *code, int n) {
+  int pc, j;
+  for (pc = 0; pc + 1 < n; pc++) {
+    OpCode first = GET_OPCODE(code[pc]);
+    OpCode second = GET_OPCODE(code[pc + 1]);
+    if (second >= NUM_OPCODES) continue;
+    second = luaP_baseop(second);
+    for (j = 0; j < NUM_FUSEDOPS; j++) {
+      if (luaP_fusedops[j][0] == first && luaP_fusedops[j][1] == second) {
+        SET_OPCODE(code[pc], OP_FIRSTFUSED + j);
+        break;
+      }
+    }
+  }
+}
+
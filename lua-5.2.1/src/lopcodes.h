@@ -221,11 +221,27 @@ OP_CLOSURE,/*	A Bx	R(A) := closure(KPROTO[Bx])			*/
 
 OP_VARARG,/*	A B	R(A), R(A+1), ..., R(A+B-2) = vararg		*/
 
-OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
+OP_EXTRAARG,/*	Ax	extra (larger) argument for previous opcode	*/
+
+/* superinstructions (see note) */
+OP_ADD_SETTABLE,/*	ADD, then the SETTABLE that follows it		*/
+OP_SETTABLE_FORLOOP,/*	SETTABLE, then the FORLOOP that follows it	*/
+OP_SUB_CALL,/*	SUB, then the CALL that follows it			*/
+OP_GETUPVAL_SUB,/*	GETUPVAL, then the SUB that follows it		*/
+OP_GETTABLE_ADD,/*	GETTABLE, then the ADD that follows it		*/
+OP_LOADK_CALL,/*	LOADK, then the CALL that follows it		*/
+OP_SELF_LOADK,/*	SELF, then the LOADK that follows it		*/
+OP_NEWTABLE_SETTABLE,/*	NEWTABLE, then the SETTABLE that follows it	*/
+OP_MUL_ADD,/*	MUL, then the ADD that follows it			*/
+OP_SETTABLE_GETTABLE,/*	SETTABLE, then the GETTABLE that follows it	*/
+OP_GETTABLE_GETTABLE/*	GETTABLE, then the GETTABLE that follows it	*/
 } OpCode;
 
 
-#define NUM_OPCODES	(cast(int, OP_EXTRAARG) + 1)
+#define NUM_OPCODES	(cast(int, OP_GETTABLE_GETTABLE) + 1)
+
+#define OP_FIRSTFUSED	OP_ADD_SETTABLE
+#define NUM_FUSEDOPS	(NUM_OPCODES - cast(int, OP_FIRSTFUSED))
 
 
 
@@ -250,6 +266,15 @@ OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
 
   (*) All `skips' (pc++) assume that next instruction is a jump.
 
+  (*) A superinstruction takes the place of the first of two adjacent
+  instructions, keeping its arguments, and runs it and then the second
+  one without dispatching in between; the second instruction is left
+  as it was, so jumps to it still work.  Opcodes are only fused by
+  'luaP_fuse' after a function is compiled or loaded, and are dumped
+  as their first instruction, so precompiled chunks only ever hold
+  standard opcodes; anything that looks at an instruction's meaning
+  should use 'luaP_baseop'.
+
 ===========================================================================*/
 
 
@@ -280,6 +305,15 @@ LUAI_DDEC const lu_byte luaP_opmodes[NUM_OPCODES];
 
 LUAI_DDEC const char *const luaP_opnames[NUM_OPCODES+1];  /* opcode names */
 
+/* the two opcodes each superinstruction runs */
+LUAI_DDEC const lu_byte luaP_fusedops[NUM_FUSEDOPS][2];
+
+/* the opcode whose work an instruction does first */
+#define luaP_baseop(o)	((o) >= OP_FIRSTFUSED ? \
+	cast(OpCode, luaP_fusedops[(o) - OP_FIRSTFUSED][0]) : (o))
+
+LUAI_FUNC void luaP_fuse (Instruction *code, int n);
+
 
 /* number of list items to accumulate before a SETLIST instruction */
 #define LFIELDS_PER_FLUSH	50
@@ -97,6 +97,7 @@ static Node *hashnum (const Table *t, lua_Number n) {
 static Node *mainposition (const Table *t, const TValue *key) {
   switch (ttype(key)) {
     case LUA_TNUMBER:
+    case LUA_TNUMINT:
       return hashnum(t, nvalue(key));
     case LUA_TLNGSTR: {
       TString *s = rawtsvalue(key);
@@ -125,6 +126,12 @@ static Node *mainposition (const Table *t, const TValue *key) {
 ** the array part of the table, -1 otherwise.
 */
 static int arrayindex (const TValue *key) {
+#if defined(LUAI_INTNUM)
+  if (ttisintnum(key)) {
+    LUAI_INTNUM k = ivalue(key);
+    return (k == cast_int(k)) ? cast_int(k) : -1;
+  }
+#endif
   if (ttisnumber(key)) {
     lua_Number n = nvalue(key);
     int k;
@@ -170,7 +177,7 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
   int i = findindex(L, t, key);  /* find original element */
   for (i++; i < t->sizearray; i++) {  /* try first array part */
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
-      setnvalue(key, cast_num(i+1));
+      setivalue(key, i+1);
       setobj2s(L, key+1, &t->array[i]);
       return 1;
     }
@@ -482,6 +489,15 @@ const TValue *luaH_get (Table *t, const TValue *key) {
   switch (ttype(key)) {
     case LUA_TNIL: return luaO_nilobject;
     case LUA_TSHRSTR: return luaH_getstr(t, rawtsvalue(key));
+#if defined(LUAI_INTNUM)
+    case LUA_TNUMINT: {
+      LUAI_INTNUM k = ivalue(key);
+      if (k == cast_int(k))  /* fits in an int? */
+        return luaH_getint(t, cast_int(k));  /* no conversion needed */
+      /* else go through */
+    }
+#endif
+    /* FALLTHROUGH */
     case LUA_TNUMBER: {
       int k;
       lua_Number n = nvalue(key);
@@ -522,7 +538,7 @@ void luaH_setint (lua_State *L, Table *t, int key, TValue *value) {
     cell = cast(TValue *, p);
   else {
     TValue k;
-    setnvalue(&k, cast_num(key));
+    setivalue(&k, key);
     cell = luaH_newkey(L, t, &k);
   }
   setobj2t(L, cell, value);
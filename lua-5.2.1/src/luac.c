@@ -260,6 +260,7 @@ static void PrintConstant(const Proto* f, int i)
 	printf(bvalue(o) ? "true" : "false");
 	break;
   case LUA_TNUMBER:
+  case LUA_TNUMINT:
 	printf(LUA_NUMBER_FMT,nvalue(o));
 	break;
   case LUA_TSTRING:
@@ -311,7 +312,7 @@ static void PrintCode(const Proto* f)
     printf("%d",MYK(ax));
     break;
   }
-  switch (o)
+  switch (luaP_baseop(o))
   {
    case OP_LOADK:
     printf("\t; "); PrintConstant(f,bx);
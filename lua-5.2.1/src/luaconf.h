@@ -528,6 +528,51 @@
 
 #endif							/* } */
 
+
+/*
+@@ LUAI_INTNUM is the integer type in which the core keeps numbers that
+** are integers (constants, loop counters, lengths, array indices...),
+** so that the VM can add, compare and index with them without doing
+** float arithmetic or conversions. It is only a representation: both
+** forms denote the same numbers, and Lua code cannot tell them apart.
+@@ LUAI_MAXINTNUM bounds the integers kept in that form; all of them
+** must be exact as lua_Numbers.
+** CHANGE them if your integer type is not adequate; the trick cannot
+** be used with LUA_NANTRICK, which leaves no room for another field.
+*/
+#if defined(LUA_CORE) && defined(LUA_NUMBER_DOUBLE) && \
+    !defined(LUA_NANTRICK) && !defined(LUA_ANSI) && defined(LLONG_MAX) /* { */
+
+#define LUAI_INTNUM	long long
+#define LUAI_MAXINTNUM	9007199254740992LL	/* 2^53 */
+
+/*
+@@ luai_numisintnum stores 'n' in 'i' and is true if 'n' can be kept as
+** a LUAI_INTNUM (an integer in range, other than -0).
+@@ The luai_int* macros are the operations over integers: they store
+** 'a op b' in 'r' and are true if that is what the luai_num* operation
+** would give, exactly, and it is in range. Otherwise the lua_Number
+** operation must be used.
+*/
+#define luai_numisintnum(n,i) \
+	((n) >= -LUAI_MAXINTNUM && (n) <= LUAI_MAXINTNUM && \
+	 ((i) = (LUAI_INTNUM)(n), (lua_Number)(i) == (n)) && \
+	 ((i) != 0 || 1/(n) > 0))
+
+#define luai_intfits(r)	((r) >= -LUAI_MAXINTNUM && (r) <= LUAI_MAXINTNUM)
+#define luai_intadd(a,b,r)	((r) = (a) + (b), luai_intfits(r))
+#define luai_intsub(a,b,r)	((r) = (a) - (b), luai_intfits(r))
+/* factors under 2^26 cannot leave the range; 0 times a negative is -0 */
+#define luai_intsmall(a)	((a) > -67108864 && (a) < 67108864)
+#define luai_intmul(a,b,r)	(luai_intsmall(a) && luai_intsmall(b) && \
+	((r) = (a) * (b), (r) != 0 || ((a) >= 0 && (b) >= 0)))
+/* luai_nummod is exact for such factors; '%' must be floored like it */
+#define luai_intmod(a,b,r)	(luai_intsmall(a) && luai_intsmall(b) && \
+	(b) != 0 && ((r) = (a) % (b), \
+	((r) != 0 && ((r) ^ (b)) < 0) ? ((r) += (b)) : 0, 1))
+
+#endif							/* } */
+
 /* }================================================================== */
 
 
@@ -16,6 +16,7 @@
 #include "lfunc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstring.h"
 #include "lundump.h"
 #include "lzio.h"
@@ -89,6 +90,8 @@ static void LoadCode(LoadState* S, Proto* f)
  f->code=luaM_newvector(S->L,n,Instruction);
  f->sizecode=n;
  LoadVector(S,f->code,n,sizeof(Instruction));
+ luaP_fuse(f->code,n);
+ luaF_initfieldslots(S->L,f);
 }
 
 static void LoadFunction(LoadState* S, Proto* f);
@@ -113,7 +116,7 @@ static void LoadConstants(LoadState* S, Proto* f)
 	setbvalue(o,LoadChar(S));
 	break;
    case LUA_TNUMBER:
-	setnvalue(o,LoadNumber(S));
+	setnumvalue(o,LoadNumber(S));
 	break;
    case LUA_TSTRING:
 	setsvalue2n(S->L,o,LoadString(S));
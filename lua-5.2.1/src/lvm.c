@@ -32,6 +32,29 @@
 #define MAXTAGLOOP	100
 
 
+/*
+** Fast paths for numbers kept as integers (see LUAI_INTNUM): when both
+** operands are integers, compare them (storing the result in `res') or
+** find the array slot `t[k]' directly.  Either fails, leaving the work
+** to the general code, when its operands don't fit.
+*/
+#if defined(LUAI_INTNUM)
+
+#define intcompare(op,a,b,res)	(ttisintnum(a) && ttisintnum(b) && \
+	((res) = (ivalue(a) op ivalue(b)), 1))
+
+#define arrayslot(t,k)	((ttistable(t) && ttisintnum(k) && \
+	ivalue(k) >= 1 && ivalue(k) <= hvalue(t)->sizearray) ? \
+	&hvalue(t)->array[ivalue(k) - 1] : NULL)
+
+#else
+
+#define intcompare(op,a,b,res)	0
+#define arrayslot(t,k)	NULL
+
+#endif
+
+
 const TValue *luaV_tonumber (const TValue *obj, TValue *n) {
   lua_Number num;
   if (ttisnumber(obj)) return obj;
@@ -134,6 +157,66 @@ void luaV_gettable (lua_State *L, const TValue *t, TValue *key, StkId val) {
 }
 
 
+/*
+** Inline caches for field accesses.  A GETTABUP, GETTABLE or SELF
+** instruction with a constant short-string key keeps, in its entry of
+** `Proto.fieldslots', the node slot where it last found that key.
+** Tables built the same way hold the same keys in the same slots, so
+** the next lookup usually just checks that the slot still holds the key
+** (a pointer compare, as short strings are interned) and loads the
+** value.  A slot beyond the end of the table, holding another key or a
+** removed field (as after a rehash) fails the check, and an ordinary
+** search then updates the cache.
+*/
+#define cachedslot(h,s,key) \
+  (cast(unsigned int, s) < cast(unsigned int, sizenode(h)) && \
+   ttisshrstring(gkey(gnode(h, s))) && \
+   rawtsvalue(gkey(gnode(h, s))) == (key) && !ttisnil(gval(gnode(h, s))))
+
+
+/*
+** luaV_gettable for a short-string `key', trying the cached `*slot' in
+** each table it searches (following __index tables, so that a method
+** found in a class table is cached too) and updating it on a miss
+*/
+static void gettablecached (lua_State *L, const TValue *t, TValue *key,
+                            StkId val, int *slot) {
+  TString *ks = rawtsvalue(key);
+  int loop;
+  for (loop = 0; loop < MAXTAGLOOP; loop++) {
+    const TValue *tm;
+    if (ttistable(t)) {  /* `t' is a table? */
+      Table *h = hvalue(t);
+      const TValue *res;
+      if (cachedslot(h, *slot, ks)) {
+        setobj2s(L, val, gval(gnode(h, *slot)));
+        return;
+      }
+      res = luaH_getstr(h, ks);  /* do a primitive get */
+      if (!ttisnil(res)) {
+        /* a string key's value is the first field of its node */
+        *slot = cast_int(cast(const Node *, res) - gnode(h, 0));
+        setobj2s(L, val, res);
+        return;
+      }
+      if ((tm = fasttm(L, h->metatable, TM_INDEX)) == NULL) {  /* no TM? */
+        setnilvalue(val);
+        return;
+      }
+      /* else will try the tag method */
+    }
+    else if (ttisnil(tm = luaT_gettmbyobj(L, t, TM_INDEX)))
+      luaG_typeerror(L, t, "index");
+    if (ttisfunction(tm)) {
+      callTM(L, tm, t, key, val, 1);
+      return;
+    }
+    t = tm;  /* else repeat with 'tm' */
+  }
+  luaG_runerror(L, "loop in gettable");
+}
+
+
 void luaV_settable (lua_State *L, const TValue *t, TValue *key, StkId val) {
   int loop;
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
@@ -231,7 +314,9 @@ static int l_strcmp (const TString *ls, const TString *rs) {
 
 int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
   int res;
-  if (ttisnumber(l) && ttisnumber(r))
+  if (intcompare(<, l, r, res))
+    return res;
+  else if (ttisnumber(l) && ttisnumber(r))
     return luai_numlt(L, nvalue(l), nvalue(r));
   else if (ttisstring(l) && ttisstring(r))
     return l_strcmp(rawtsvalue(l), rawtsvalue(r)) < 0;
@@ -243,7 +328,9 @@ int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
 
 int luaV_lessequal (lua_State *L, const TValue *l, const TValue *r) {
   int res;
-  if (ttisnumber(l) && ttisnumber(r))
+  if (intcompare(<=, l, r, res))
+    return res;
+  else if (ttisnumber(l) && ttisnumber(r))
     return luai_numle(L, nvalue(l), nvalue(r));
   else if (ttisstring(l) && ttisstring(r))
     return l_strcmp(rawtsvalue(l), rawtsvalue(r)) <= 0;
@@ -263,7 +350,8 @@ int luaV_equalobj_ (lua_State *L, const TValue *t1, const TValue *t2) {
   lua_assert(ttisequal(t1, t2));
   switch (ttype(t1)) {
     case LUA_TNIL: return 1;
-    case LUA_TNUMBER: return luai_numeq(nvalue(t1), nvalue(t2));
+    case LUA_TNUMBER: case LUA_TNUMINT:  /* 't2' may have either form */
+      return luai_numeq(nvalue(t1), nvalue(t2));
     case LUA_TBOOLEAN: return bvalue(t1) == bvalue(t2);  /* true must be 1 !! */
     case LUA_TLIGHTUSERDATA: return pvalue(t1) == pvalue(t2);
     case LUA_TLCF: return fvalue(t1) == fvalue(t2);
@@ -340,11 +428,11 @@ void luaV_objlen (lua_State *L, StkId ra, const TValue *rb) {
       Table *h = hvalue(rb);
       tm = fasttm(L, h->metatable, TM_LEN);
       if (tm) break;  /* metamethod? break switch to call it */
-      setnvalue(ra, cast_num(luaH_getn(h)));  /* else primitive len */
+      setivalue(ra, luaH_getn(h));  /* else primitive len */
       return;
     }
     case LUA_TSTRING: {
-      setnvalue(ra, cast_num(tsvalue(rb)->len));
+      setivalue(ra, tsvalue(rb)->len);
       return;
     }
     default: {  /* try metamethod */
@@ -418,6 +506,40 @@ static void pushclosure (lua_State *L, Proto *p, UpVal **encup, StkId base,
 }
 
 
+/*
+** Prepare a numeric for loop to count with integers when its initial
+** value and step are integers.  The limit is rounded towards them
+** (down for positive steps, up otherwise), which doesn't change the
+** iterations.  Loops whose index could step beyond the range of
+** integers (where lua_Numbers would round it) use lua_Numbers instead.
+*/
+static int forprepint (StkId ra) {
+#if defined(LUAI_INTNUM)
+  LUAI_INTNUM step, limit, init, last;
+  if (!ttisintnum(ra) || !ttisintnum(ra+2))
+    return 0;
+  step = ivalue(ra+2);
+  if (ttisintnum(ra+1))
+    limit = ivalue(ra+1);
+  else {
+    lua_Number l = nvalue(ra+1);
+    l = (0 < step) ? floor(l) : -floor(-l);
+    if (!luai_numisintnum(l, limit))
+      return 0;
+  }
+  if (!luai_intsub(ivalue(ra), step, init) ||
+      !luai_intadd(limit, step, last))
+    return 0;
+  setivalue(ra, init);
+  setivalue(ra+1, limit);
+  return 1;
+#else
+  UNUSED(ra);
+  return 0;
+#endif
+}
+
+
 /*
 ** finish execution of an opcode interrupted by an yield
 */
@@ -425,7 +547,7 @@ void luaV_finishOp (lua_State *L) {
   CallInfo *ci = L->ci;
   StkId base = ci->u.l.base;
   Instruction inst = *(ci->u.l.savedpc - 1);  /* interrupted instruction */
-  OpCode op = GET_OPCODE(inst);
+  OpCode op = luaP_baseop(GET_OPCODE(inst));
   switch (op) {  /* finish its execution */
     case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
     case OP_MOD: case OP_POW: case OP_UNM: case OP_LEN:
@@ -499,11 +621,12 @@ void luaV_finishOp (lua_State *L) {
   (k + (GETARG_Bx(i) != 0 ? GETARG_Bx(i) - 1 : GETARG_Ax(*ci->u.l.savedpc++)))
 
 
-/* execute a jump instruction */
+/* execute a jump instruction (which may close a loop, so look for new hooks) */
 #define dojump(ci,i,e) \
   { int a = GETARG_A(i); \
     if (a > 0) luaF_close(L, ci->u.l.base + a - 1); \
-    ci->u.l.savedpc += GETARG_sBx(i) + e; }
+    ci->u.l.savedpc += GETARG_sBx(i) + e; \
+    vmupdatehooks(); }
 
 /* for test instructions, execute the jump instruction that follows it */
 #define donextjump(ci)	{ i = *ci->u.l.savedpc; dojump(ci, i, 1); }
@@ -518,49 +641,247 @@ void luaV_finishOp (lua_State *L) {
            luai_threadyield(L); )
 
 
+/* R(A) := t[RK(C)], through the instruction's inline cache if RK(C) is
+   a constant short string, or straight from the array part */
+#define gettablefield(t,rc) { \
+  const TValue *t_ = (t); \
+  TValue *rc_ = (rc); \
+  const TValue *aslot_; \
+  if (ISK(GETARG_C(i)) && ttisshrstring(rc_)) { \
+    int *slot_ = &cl->p->fieldslots[pcRel(ci->u.l.savedpc, cl->p)]; \
+    if (ttistable(t_) && cachedslot(hvalue(t_), *slot_, rawtsvalue(rc_))) { \
+      setobj2s(L, ra, gval(gnode(hvalue(t_), *slot_))); \
+    } \
+    else Protect(gettablecached(L, t_, rc_, ra, slot_)); \
+  } \
+  else if ((aslot_ = arrayslot(t_, rc_)) != NULL && !ttisnil(aslot_)) { \
+    setobj2s(L, ra, aslot_); \
+  } \
+  else Protect(luaV_gettable(L, t_, rc_, ra)); }
+
+/* R(A)[RK(B)] := RK(C), storing into the array part directly if the
+   slot is in use (an empty one may need `__newindex') */
+#define settablefield(t,rb,rc) { \
+  TValue *t_ = (t); \
+  TValue *rb_ = (rb); \
+  TValue *rc_ = (rc); \
+  TValue *aslot_ = arrayslot(t_, rb_); \
+  if (aslot_ != NULL && !ttisnil(aslot_)) { \
+    setobj2t(L, aslot_, rc_); \
+    luaC_barrierback(L, obj2gco(hvalue(t_)), rc_); \
+  } \
+  else Protect(luaV_settable(L, t_, rb_, rc_)); }
+
+
 #define arith_op(op,tm) { \
         TValue *rb = RKB(i); \
         TValue *rc = RKC(i); \
-        if (ttisnumber(rb) && ttisnumber(rc)) { \
+        if (ttisfltnum(rb) && ttisfltnum(rc)) { \
+          lua_Number nb = fltvalue(rb), nc = fltvalue(rc); \
+          setnvalue(ra, op(L, nb, nc)); \
+        } \
+        else if (ttisnumber(rb) && ttisnumber(rc)) { \
+          lua_Number nb = nvalue(rb), nc = nvalue(rc); \
+          setnvalue(ra, op(L, nb, nc)); \
+        } \
+        else { Protect(luaV_arith(L, ra, rb, rc, tm)); } }
+
+#if defined(LUAI_INTNUM)
+/* like arith_op, but first trying integer operation `iop' */
+#define intarith_op(op,iop,tm) { \
+        TValue *rb = RKB(i); \
+        TValue *rc = RKC(i); \
+        LUAI_INTNUM ir; \
+        if (ttisfltnum(rb) && ttisfltnum(rc)) { \
+          lua_Number nb = fltvalue(rb), nc = fltvalue(rc); \
+          setnvalue(ra, op(L, nb, nc)); \
+        } \
+        else if (ttisintnum(rb) && ttisintnum(rc) && \
+                 iop(ivalue(rb), ivalue(rc), ir)) { \
+          setivalue(ra, ir); \
+        } \
+        else if (ttisnumber(rb) && ttisnumber(rc)) { \
           lua_Number nb = nvalue(rb), nc = nvalue(rc); \
           setnvalue(ra, op(L, nb, nc)); \
         } \
         else { Protect(luaV_arith(L, ra, rb, rc, tm)); } }
+#else
+#define intarith_op(op,iop,tm)	arith_op(op,tm)
+#endif
+
+
+/*
+** Bodies of the opcodes that superinstructions begin with, shared by
+** their own cases and the fused ones.
+*/
+#define op_loadk()	{ \
+        TValue *rb = k + GETARG_Bx(i); \
+        setobj2s(L, ra, rb); }
 
+#define op_getupval()	{ \
+        int b = GETARG_B(i); \
+        setobj2s(L, ra, cl->upvals[b]->v); }
+
+#define op_gettable()	gettablefield(RB(i), RKC(i))
+
+#define op_settable()	settablefield(ra, RKB(i), RKC(i))
+
+#define op_newtable()	{ \
+        int b = GETARG_B(i); \
+        int c = GETARG_C(i); \
+        Table *t = luaH_new(L); \
+        sethvalue(L, ra, t); \
+        if (b != 0 || c != 0) \
+          luaH_resize(L, t, luaO_fb2int(b), luaO_fb2int(c)); \
+        checkGC(L, ra + 1); }
+
+#define op_self()	{ \
+        StkId rb = RB(i); \
+        setobjs2s(L, ra+1, rb); \
+        gettablefield(rb, RKC(i)); }
+
+#define op_add()	intarith_op(luai_numadd, luai_intadd, TM_ADD)
+#define op_sub()	intarith_op(luai_numsub, luai_intsub, TM_SUB)
+#define op_mul()	intarith_op(luai_nummul, luai_intmul, TM_MUL)
+
+
+/* run the line and count hooks, if due, before executing `i' */
+#define vmhookcheck()	{ \
+  if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) && \
+      (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) { \
+    Protect(traceexec(L)); \
+  } }
+
+
+/*
+** LUA_USE_JUMPTABLE selects threaded dispatch: each opcode's code ends
+** by fetching the next instruction and jumping straight to its code
+** through a table of label addresses, giving every opcode an indirect
+** branch of its own to predict.  It needs the labels-as-values extension
+** of GCC and Clang; define it as 0 to use a plain `switch' instead.
+*/
+#if !defined(LUA_USE_JUMPTABLE)
+#if defined(__GNUC__)
+#define LUA_USE_JUMPTABLE	1
+#else
+#define LUA_USE_JUMPTABLE	0
+#endif
+#endif
+
+/*
+** Line and count hooks are rare outside debuggers, so the loop doesn't
+** test for them before every instruction.  Instead, `vmupdatehooks'
+** picks one of two ways of running when a closure is entered, after a
+** call to a C function returns, and on jumps (which include every
+** backward jump closing a loop); a hook set in between takes effect at
+** the next of those.  With a jump table, hooks are run by dispatching
+** every opcode through `hooktab' to L_hook; otherwise, a local flag
+** enables the check in `vmfetch'.
+*/
+#if LUA_USE_JUMPTABLE
+
+#define vmupdatehooks()  \
+  (disp = (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) ? hooktab : disptab)
+
+/* fetch the next instruction and decode its `ra' */
+#define vmfetch()	{ \
+  i = *(ci->u.l.savedpc++); \
+  ra = RA(i); \
+  lua_assert(base == ci->u.l.base); \
+  lua_assert(base <= L->top && L->top < L->stack + L->stacksize); \
+}
+
+#define vmdispatch(o)	goto *disp[o];
+#define vmcase(l,b)	L_##l: {b}  vmfetch(); vmdispatch(GET_OPCODE(i));
+#define vmcasenb(l,b)	L_##l: {b}		/* nb = no break */
+/* superinstruction `l' runs `b' and then goes straight to opcode `n' */
+#define vmfused(l,n,b)	L_##l: {b}  vmfetch(); \
+  lua_assert(luaP_baseop(GET_OPCODE(i)) == n); \
+  if (disp != disptab) goto L_hook; else goto L_##n;
+
+#else
+
+#define vmupdatehooks()  \
+  (hooked = (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) != 0)
+
+/* fetch the next instruction, run hooks for it and decode its `ra' */
+#define vmfetch()	{ \
+  i = *(ci->u.l.savedpc++); \
+  if (hooked) vmhookcheck(); \
+  /* WARNING: several calls may realloc the stack and invalidate `ra' */ \
+  ra = RA(i); \
+  lua_assert(base == ci->u.l.base); \
+  lua_assert(base <= L->top && L->top < L->stack + L->stacksize); \
+}
 
 #define vmdispatch(o)	switch(o)
 #define vmcase(l,b)	case l: {b}  break;
 #define vmcasenb(l,b)	case l: {b}		/* nb = no break */
+/* without labels to jump to, superinstructions just run their first half */
+#define vmfused(l,n,b)	case l: {b}  break;
+
+#endif
 
 void luaV_execute (lua_State *L) {
   CallInfo *ci = L->ci;
   LClosure *cl;
   TValue *k;
   StkId base;
+#if LUA_USE_JUMPTABLE
+  /* must follow the order of enum OpCode in lopcodes.h */
+  static const void *const disptab[] = {
+    &&L_OP_MOVE, &&L_OP_LOADK, &&L_OP_LOADKX, &&L_OP_LOADBOOL,
+    &&L_OP_LOADNIL, &&L_OP_GETUPVAL, &&L_OP_GETTABUP, &&L_OP_GETTABLE,
+    &&L_OP_SETTABUP, &&L_OP_SETUPVAL, &&L_OP_SETTABLE, &&L_OP_NEWTABLE,
+    &&L_OP_SELF, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV,
+    &&L_OP_MOD, &&L_OP_POW, &&L_OP_UNM, &&L_OP_NOT, &&L_OP_LEN,
+    &&L_OP_CONCAT, &&L_OP_JMP, &&L_OP_EQ, &&L_OP_LT, &&L_OP_LE,
+    &&L_OP_TEST, &&L_OP_TESTSET, &&L_OP_CALL, &&L_OP_TAILCALL,
+    &&L_OP_RETURN, &&L_OP_FORLOOP, &&L_OP_FORPREP, &&L_OP_TFORCALL,
+    &&L_OP_TFORLOOP, &&L_OP_SETLIST, &&L_OP_CLOSURE, &&L_OP_VARARG,
+    &&L_OP_EXTRAARG, &&L_OP_ADD_SETTABLE, &&L_OP_SETTABLE_FORLOOP,
+    &&L_OP_SUB_CALL, &&L_OP_GETUPVAL_SUB, &&L_OP_GETTABLE_ADD,
+    &&L_OP_LOADK_CALL, &&L_OP_SELF_LOADK, &&L_OP_NEWTABLE_SETTABLE,
+    &&L_OP_MUL_ADD, &&L_OP_SETTABLE_GETTABLE, &&L_OP_GETTABLE_GETTABLE
+  };
+#define HOOK4	&&L_hook, &&L_hook, &&L_hook, &&L_hook
+  static const void *const hooktab[] = {
+    HOOK4, HOOK4, HOOK4, HOOK4, HOOK4, HOOK4, HOOK4, HOOK4, HOOK4, HOOK4,
+    HOOK4, HOOK4, &&L_hook, &&L_hook, &&L_hook
+  };
+#undef HOOK4
+  /* a missing or extra entry would jump to the wrong opcode's code */
+  enum { disptab_check =
+      1 / (int)(sizeof(disptab) / sizeof(disptab[0]) == NUM_OPCODES &&
+                sizeof(hooktab) == sizeof(disptab)) };
+  const void *const *disp;
+#else
+  int hooked;
+#endif
  newframe:  /* reentry point when frame changes (call/return) */
   lua_assert(ci == L->ci);
   cl = clLvalue(ci->func);
   k = cl->p->k;
   base = ci->u.l.base;
+  vmupdatehooks();
   /* main loop of interpreter */
   for (;;) {
-    Instruction i = *(ci->u.l.savedpc++);
+    Instruction i;
     StkId ra;
-    if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
-        (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
-      Protect(traceexec(L));
-    }
-    /* WARNING: several calls may realloc the stack and invalidate `ra' */
-    ra = RA(i);
-    lua_assert(base == ci->u.l.base);
-    lua_assert(base <= L->top && L->top < L->stack + L->stacksize);
+    vmfetch();
     vmdispatch (GET_OPCODE(i)) {
+#if LUA_USE_JUMPTABLE
+      L_hook:  /* every opcode comes here through `hooktab' */
+        vmhookcheck();
+        /* WARNING: several calls may realloc the stack and invalidate `ra' */
+        ra = RA(i);
+        goto *disptab[GET_OPCODE(i)];
+#endif
       vmcase(OP_MOVE,
         setobjs2s(L, ra, RB(i));
       )
       vmcase(OP_LOADK,
-        TValue *rb = k + GETARG_Bx(i);
-        setobj2s(L, ra, rb);
+        op_loadk();
       )
       vmcase(OP_LOADKX,
         TValue *rb;
@@ -579,15 +900,14 @@ void luaV_execute (lua_State *L) {
         } while (b--);
       )
       vmcase(OP_GETUPVAL,
-        int b = GETARG_B(i);
-        setobj2s(L, ra, cl->upvals[b]->v);
+        op_getupval();
       )
       vmcase(OP_GETTABUP,
         int b = GETARG_B(i);
-        Protect(luaV_gettable(L, cl->upvals[b]->v, RKC(i), ra));
+        gettablefield(cl->upvals[b]->v, RKC(i));
       )
       vmcase(OP_GETTABLE,
-        Protect(luaV_gettable(L, RB(i), RKC(i), ra));
+        op_gettable();
       )
       vmcase(OP_SETTABUP,
         int a = GETARG_A(i);
@@ -599,42 +919,40 @@ void luaV_execute (lua_State *L) {
         luaC_barrier(L, uv, ra);
       )
       vmcase(OP_SETTABLE,
-        Protect(luaV_settable(L, ra, RKB(i), RKC(i)));
+        op_settable();
       )
       vmcase(OP_NEWTABLE,
-        int b = GETARG_B(i);
-        int c = GETARG_C(i);
-        Table *t = luaH_new(L);
-        sethvalue(L, ra, t);
-        if (b != 0 || c != 0)
-          luaH_resize(L, t, luaO_fb2int(b), luaO_fb2int(c));
-        checkGC(L, ra + 1);
+        op_newtable();
       )
       vmcase(OP_SELF,
-        StkId rb = RB(i);
-        setobjs2s(L, ra+1, rb);
-        Protect(luaV_gettable(L, rb, RKC(i), ra));
+        op_self();
       )
       vmcase(OP_ADD,
-        arith_op(luai_numadd, TM_ADD);
+        op_add();
       )
       vmcase(OP_SUB,
-        arith_op(luai_numsub, TM_SUB);
+        op_sub();
       )
       vmcase(OP_MUL,
-        arith_op(luai_nummul, TM_MUL);
+        op_mul();
       )
       vmcase(OP_DIV,
         arith_op(luai_numdiv, TM_DIV);
       )
       vmcase(OP_MOD,
-        arith_op(luai_nummod, TM_MOD);
+        intarith_op(luai_nummod, luai_intmod, TM_MOD);
       )
       vmcase(OP_POW,
         arith_op(luai_numpow, TM_POW);
       )
       vmcase(OP_UNM,
         TValue *rb = RB(i);
+#if defined(LUAI_INTNUM)
+        if (ttisintnum(rb) && ivalue(rb) != 0) {  /* (-0 is not an integer) */
+          setivalue(ra, -ivalue(rb));
+        }
+        else
+#endif
         if (ttisnumber(rb)) {
           lua_Number nb = nvalue(rb);
           setnvalue(ra, luai_numunm(L, nb));
@@ -677,20 +995,26 @@ void luaV_execute (lua_State *L) {
         )
       )
       vmcase(OP_LT,
-        Protect(
-          if (luaV_lessthan(L, RKB(i), RKC(i)) != GETARG_A(i))
-            ci->u.l.savedpc++;
-          else
-            donextjump(ci);
-        )
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        int res;
+        if (!intcompare(<, rb, rc, res))
+          Protect(res = luaV_lessthan(L, rb, rc));
+        if (res != GETARG_A(i))
+          ci->u.l.savedpc++;
+        else
+          donextjump(ci);
       )
       vmcase(OP_LE,
-        Protect(
-          if (luaV_lessequal(L, RKB(i), RKC(i)) != GETARG_A(i))
-            ci->u.l.savedpc++;
-          else
-            donextjump(ci);
-        )
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        int res;
+        if (!intcompare(<=, rb, rc, res))
+          Protect(res = luaV_lessequal(L, rb, rc));
+        if (res != GETARG_A(i))
+          ci->u.l.savedpc++;
+        else
+          donextjump(ci);
       )
       vmcase(OP_TEST,
         if (GETARG_C(i) ? l_isfalse(ra) : !l_isfalse(ra))
@@ -714,6 +1038,7 @@ void luaV_execute (lua_State *L) {
         if (luaD_precall(L, ra, nresults)) {  /* C function? */
           if (nresults >= 0) L->top = ci->top;  /* adjust results */
           base = ci->u.l.base;
+          vmupdatehooks();
         }
         else {  /* Lua function */
           ci = L->ci;
@@ -725,8 +1050,10 @@ void luaV_execute (lua_State *L) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         lua_assert(GETARG_C(i) - 1 == LUA_MULTRET);
-        if (luaD_precall(L, ra, LUA_MULTRET))  /* C function? */
+        if (luaD_precall(L, ra, LUA_MULTRET)) {  /* C function? */
           base = ci->u.l.base;
+          vmupdatehooks();
+        }
         else {
           /* tail call: put called frame (n) in place of caller one (o) */
           CallInfo *nci = L->ci;  /* called frame */
@@ -766,14 +1093,32 @@ void luaV_execute (lua_State *L) {
         }
       )
       vmcase(OP_FORLOOP,
-        lua_Number step = nvalue(ra+2);
-        lua_Number idx = luai_numadd(L, nvalue(ra), step); /* increment index */
-        lua_Number limit = nvalue(ra+1);
-        if (luai_numlt(L, 0, step) ? luai_numle(L, idx, limit)
-                                   : luai_numle(L, limit, idx)) {
+        int loop;  /* jump back? */
+#if defined(LUAI_INTNUM)
+        if (ttisintnum(ra) && ttisintnum(ra+1) && ttisintnum(ra+2)) {
+          LUAI_INTNUM step = ivalue(ra+2);
+          LUAI_INTNUM idx = ivalue(ra) + step;  /* both in range: no overflow */
+          LUAI_INTNUM limit = ivalue(ra+1);
+          if ((loop = (0 < step ? idx <= limit : limit <= idx))) {
+            setivalue(ra, idx);  /* update internal index... */
+            setivalue(ra+3, idx);  /* ...and external index */
+          }
+        }
+        else
+#endif
+        {
+          lua_Number step = nvalue(ra+2);
+          lua_Number idx = luai_numadd(L, nvalue(ra), step); /* increment index */
+          lua_Number limit = nvalue(ra+1);
+          if ((loop = (luai_numlt(L, 0, step) ? luai_numle(L, idx, limit)
+                                              : luai_numle(L, limit, idx)))) {
+            setnvalue(ra, idx);  /* update internal index... */
+            setnvalue(ra+3, idx);  /* ...and external index */
+          }
+        }
+        if (loop) {
           ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
-          setnvalue(ra, idx);  /* update internal index... */
-          setnvalue(ra+3, idx);  /* ...and external index */
+          vmupdatehooks();
         }
       )
       vmcase(OP_FORPREP,
@@ -786,7 +1131,8 @@ void luaV_execute (lua_State *L) {
           luaG_runerror(L, LUA_QL("for") " limit must be a number");
         else if (!tonumber(pstep, ra+2))
           luaG_runerror(L, LUA_QL("for") " step must be a number");
-        setnvalue(ra, luai_numsub(L, nvalue(ra), nvalue(pstep)));
+        if (!forprepint(ra))
+          setnvalue(ra, luai_numsub(L, nvalue(ra), nvalue(pstep)));
         ci->u.l.savedpc += GETARG_sBx(i);
       )
       vmcasenb(OP_TFORCALL,
@@ -807,6 +1153,7 @@ void luaV_execute (lua_State *L) {
         if (!ttisnil(ra + 1)) {  /* continue loop? */
           setobjs2s(L, ra, ra + 1);  /* save control variable */
            ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
+           vmupdatehooks();
         }
       )
       vmcase(OP_SETLIST,
@@ -862,6 +1209,40 @@ void luaV_execute (lua_State *L) {
       vmcase(OP_EXTRAARG,
         lua_assert(0);
       )
+      /* superinstructions: the first opcode's code, as above */
+      vmfused(OP_ADD_SETTABLE, OP_SETTABLE,
+        op_add();
+      )
+      vmfused(OP_SETTABLE_FORLOOP, OP_FORLOOP,
+        op_settable();
+      )
+      vmfused(OP_SUB_CALL, OP_CALL,
+        op_sub();
+      )
+      vmfused(OP_GETUPVAL_SUB, OP_SUB,
+        op_getupval();
+      )
+      vmfused(OP_GETTABLE_ADD, OP_ADD,
+        op_gettable();
+      )
+      vmfused(OP_LOADK_CALL, OP_CALL,
+        op_loadk();
+      )
+      vmfused(OP_SELF_LOADK, OP_LOADK,
+        op_self();
+      )
+      vmfused(OP_NEWTABLE_SETTABLE, OP_SETTABLE,
+        op_newtable();
+      )
+      vmfused(OP_MUL_ADD, OP_ADD,
+        op_mul();
+      )
+      vmfused(OP_SETTABLE_GETTABLE, OP_GETTABLE,
+        op_settable();
+      )
+      vmfused(OP_GETTABLE_GETTABLE, OP_GETTABLE,
+        op_gettable();
+      )
     }
   }
 }